@@ -4,6 +4,9 @@
 #include <string.h>
 
 #define PIPE_BUFFER_SIZE (128 * 1024 * 1024)
+#define SHM_SLOT_COUNT   4
+// a 4K I420 frame plus room for line padding of decoder frames
+#define SHM_SLOT_SIZE    (3840 * 2160 * 3 / 2 + 256 * 1024)
 
 enum class AVCmdType : uint8_t {
   Unknown = 0,
@@ -25,6 +28,43 @@ enum class AVCmdType : uint8_t {
   KeepAlive,
 
   StopService,
+
+  // size carries the window, the Ack the window the service accepted. It
+  // bounds every request queued on a session (Encode/Decode, Flush,
+  // SetBitrate, ForceKeyframe, SetResolution, SetSink), past it they Nack.
+  SetPipeline,
+
+  ReleaseFrame,  // size carries the AVFramePlanes::frameId
+
+  // Encoder reconfiguration, applied in order with queued frames. Packets
+  // drained by a codec reopen are returned by the next GetPacket.
+  SetBitrate,     // rate
+  ForceKeyframe,  // next frame is encoded as IDR
+  SetResolution,  // init.width/init.height, following frames use the new size
+
+  // Decoder chained into an encoder inside the service. init describes the
+  // encoder, the AVInitExt source fields the decoder. Takes Decode payloads
+  // and returns GetPacket output, decoded frames never leave the service.
+  OpenTranscoder,
+
+  // Encoded output goes to a sink in the service instead of GetPacket. The
+  // payload is an AVSinkInfo followed by the sink path, an AVSinkType::Fd
+  // sink passes its descriptor over the socket right after it. Pipelined
+  // sessions report progress with GetSinkStatus replies.
+  SetSink,
+  GetSinkStatus,  // replies with an AVSinkStatus payload
+
+  // Muxed encoders (AVInitExt::container): the oldest complete segment, an
+  // AVSegmentInfo followed by the segment bytes. GetPacket returns all
+  // complete segments as such records.
+  GetSegment,
+
+  // Replies with one AVCodecCaps record per probed encoder and decoder,
+  // including the ones that failed to open.
+  GetCapabilities,
+
+  // Replies with an AVServiceStats payload, counted since the service started.
+  GetStats,
 };
 
 enum class AVCmdResult : uint8_t {
@@ -32,20 +72,310 @@ enum class AVCmdResult : uint8_t {
   Nack,
 };
 
+// AVInitInfo::flags
+enum AVInitFlag : uint32_t {
+  // Decoder keeps its frames referenced instead of repacking them to I420.
+  // GetFrame replies with an AVFramePlanes descriptor followed by the planes
+  // at their native line size, the frame is held until ReleaseFrame. At most
+  // 16 frames are held, GetFrame Nacks until one is released and pipelined
+  // sessions resume sending frames once one is. A frame that cannot be
+  // described is dropped and answered with a GetFrame Nack.
+  AVInitFlagFrameRefs = 1 << 0,
+  // GetPacket returns one AVPacketInfo header per packet, each followed by
+  // the packet bytes, instead of the bare concatenated stream.
+  AVInitFlagPacketInfo = 1 << 1,
+  // Encode/Decode carry the pts of their payload in AVCmd::payload.pts, in
+  // units of 1/fps. Without it the service numbers frames itself.
+  AVInitFlagClientPts = 1 << 2,
+  // Decoder only: every Decode payload is one complete access unit and goes
+  // to the codec as is, without the bitstream parser.
+  AVInitFlagFramedInput = 1 << 3,
+  // Decoder only: decodes the media file AVInitExt::sourcePath, mapped and
+  // demuxed inside the service. Decode takes no payload and outputs at least
+  // one frame, or the last ones at the end of the file; after that it
+  // replies Nack. Flush ends the stream early. codecName may be empty to
+  // pick the decoder from the file's video stream.
+  AVInitFlagFileInput = 1 << 4,
+};
+
+enum AVPacketFlag : uint16_t {
+  AVPacketFlagKey = 1 << 0,
+};
+
+#define AV_FRAME_MAX_PLANES 4
+
+// AVInitInfo::format, layout of Encode input and GetFrame output. Planes are
+// tightly packed, the service converts to and from the codec's I420.
+enum class AVRawFormat : uint8_t {
+  I420 = 0,
+  NV12,
+  BGRA,
+  RGBA,
+};
+
+enum class AVThreadType : uint8_t {
+  Default = 0,
+  Frame,
+  Slice,
+  FrameAndSlice,
+};
+
+enum class AVRateControl : uint8_t {
+  Default = 0,
+  CBR,
+  VBR,
+  CRF,
+};
+
+// AVInitExt::decodeProfile. Explicit thread settings override the profile's.
+enum class AVDecodeProfile : uint8_t {
+  Default = 0,
+  Throughput,   // frame and slice threads on all cores, batch work
+  LowLatency,   // slice threads only, frames leave as soon as decoded
+  Fast,         // no deblocking, non-reference frames skipped, previews
+};
+
+// AVInitExt::skipFrames, frames the decoder does not output at all.
+enum class AVSkipFrames : uint8_t {
+  Default = 0,
+  NonRef,       // drop frames no other frame references
+  NonKey,       // keyframes only, for thumbnails and scrubbing
+};
+
+enum class AVSinkType : uint8_t {
+  None = 0,     // closes the sink, GetPacket returns the output again
+  File,         // path of a file to create
+  Fd,           // descriptor handed over with the command, local sockets only
+  Socket,       // path of a listening local socket (named pipe on Windows)
+};
+
+enum AVSinkFlag : uint8_t {
+  AVSinkFlagAppend = 1 << 0,   // File: append instead of truncating
+  AVSinkFlagDirect = 1 << 1,   // File: bypass the page cache (O_DIRECT)
+};
+
+// AVInitExt::container
+enum class AVContainer : uint8_t {
+  None = 0,     // bare Annex-B packets
+  FMP4,         // CMAF fragments after an init segment (ftyp, moov)
+  MPEGTS,       // transport stream segments, each opening with PAT/PMT
+};
+
+enum AVSegmentFlag : uint16_t {
+  AVSegmentFlagInit = 1 << 0,   // fMP4 init segment, ahead of all media segments
+  AVSegmentFlagLast = 1 << 1,   // closed by Flush
+};
+
+enum AVCapsFlag : uint8_t {
+  AVCapsFlagEncoder  = 1 << 0,
+  AVCapsFlagHardware = 1 << 1,   // the codec has a hardware config
+  AVCapsFlagOpens    = 1 << 2,   // a probe context opened, sessions may use it
+};
+
+#define AV_CAPS_MAX_PIX_FMTS 8
+
+// AVServiceStats::latency index, where a frame's time goes in the service.
+enum class AVStatLatency : uint8_t {
+  SocketRead = 0,   // Encode/Decode payloads read from the client
+  CodecSend,        // avcodec_send_frame/avcodec_send_packet
+  CodecReceive,     // avcodec_receive_packet/avcodec_receive_frame
+  Convert,          // pixel format conversion and copies into codec frames
+  SocketWrite,      // GetPacket/GetFrame/GetSegment payloads written out
+  Count,
+};
+
+#define AV_STATS_VERSION 1
+#define AV_DOWNSCALE_MAX     3
+#define AV_MAX_RENDITIONS    8
+#define AV_INIT_EXT_VERSION  8
+#define AV_SOURCE_PATH_SIZE  256
+#define AV_INIT_EXT_MAX_SIZE (64 * 1024)
+
 #pragma pack(push, 1)
+// One rung of an ABR ladder, see AVInitExt::renditions.
+typedef struct {
+  uint16_t width;
+  uint16_t height;
+  uint32_t bps;
+} AVRendition;
+
 typedef struct {
   uint32_t bps;
   uint16_t width;
   uint16_t height;
   uint8_t  fps;
   char codecName[30];
+  uint32_t flags;
+  AVRawFormat format;
+  uint32_t extSize;    // size of the AVInitExt block following the command
 } AVInitInfo;
 
+// Optional codec settings sent right after OpenEncoder/OpenDecoder. Readers
+// take 'headerSize' bytes of header, so fields appended in later versions
+// must treat 0 as "encoder default". 'key\0value\0' pairs for av_opt_set
+// follow the header up to AVInitInfo::extSize.
+typedef struct {
+  uint16_t      version;
+  uint16_t      headerSize;
+  AVThreadType  threadType;
+  uint8_t       threadCount;   // 0 lets libavcodec decide
+  AVRateControl rateControl;
+  int8_t        bframes;       // -1 keeps the encoder default
+  int32_t       gop;           // 0 keeps the encoder default
+  uint32_t      maxrate;
+  uint32_t      bufsize;
+  uint8_t       crf;
+  char          preset[16];
+  char          tune[16];
+  AVDecodeProfile decodeProfile;  // version 2
+  AVSkipFrames  skipFrames;    // version 3
+  uint8_t       downscale;     // version 3, decoder output divided by 2^downscale, rounded up
+  char          sourceCodec[30];  // version 4, OpenTranscoder decoder name
+  uint16_t      sourceWidth;      // version 4, OpenTranscoder input size
+  uint16_t      sourceHeight;
+  // version 5. OpenEncoder with renditions encodes every Encode frame at
+  // each rung, scaled in the service. GetPacket then always returns
+  // AVPacketInfo records, 'stream' holding the rendition index.
+  uint8_t       renditionCount;
+  AVRendition   renditions[AV_MAX_RENDITIONS];
+  // version 6. OpenEncoder with chunkFrames encodes offline: every chunk of
+  // that many frames starts with an IDR and goes to one of chunkEncoders
+  // parallel encoders (0 picks from the core count). Packets come back in
+  // order, a chunk at a time, so GetPacket lags the input by up to
+  // chunkEncoders chunks. Chunks are encoded without B-frames, 'bframes' is
+  // ignored, so dts keeps increasing across chunk boundaries.
+  uint16_t      chunkFrames;
+  uint8_t       chunkEncoders;
+  // version 7. OpenEncoder with a container muxes the output in the service.
+  // renditions, chunkFrames and container exclude each other, OpenEncoder
+  // Nacks when more than one is set.
+  // Segments start at the first keyframe after segmentMs of media, or at
+  // every keyframe for 0. A sink receives the segments back to back.
+  AVContainer   container;
+  uint32_t      segmentMs;
+  char          sourcePath[AV_SOURCE_PATH_SIZE];  // version 8, AVInitFlagFileInput
+} AVInitExt;
+
+// Leads a GetFrame payload of an AVInitFlagFrameRefs decoder. Plane offsets
+// count from the start of the payload, i.e. include this descriptor.
+typedef struct {
+  uint32_t frameId;
+  int32_t  format;     // AVPixelFormat
+  uint16_t width;
+  uint16_t height;
+  int64_t  pts;
+  uint8_t  planes;
+  uint32_t linesize[AV_FRAME_MAX_PLANES];
+  uint32_t offset[AV_FRAME_MAX_PLANES];
+  uint32_t size[AV_FRAME_MAX_PLANES];
+} AVFramePlanes;
+
+// GetCapabilities record. Names are the ones GetEncoderName/GetDecoderName
+// return and OpenEncoder/OpenDecoder accept.
+typedef struct {
+  char     name[30];
+  uint8_t  flags;       // AVCapsFlag
+  uint16_t maxWidth;    // largest probed encoder size that opened, 0 if unknown
+  uint16_t maxHeight;
+  uint8_t  pixFmtCount;
+  int32_t  pixFmts[AV_CAPS_MAX_PIX_FMTS];  // AVPixelFormat, as the codec lists them
+} AVCodecCaps;
+
+// Durations of one AVStatLatency stage. Percentiles are read from a
+// log-linear histogram and are within 1/8 of the true value.
+typedef struct {
+  uint64_t count;
+  uint64_t totalNs;
+  uint64_t maxNs;
+  uint64_t p50Ns;
+  uint64_t p90Ns;
+  uint64_t p99Ns;
+  uint64_t p999Ns;
+} AVLatencyStats;
+
+// GetStats payload. Readers take 'headerSize' bytes, fields are only appended.
+typedef struct {
+  uint16_t version;
+  uint16_t headerSize;
+  uint64_t uptimeMs;
+  uint64_t commands;
+  uint64_t bytesIn;       // Encode/Decode payload bytes
+  uint64_t bytesOut;      // GetPacket/GetFrame/GetSegment payload bytes
+  uint64_t framesIn;      // raw frames sent to encoders
+  uint64_t framesOut;     // frames received from decoders
+  uint64_t packetsIn;     // packets sent to decoders
+  uint64_t packetsOut;    // packets received from encoders
+  uint32_t sessions;
+  uint32_t queueDepth;    // jobs waiting for or running on codec threads
+  uint32_t maxQueueDepth;
+  AVLatencyStats latency[(int)AVStatLatency::Count];
+} AVServiceStats;
+
+// SetSink payload header, the path follows without terminator.
+typedef struct {
+  AVSinkType type;
+  uint8_t    flags;       // AVSinkFlag
+  uint32_t   batchSize;   // bytes gathered per write, 0 writes every output
+} AVSinkInfo;
+
+typedef struct {
+  uint64_t bytes;         // encoded bytes handed to the sink
+  uint64_t written;       // of those, bytes already written out
+  uint32_t outputs;       // jobs that produced output
+  int32_t  error;         // errno of the first failed write, 0 if none
+} AVSinkStatus;
+
+// Encode/Decode arguments, 'size' aliases AVCmd::size.
+typedef struct {
+  size_t  size;
+  int64_t pts;
+} AVPayloadInfo;
+
+typedef struct {
+  int64_t  pts;
+  int64_t  dts;
+  uint32_t size;      // packet bytes following this header
+  uint16_t flags;     // AVPacketFlag
+  uint16_t stream;    // output index, 0 for single output sessions
+} AVPacketInfo;
+
+typedef struct {
+  uint32_t size;      // segment bytes following this header
+  uint32_t sequence;  // media segment number from 0, an init segment has the next one's
+  int64_t  pts;       // first frame, in units of 1/fps
+  int64_t  duration;  // in units of 1/fps, 0 for an init segment
+  uint16_t flags;     // AVSegmentFlag
+} AVSegmentInfo;
+
+typedef struct {
+  uint32_t bps;
+  uint32_t maxrate;   // 0 keeps the current value
+  uint32_t bufsize;   // 0 keeps the current value
+} AVRateInfo;
+
+// 'session' addresses the handle returned by OpenEncoder/OpenDecoder, 0 means
+// the session opened last on this connection.
 typedef struct {
   AVCmdType type;
+  uint32_t  session;
+  uint32_t  requestId;
+  uint32_t  seq;
   union {
     AVInitInfo init;
+    AVRateInfo rate;
+    AVPayloadInfo payload;
     size_t size;
   };
 } AVCmd;
+
+// Reply header used once SetPipeline enabled a request window. It carries the
+// id and sequence number of the request it belongs to, and 'type' tells the
+// completion of that request apart from GetPacket/GetFrame outputs it produced.
+typedef struct {
+  AVCmdResult result;
+  AVCmdType   type;
+  uint32_t    requestId;
+  uint32_t    seq;
+  size_t      size;
+} AVCmdReply;
 #pragma pack(pop)
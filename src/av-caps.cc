@@ -0,0 +1,269 @@
+#include <plog/Log.h>
+#include "av.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixfmt.h>
+#if defined (__cplusplus)
+}
+#endif
+
+#define CAPS_FILE_MAGIC   0x5350434c   // "LCPS"
+#define CAPS_FILE_VERSION 1
+
+// Encoder sizes probed in order, the last one that opens is reported.
+static const struct { uint16_t width, height; } capsProbeSizes[] = {
+  { 640, 360 }, { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 },
+};
+
+// Identifies the libav build and the host the probe results are valid for.
+static std::string capsKey() {
+  char host[256] = {};
+#ifdef _WIN32
+  DWORD hostSize = sizeof(host);
+  GetComputerNameA(host, &hostSize);
+#else
+  gethostname(host, sizeof(host) - 1);
+#endif
+  std::stringstream ss;
+  ss << CAPS_FILE_VERSION << '|' << host << '|' << avcodec_version() << '|' << avcodec_configuration();
+  return ss.str();
+}
+
+#ifndef _WIN32
+// The directory if it exists or was created, is ours and closed to others.
+static bool privateDir(const std::string &dir) {
+  if (::mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+    return false;
+  }
+  struct stat st;
+  return ::lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+         !(st.st_mode & (S_IRWXG | S_IRWXO));
+}
+#endif
+
+// Per user: $XDG_CACHE_HOME/libav-node, ~/.cache/libav-node, or else a 0700
+// directory named with the uid in /tmp. Empty if none is safe to use.
+static std::string capsDir() {
+#ifdef _WIN32
+  char tmp[MAX_PATH + 1] = {};
+  GetTempPathA(sizeof(tmp), tmp);   // already per user
+  return tmp;
+#else
+  std::string base;
+  if (auto xdg = getenv("XDG_CACHE_HOME"); xdg && xdg[0] == '/') {
+    base = xdg;
+  } else if (auto home = getenv("HOME"); home && home[0] == '/') {
+    base = std::string(home) + "/.cache";
+  }
+  if (base.length()) ::mkdir(base.c_str(), 0700);
+  if (base.length() && privateDir(base + "/libav-node")) {
+    return base + "/libav-node/";
+  }
+
+  auto dir = "/tmp/libav-node-" + std::to_string(getuid());
+  if (privateDir(dir)) {
+    return dir + "/";
+  }
+  LOG_ERROR << "[CAPS] No private directory for the capability cache";
+  return "";
+#endif
+}
+
+static std::string capsPath(const std::string &key) {
+  auto dir = capsDir();
+  if (dir.empty()) {
+    return "";
+  }
+  std::stringstream ss;
+  ss << dir << "libav-node-caps-" << std::hex << std::hash<std::string>()(key) << ".bin";
+  return ss.str();
+}
+
+static bool loadCaps(const std::string &path, const std::string &key, std::vector<AVCodecCaps> &caps) {
+#ifdef _WIN32
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  long long fileSize = _ftelli64(f);
+  fseek(f, 0, SEEK_SET);
+#else
+  // only a regular file of ours that nobody else can write
+  int fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    LOG_ERROR << "[CAPS] Ignoring " << path << ", not a private file";
+    ::close(fd);
+    return false;
+  }
+  long long fileSize = st.st_size;
+  FILE *f = fdopen(fd, "rb");
+  if (!f) {
+    ::close(fd);
+    return false;
+  }
+#endif
+
+  uint32_t header[3] = {};
+  std::string fileKey;
+  uint32_t count = 0;
+  bool ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == CAPS_FILE_MAGIC &&
+            header[1] == CAPS_FILE_VERSION && header[2] == key.size();
+  if (ok) {
+    fileKey.resize(header[2]);
+    ok = fread(fileKey.data(), 1, fileKey.size(), f) == fileKey.size() && fileKey == key &&
+         fread(&count, sizeof(count), 1, f) == 1;
+  }
+  // the records must fill the rest of the file exactly
+  ok = ok && fileSize == (long long)(sizeof(header) + key.size() + sizeof(count)) + (long long)count * sizeof(AVCodecCaps);
+  if (ok) {
+    caps.resize(count);
+    ok = !count || fread(caps.data(), sizeof(AVCodecCaps), count, f) == count;
+  }
+  fclose(f);
+
+  if (!ok) caps.clear();
+  return ok;
+}
+
+static void saveCaps(const std::string &path, const std::string &key, const std::vector<AVCodecCaps> &caps) {
+  // written aside and renamed, services starting together never read half a file
+#ifdef _WIN32
+  std::string tmpPath = path + "." + std::to_string(GetCurrentProcessId());
+  FILE *f = fopen(tmpPath.c_str(), "wb");
+#else
+  std::string tmpPath = path + "." + std::to_string(getpid());
+  ::unlink(tmpPath.c_str());
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  FILE *f = (fd >= 0) ? fdopen(fd, "wb") : nullptr;
+  if (!f && fd >= 0) ::close(fd);
+#endif
+  if (!f) {
+    LOG_ERROR << "[CAPS] Could not create " << tmpPath;
+    return;
+  }
+
+  uint32_t header[3] = { CAPS_FILE_MAGIC, CAPS_FILE_VERSION, (uint32_t)key.size() };
+  uint32_t count = (uint32_t)caps.size();
+  bool ok = fwrite(header, sizeof(header), 1, f) == 1 && fwrite(key.data(), 1, key.size(), f) == key.size() &&
+            fwrite(&count, sizeof(count), 1, f) == 1 &&
+            (!count || fwrite(caps.data(), sizeof(AVCodecCaps), count, f) == count);
+  ok = fclose(f) == 0 && ok;
+
+#ifdef _WIN32
+  ok = ok && MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  ok = ok && rename(tmpPath.c_str(), path.c_str()) == 0;
+#endif
+  if (!ok) {
+    LOG_ERROR << "[CAPS] Could not write " << path;
+    std::remove(tmpPath.c_str());
+  }
+}
+
+static bool probeOpen(const AVCodec *codec, int width, int height) {
+  auto ctx = avcodec_alloc_context3(codec);
+  if (!ctx) {
+    return false;
+  }
+
+  if (av_codec_is_encoder(codec)) {
+    ctx->width = width;
+    ctx->height = height;
+    ctx->bit_rate = 2000000;
+    ctx->time_base = { 1, 30 };
+    ctx->framerate = { 30, 1 };
+    ctx->gop_size = 10;
+    ctx->max_b_frames = 0;
+    ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  }
+
+  bool ok = avcodec_open2(ctx, codec, NULL) >= 0;
+  avcodec_free_context(&ctx);
+  return ok;
+}
+
+static AVCodecCaps probeCoder(const std::string &name, bool encoder) {
+  AVCodecCaps caps;
+  memset(&caps, 0, sizeof(caps));
+  strncpy(caps.name, name.c_str(), sizeof(caps.name) - 1);
+  if (encoder) caps.flags |= AVCapsFlagEncoder;
+
+  const char *tmpName = name.c_str();
+  if (name.find("sw-") == 0 || name.find("hw-") == 0) {
+    tmpName += 3;
+  }
+  auto codec = (encoder) ? avcodec_find_encoder_by_name(tmpName) : avcodec_find_decoder_by_name(tmpName);
+  if (!codec) {
+    return caps;
+  }
+  if (avcodec_get_hw_config(codec, 0)) caps.flags |= AVCapsFlagHardware;
+
+  if (codec->pix_fmts) {
+    for (auto fmt = codec->pix_fmts; *fmt != AV_PIX_FMT_NONE && caps.pixFmtCount < AV_CAPS_MAX_PIX_FMTS; fmt++) {
+      caps.pixFmts[caps.pixFmtCount++] = *fmt;
+    }
+  }
+
+  if (!encoder) {
+    if (probeOpen(codec, 0, 0)) caps.flags |= AVCapsFlagOpens;
+    return caps;
+  }
+
+  // sessions always feed encoders I420
+  for (auto &size : capsProbeSizes) {
+    if (!probeOpen(codec, size.width, size.height)) break;
+    caps.flags |= AVCapsFlagOpens;
+    caps.maxWidth = size.width;
+    caps.maxHeight = size.height;
+  }
+  return caps;
+}
+
+std::vector<AVCodecCaps> IAVEnc::getCapabilities(bool refresh) {
+  std::vector<AVCodecCaps> caps;
+  auto key = capsKey();
+  auto path = capsPath(key);
+  if (!refresh && path.length() && loadCaps(path, key, caps)) {
+    LOG_INFO << "[CAPS] Loaded " << caps.size() << " coders from " << path;
+    return caps;
+  }
+
+  for (auto &name : getEncoders()) {
+    caps.push_back(probeCoder(name, true));
+  }
+  for (auto &name : getDecoders()) {
+    caps.push_back(probeCoder(name, false));
+  }
+  for (auto &c : caps) {
+    if (!(c.flags & AVCapsFlagOpens)) LOG_INFO << "[CAPS] " << c.name << " fails to open";
+    else if (c.maxWidth) LOG_INFO << "[CAPS] " << c.name << " opens up to " << c.maxWidth << "x" << c.maxHeight;
+    else LOG_INFO << "[CAPS] " << c.name << " opens";
+  }
+
+  if (path.length()) saveCaps(path, key, caps);
+  return caps;
+}
@@ -0,0 +1,248 @@
+#include <plog/Log.h>
+#include "av.h"
+#include "pixconv.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+#include <libavutil/avutil.h>
+#if defined (__cplusplus)
+}
+#endif
+
+// A run of frames encoded by a fresh encoder, so it opens with an IDR and
+// references nothing outside itself.
+struct AVChunk {
+  uint64_t index = 0;
+  DoubleArray frames;
+  std::vector<int64_t> pts;
+  std::vector<size_t> keyframes;   // forced IDRs inside the chunk
+  SingleArray packets;
+  bool done = false;
+  bool result = false;
+};
+typedef std::shared_ptr<AVChunk> Chunk;
+
+// Offline encoder running one encoder instance per chunk on a pool of
+// threads. All instances share the same settings, so their parameter sets
+// are identical and the chunks concatenate into one valid stream, without
+// B-frames so timestamps stay monotonic across chunks. Up to
+// 'maxPending' chunks of raw frames are held while they encode.
+class AVChunkedEncoder : public IAVEnc {
+public:
+  ~AVChunkedEncoder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : workers) {
+      if (t.joinable()) t.join();
+    }
+  }
+
+  std::string name;
+  int width = 0, height = 0;
+  int fps = 0, bitrate = 0;
+  uint32_t flags = 0;
+  AVRawFormat inputFormat = AVRawFormat::I420;
+  AVEncodeParams chunkParams;
+  size_t chunkFrames = 0;
+  size_t maxPending = 0;
+
+  int64_t frameIdx = 0;
+  int64_t nextPts = AV_NOPTS_VALUE;
+  bool keyframeRequested = false;
+  uint64_t nextIndex = 0;
+  Chunk current;
+
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  std::deque<Chunk> pending;   // submitted chunks, in stream order
+  std::deque<Chunk> jobs;      // submitted chunks no worker has taken yet
+  std::vector<std::thread> workers;
+  bool stopping = false;
+
+  bool init(const std::string &_name, int _width, int _height, int _fps, int bps, uint32_t _flags,
+            AVRawFormat format, const AVEncodeParams &params) {
+    if (params.chunkFrames <= 0) {
+      return false;
+    }
+    name = _name;
+    width = _width;
+    height = _height;
+    fps = _fps;
+    bitrate = bps;
+    flags = _flags;
+    inputFormat = format;
+    chunkFrames = params.chunkFrames;
+
+    int cores = std::max(1, (int)std::thread::hardware_concurrency());
+    int encoders = params.chunkEncoders ? params.chunkEncoders : std::max(1, cores / 4);
+    chunkParams = params;
+    chunkParams.chunkFrames = 0;
+    chunkParams.chunkEncoders = 0;
+    if (!chunkParams.threadCount) chunkParams.threadCount = std::max(1, cores / encoders);
+    // each chunk restarts its dts below its first pts by the reorder delay,
+    // which would step back behind the previous chunk's last packet
+    if (chunkParams.bframes > 0) LOG_INFO << "[CHK] B-frames disabled for chunked encoding";
+    chunkParams.bframes = 0;
+    // one IDR per chunk unless the client wants shorter GOPs
+    if (chunkParams.gop <= 0 || chunkParams.gop > params.chunkFrames) chunkParams.gop = params.chunkFrames;
+
+    // settings errors surface at OpenEncoder, not at the first chunk
+    auto probe = createEncoder(name, width, height, fps, bitrate, flags, inputFormat, chunkParams);
+    if (!probe) {
+      return false;
+    }
+    codecName = probe->getName();
+
+    maxPending = encoders;
+    for (int i = 0; i < encoders; i++) {
+      workers.emplace_back(&AVChunkedEncoder::run, this);
+    }
+    LOG_INFO << "[CHK] Chunked encoder opened: " << codecName << ", " << encoders << " encoders x " <<
+                chunkParams.threadCount << " threads, " << chunkFrames << " frames per chunk";
+    return true;
+  }
+
+  void run() {
+    while (1) {
+      Chunk chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stopping || !jobs.empty(); });
+        if (stopping) return;
+        chunk = jobs.front();
+        jobs.pop_front();
+      }
+
+      chunk->result = encodeChunk(*chunk);
+      chunk->frames.clear();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        chunk->done = true;
+      }
+      done.notify_all();
+    }
+  }
+
+  bool encodeChunk(AVChunk &chunk) {
+    auto enc = createEncoder(name, width, height, fps, bitrate, flags, inputFormat, chunkParams);
+    if (!enc) {
+      return false;
+    }
+
+    size_t key = 0;
+    for (size_t i = 0; i < chunk.frames.size(); i++) {
+      if (key < chunk.keyframes.size() && chunk.keyframes[key] == i) {
+        enc->forceKeyframe();
+        key++;
+      }
+      enc->setNextPts(chunk.pts[i]);
+      DoubleArray frame;
+      frame.push_back(std::move(chunk.frames[i]));
+      if (!enc->process(&frame, &chunk.packets)) {
+        return false;
+      }
+    }
+    return enc->process(nullptr, &chunk.packets);
+  }
+
+  // Appends finished chunks from the head of the queue, waiting for
+  // unfinished ones while more than 'keep' chunks are pending.
+  bool emit(SingleArray *packetData, size_t keep) {
+    bool ret = true;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!pending.empty()) {
+      auto chunk = pending.front();
+      if (!chunk->done) {
+        if (pending.size() <= keep) break;
+        done.wait(lock, [&]() { return chunk->done; });
+      }
+      pending.pop_front();
+      if (!chunk->result) {
+        LOG_ERROR << "[CHK] Chunk " << chunk->index << " failed";
+        ret = false;
+      }
+      if (packetData) packetData->append(chunk->packets.data(), chunk->packets.size());
+    }
+    return ret;
+  }
+
+  bool submit(SingleArray *packetData) {
+    bool ret = emit(packetData, maxPending - 1);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.push_back(current);
+      jobs.push_back(current);
+    }
+    wake.notify_one();
+    current = nullptr;
+    return ret;
+  }
+
+  bool process(DoubleArray *frameData, SingleArray *packetData) override {
+    if (!frameData) {
+      bool ret = !current || submit(packetData);
+      return emit(packetData, 0) && ret;
+    }
+
+    bool ret = true;
+    for (auto &data : *frameData) {
+      if (data.size() < rawFrameSize(inputFormat, width, height)) {
+        LOG_ERROR << "[CHK] Frame data too small: " << data.size();
+        ret = false;
+        break;
+      }
+      if (!current) {
+        current = std::make_shared<AVChunk>();
+        current->index = nextIndex++;
+      }
+      if (keyframeRequested) current->keyframes.push_back(current->frames.size());
+      keyframeRequested = false;
+      current->pts.push_back((nextPts != AV_NOPTS_VALUE) ? nextPts : frameIdx);
+      nextPts = AV_NOPTS_VALUE;
+      frameIdx++;
+      current->frames.push_back(std::move(data));
+      if (current->frames.size() == chunkFrames && !submit(packetData)) {
+        ret = false;
+      }
+    }
+    frameData->clear();
+    return emit(packetData, SIZE_MAX) && ret;
+  }
+
+  void setNextPts(int64_t pts) override {
+    nextPts = pts;
+  }
+
+  bool forceKeyframe() override {
+    keyframeRequested = true;
+    return true;
+  }
+
+  bool isEncoder() const override { return true; }
+};
+
+AVEnc IAVEnc::createChunked(const std::string &name, int width, int height, int fps, int bps, uint32_t flags,
+                            AVRawFormat format, const AVEncodeParams &params) {
+  auto enc = std::make_shared<AVChunkedEncoder>();
+  if (!enc) {
+    return nullptr;
+  }
+
+  if (!enc->init(name, width, height, fps, bps, flags, format, params)) {
+    return nullptr;
+  }
+
+  return enc;
+}
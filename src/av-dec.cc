@@ -1,5 +1,9 @@
 #include <plog/Log.h>
 #include "av.h"
+#include "pixconv.h"
+#include "stats.h"
+#include <deque>
+#include <memory>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -12,6 +16,8 @@ extern "C" {
 #include <libavutil/error.h>
 #include <libavutil/opt.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
 #if defined (__cplusplus)
 }
 #endif
@@ -31,10 +37,25 @@ public:
   AVFrame *frame = nullptr;
   AVPacket *pkt = nullptr;
 
-  bool init(const std::string &name, int width, int height) {
+  bool frameRefs = false;
+  bool framedInput = false;
+  int downscale = 0;        // done by the service when the codec has no lowres
+  SingleArray scaled;
+  int64_t nextPts = AV_NOPTS_VALUE;
+  std::deque<FrameRef> frames;
+  AVRawFormat outputFormat = AVRawFormat::I420;
+  PixelConvFunc convert = nullptr;
+
+  bool init(const std::string &name, int width, int height, uint32_t flags, AVRawFormat format,
+            const AVEncodeParams &params) {
     if (width <= 0 || height <= 0 || (width & 2) || (height % 2)) {
       return false;
     }
+    outputFormat = format;
+    convert = getPixelConverter(AVRawFormat::I420, format);
+    if (!convert) {
+      return false;
+    }
     const char *tmpName = name.c_str();
     if (name.find("sw-") == 0 || name.find("hw-") == 0) {
       tmpName += 3;
@@ -46,10 +67,13 @@ public:
       return false;
     }
 
-    parser = av_parser_init(codec->id);
-    if (!parser) {
-      LOG_ERROR << "[DEC] parser not found";
-      return false;
+    framedInput = (flags & AVInitFlagFramedInput) != 0;
+    if (!framedInput) {
+      parser = av_parser_init(codec->id);
+      if (!parser) {
+        LOG_ERROR << "[DEC] parser not found";
+        return false;
+      }
     }
 
     ctx = avcodec_alloc_context3(codec);
@@ -72,6 +96,11 @@ public:
 
     ctx->opaque = this;
 
+    if (!applyParams(codec, params)) {
+      deinit();
+      return false;
+    }
+
     char errstr[256];
     auto ret = avcodec_open2(ctx, codec, NULL);
     if (ret < 0) {
@@ -86,9 +115,70 @@ public:
       return false;
     }
 
+    frameRefs = (flags & AVInitFlagFrameRefs) != 0;
     codecName = codec->name;
-    LOG_INFO << "[DEC] Decoder opened: " << codec->name;
+    LOG_INFO << "[DEC] Decoder opened: " << codec->name << ", threads " << ctx->thread_count <<
+                ", output " <<
+                (frameRefs ? "frame refs" : rawFormatName(outputFormat)) <<
+                (framedInput ? ", framed input" : "") <<
+                (downscale ? ", box downscale" : ctx->lowres ? ", lowres" : "");
+
+    return true;
+  }
+
+  bool applyParams(const AVCodec *codec, const AVEncodeParams &params) {
+    switch (params.decodeProfile) {
+      case AVDecodeProfile::Throughput: {
+        // frame threads add a frame of delay each, fine for batch jobs
+        ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        ctx->thread_count = 0;
+        break;
+      }
+      case AVDecodeProfile::LowLatency: {
+        ctx->thread_type = FF_THREAD_SLICE;
+        ctx->thread_count = 0;
+        ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        break;
+      }
+      case AVDecodeProfile::Fast: {
+        ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+        ctx->skip_loop_filter = AVDISCARD_ALL;
+        ctx->skip_frame = AVDISCARD_NONREF;
+        break;
+      }
+      default: break;
+    }
+
+    switch (params.threadType) {
+      case AVThreadType::Frame: ctx->thread_type = FF_THREAD_FRAME; break;
+      case AVThreadType::Slice: ctx->thread_type = FF_THREAD_SLICE; break;
+      case AVThreadType::FrameAndSlice: ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE; break;
+      default: break;
+    }
+    if (params.threadCount) {
+      ctx->thread_count = params.threadCount;
+    }
+
+    switch (params.skipFrames) {
+      case AVSkipFrames::NonRef: ctx->skip_frame = AVDISCARD_NONREF; break;
+      case AVSkipFrames::NonKey: ctx->skip_frame = AVDISCARD_NONKEY; break;
+      default: break;
+    }
+
+    if (params.downscale < 0 || params.downscale > AV_DOWNSCALE_MAX) {
+      LOG_ERROR << "[DEC] Unsupported downscale " << params.downscale;
+      return false;
+    }
+    // lowres skips most of the reconstruction work, only a few codecs have it
+    if (params.downscale <= codec->max_lowres) ctx->lowres = params.downscale;
+    else downscale = params.downscale;
 
+    for (auto &opt : params.options) {
+      if (av_opt_set(ctx, opt.first.c_str(), opt.second.c_str(), AV_OPT_SEARCH_CHILDREN) < 0) {
+        LOG_ERROR << "[DEC] Could not set option " << opt.first << "=" << opt.second;
+        return false;
+      }
+    }
     return true;
   }
 
@@ -97,42 +187,83 @@ public:
     if (ctx) avcodec_free_context(&ctx); ctx = nullptr;
     if (frame) av_frame_free(&frame); frame = nullptr;
     if (pkt) av_packet_free(&pkt); pkt = nullptr;
+    frames.clear();
   }
 
   bool decode(DoubleArray *frameData) {
-    int ret = avcodec_send_packet(ctx, pkt);
+    int ret;
+    {
+      StatTimer timer(AVStatLatency::CodecSend);
+      ret = avcodec_send_packet(ctx, pkt);
+    }
+    if (pkt->size) ServiceStats::get().add(ServiceStats::get().packetsIn);
     if (ret < 0) {
       LOG_ERROR << "[DEC] Error sending a packet for decoding";
       return false;
     }
 
     while (ret >= 0) {
-      ret = avcodec_receive_frame(ctx, frame);
+      {
+        StatTimer timer(AVStatLatency::CodecReceive);
+        ret = avcodec_receive_frame(ctx, frame);
+      }
       if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-        if (ret == AVERROR_EOF) return false;
+        // EOF is expected only after draining with an empty packet
+        if (ret == AVERROR_EOF) return pkt->size == 0;
         continue;
       } else if (ret < 0) {
         LOG_ERROR << "[DEC] Error during decoding";
         return false;
       }
+      ServiceStats::get().add(ServiceStats::get().framesOut);
+
+      // the raw output and the box filter take I420, other formats (10 bit,
+      // 4:2:2, 4:4:4) are converted first
+      bool isI420 = frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P;
+      FrameRef converted;
+      const AVFrame *picture = frame;
+      if ((!frameRefs || downscale) && !isI420) {
+        converted = convertToI420(frame);
+        if (!converted) {
+          LOG_ERROR << "[DEC] Unsupported frame format " << frame->format;
+          return false;
+        }
+        picture = converted.get();
+      }
 
-      frameData->push_back(SingleArray());
-      frameData->back().resize(3 * frame->width * frame->height / 2);
-
-      auto dataPtr = frameData->back().data();
-      int stride = frame->width;
-      for (int y = 0; y < ctx->height; y++) {
-        memcpy(dataPtr, &frame->data[0][y * frame->linesize[0]], stride);
-        dataPtr += stride;
+      if (frameRefs) {
+        // take over the decoder's reference instead of repacking the planes
+        auto ref = downscale ? downscaleFrame(picture) : av_frame_alloc();
+        if (!ref) {
+          LOG_ERROR << "[DEC] Could not allocate video frame";
+          return false;
+        }
+        if (downscale) av_frame_unref(frame);
+        else av_frame_move_ref(ref, frame);
+        frames.push_back(FrameRef(ref, [](AVFrame *f) { av_frame_free(&f); }));
+        continue;
       }
 
-      stride /= 2;
-      int scanline = ctx->height / 2;
-      for (int y = 0; y < ctx->height; y++) {
-        int planeIdx = 1 + (y / scanline);
-        memcpy(dataPtr, &frame->data[planeIdx][(y % scanline) * frame->linesize[planeIdx]], stride);
-        dataPtr += stride;
+      int width = picture->width;
+      int height = picture->height;
+      PixelPlanes src = {
+        { picture->data[0], picture->data[1], picture->data[2] },
+        { picture->linesize[0], picture->linesize[1], picture->linesize[2] },
+      };
+      if (downscale) {
+        width  = downscaledSize(picture->width, downscale);
+        height = downscaledSize(picture->height, downscale);
+        scaled.resize(rawFrameSize(AVRawFormat::I420, width, height));
+        auto planes = rawFramePlanes(AVRawFormat::I420, scaled.data(), width, height);
+        downscaleI420(src, planes, picture->width, picture->height, downscale);
+        src = planes;
       }
+
+      frameData->push_back(SingleArray());
+      auto &output = frameData->back();
+      output.resize(rawFrameSize(outputFormat, width, height));
+      StatTimer timer(AVStatLatency::Convert);
+      convert(src, rawFramePlanes(outputFormat, output.data(), width, height), width, height);
     }
 
     return true;
@@ -143,6 +274,10 @@ public:
       return false;
     }
 
+    if (framedInput) {
+      return decodeFramed(frameData, packetData);
+    }
+
     auto ptr = (packetData) ? packetData->data() : nullptr;
     size_t packetSize = (packetData) ? packetData->size() : 0;
     do {
@@ -165,6 +300,87 @@ public:
     return true;
   }
 
+  // Box filtered copy of an I420 frame, for codecs without lowres.
+  AVFrame *downscaleFrame(const AVFrame *src) {
+    auto dst = av_frame_alloc();
+    if (!dst) {
+      return nullptr;
+    }
+    dst->format = src->format;
+    dst->width  = downscaledSize(src->width, downscale);
+    dst->height = downscaledSize(src->height, downscale);
+    if (av_frame_get_buffer(dst, 0) < 0 || av_frame_copy_props(dst, src) < 0) {
+      av_frame_free(&dst);
+      return nullptr;
+    }
+
+    PixelPlanes srcPlanes = {
+      { src->data[0], src->data[1], src->data[2] },
+      { src->linesize[0], src->linesize[1], src->linesize[2] },
+    };
+    PixelPlanes dstPlanes = {
+      { dst->data[0], dst->data[1], dst->data[2] },
+      { dst->linesize[0], dst->linesize[1], dst->linesize[2] },
+    };
+    downscaleI420(srcPlanes, dstPlanes, src->width, src->height, downscale);
+    return dst;
+  }
+
+  // One payload is one packet, sent without copying: the packet references
+  // the payload, which is moved out of 'packetData'. A null payload drains
+  // the decoder and leaves it ready for the next stream.
+  bool decodeFramed(DoubleArray *frameData, SingleArray *packetData) {
+    av_packet_unref(pkt);
+    if (!packetData) {
+      bool ret = decode(frameData);
+      avcodec_flush_buffers(ctx);
+      return ret;
+    }
+    if (packetData->empty()) {
+      return true;
+    }
+
+    size_t size = packetData->size();
+    packetData->resize(size + AV_PACKET_PADDING);
+    memset(packetData->data() + size, 0, AV_PACKET_PADDING);
+    packetData->resize(size);
+
+    // libavcodec references the payload instead of copying a packet without
+    // a buffer, the payload is released once it lets go of it
+    auto holder = new SingleArray(std::move(*packetData));
+    pkt->buf = av_buffer_create(holder->data(), (int)(size + AV_PACKET_PADDING), releaseBuffer, holder, 0);
+    if (!pkt->buf) {
+      *packetData = std::move(*holder);
+      delete holder;
+      pkt->data = packetData->data();
+    } else {
+      pkt->data = holder->data();
+    }
+    pkt->size = (int)size;
+    pkt->pts  = nextPts;
+    nextPts = AV_NOPTS_VALUE;
+    bool ret = decode(frameData);
+    av_packet_unref(pkt);
+    return ret;
+  }
+
+  static void releaseBuffer(void *opaque, uint8_t *) {
+    delete (SingleArray *)opaque;
+  }
+
+  void setNextPts(int64_t pts) override {
+    nextPts = pts;
+  }
+
+  FrameRef popFrame() override {
+    if (frames.empty()) {
+      return nullptr;
+    }
+    auto ref = std::move(frames.front());
+    frames.pop_front();
+    return ref;
+  }
+
   bool isEncoder() const override { return false; }
 
 };
@@ -189,13 +405,136 @@ std::set<std::string> IAVEnc::getDecoders() {
   return codecs;
 }
 
-AVEnc IAVEnc::createDecoder(const std::string &name, int width, int height) {
+bool getFramePlanes(const FrameRef &frame, uint32_t frameId, FramePlanes &planes) {
+  memset(&planes, 0, sizeof(planes));
+  auto pixDesc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+  if (!pixDesc || (pixDesc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+    LOG_ERROR << "[DEC] Frame format " << frame->format << " has no plane layout";
+    return false;
+  }
+
+  auto &desc = planes.desc;
+  desc.frameId = frameId;
+  desc.format  = frame->format;
+  desc.width   = frame->width;
+  desc.height  = frame->height;
+  desc.pts     = frame->pts;
+
+  size_t offset = sizeof(AVFramePlanes);
+  int count = av_pix_fmt_count_planes((AVPixelFormat)frame->format);
+  for (int i = 0; i < count && i < AV_FRAME_MAX_PLANES; i++) {
+    if (!frame->data[i] || frame->linesize[i] <= 0) {
+      LOG_ERROR << "[DEC] Unsupported line size " << frame->linesize[i] << " of plane " << i;
+      return false;
+    }
+    // chroma planes are subsampled, alpha is not
+    int height = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(frame->height, pixDesc->log2_chroma_h) : frame->height;
+    size_t size = (size_t)frame->linesize[i] * height;
+    planes.data[i]   = frame->data[i];
+    desc.linesize[i] = frame->linesize[i];
+    desc.offset[i]   = (uint32_t)offset;
+    desc.size[i]     = (uint32_t)size;
+    desc.planes++;
+    offset += size;
+  }
+  planes.totalSize = offset;
+  return true;
+}
+
+static PixelPlanes framePlanes(const AVFrame *frame) {
+  return {
+    { frame->data[0], frame->data[1], frame->data[2] },
+    { frame->linesize[0], frame->linesize[1], frame->linesize[2] },
+  };
+}
+
+static FrameRef allocFrameLike(const AVFrame *src, int width, int height) {
+  auto dst = av_frame_alloc();
+  if (!dst) {
+    return nullptr;
+  }
+  dst->format = src->format;
+  dst->width  = width;
+  dst->height = height;
+  if (av_frame_get_buffer(dst, 0) < 0 || av_frame_copy_props(dst, src) < 0) {
+    av_frame_free(&dst);
+    return nullptr;
+  }
+  return FrameRef(dst, [](AVFrame *f) { av_frame_free(&f); });
+}
+
+FrameRef scaleFrame(const FrameRef &frame, int width, int height) {
+  if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+    LOG_ERROR << "[AV] Cannot scale frame format " << frame->format;
+    return nullptr;
+  }
+
+  int shift = 0;
+  while (shift < AV_DOWNSCALE_MAX && downscaledSize(frame->width, shift + 1) >= width &&
+         downscaledSize(frame->height, shift + 1) >= height) {
+    shift++;
+  }
+
+  FrameRef src = frame;
+  if (shift) {
+    auto boxed = allocFrameLike(frame.get(), downscaledSize(frame->width, shift), downscaledSize(frame->height, shift));
+    if (!boxed) {
+      return nullptr;
+    }
+    downscaleI420(framePlanes(frame.get()), framePlanes(boxed.get()), frame->width, frame->height, shift);
+    src = boxed;
+  }
+  if (src->width == width && src->height == height) {
+    return src;
+  }
+
+  auto dst = allocFrameLike(src.get(), width, height);
+  if (!dst) {
+    return nullptr;
+  }
+  scaleI420(framePlanes(src.get()), src->width, src->height, framePlanes(dst.get()), width, height);
+  return dst;
+}
+
+FrameRef convertToI420(const AVFrame *frame) {
+  if (frame->format == AV_PIX_FMT_NONE || frame->hw_frames_ctx) {
+    return nullptr;
+  }
+  auto dst = av_frame_alloc();
+  if (!dst) {
+    return nullptr;
+  }
+  dst->format = AV_PIX_FMT_YUV420P;
+  dst->width  = frame->width;
+  dst->height = frame->height;
+  if (av_frame_get_buffer(dst, 0) < 0 || av_frame_copy_props(dst, frame) < 0) {
+    av_frame_free(&dst);
+    return nullptr;
+  }
+
+  // every codec thread keeps its own context, the source format rarely
+  // changes within a stream
+  thread_local std::unique_ptr<SwsContext, void (*)(SwsContext *)> sws(nullptr, sws_freeContext);
+  auto ctx = sws_getCachedContext(sws.release(), frame->width, frame->height, (AVPixelFormat)frame->format,
+                                  dst->width, dst->height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+  sws.reset(ctx);
+  if (!ctx) {
+    av_frame_free(&dst);
+    return nullptr;
+  }
+  StatTimer timer(AVStatLatency::Convert);
+  sws_scale(ctx, frame->data, frame->linesize, 0, frame->height, dst->data, dst->linesize);
+  return FrameRef(dst, [](AVFrame *f) { av_frame_free(&f); });
+}
+
+AVEnc IAVEnc::createDecoder(const std::string &name, int width, int height, uint32_t flags, AVRawFormat format,
+                            const AVEncodeParams &params) {
   auto dec = std::make_shared<AVDecoder>();
   if (!dec) {
     return nullptr;
   }
 
-  if (!dec->init(name, width, height)) {
+  if (!dec->init(name, width, height, flags, format, params)) {
     return nullptr;
   }
 
@@ -0,0 +1,323 @@
+#include <plog/Log.h>
+#include "av.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <string>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/error.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#if defined (__cplusplus)
+}
+#endif
+
+#define DEMUX_IO_BUFFER_SIZE (64 * 1024)
+
+// Read-only mapping of a whole file.
+struct AVFileMapping {
+  ~AVFileMapping() {
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (data) munmap((void *)data, size);
+    if (fd >= 0) ::close(fd);
+#endif
+  }
+
+  bool open(const std::string &path) {
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER fileSize;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) || !fileSize.QuadPart) {
+      LOG_ERROR << "[DMX] Could not open " << path << ". Error " << GetLastError();
+      return false;
+    }
+    size = (size_t)fileSize.QuadPart;
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    data = mapping ? (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!data) {
+      LOG_ERROR << "[DMX] Could not map " << path << ". Error " << GetLastError();
+      return false;
+    }
+#else
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) < 0 || !st.st_size) {
+      LOG_ERROR << "[DMX] Could not open " << path << ". Error " << errno;
+      return false;
+    }
+    size = (size_t)st.st_size;
+    auto ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      LOG_ERROR << "[DMX] Could not map " << path << ". Error " << errno;
+      return false;
+    }
+    data = (const uint8_t *)ptr;
+    // the demuxer reads front to back, let the kernel read ahead
+    madvise(ptr, size, MADV_SEQUENTIAL);
+#endif
+    return true;
+  }
+
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#else
+  int fd = -1;
+#endif
+};
+
+// Decoder fed by a demuxer reading a mapped media file through a custom
+// AVIOContext, so no compressed data crosses the IPC boundary. MP4 style
+// length prefixed packets are converted to Annex-B for the framed decoder.
+class AVFileDecoder : public IAVEnc {
+public:
+  ~AVFileDecoder() {
+    if (fmt) avformat_close_input(&fmt);
+    if (io) {
+      av_freep(&io->buffer);
+      avio_context_free(&io);
+    }
+    if (bsf) av_bsf_free(&bsf);
+    if (demuxed) av_packet_free(&demuxed);
+    if (filtered) av_packet_free(&filtered);
+  }
+
+  AVFileMapping file;
+  int64_t position = 0;
+  AVIOContext *io = nullptr;
+  AVFormatContext *fmt = nullptr;
+  AVBSFContext *bsf = nullptr;
+  AVPacket *demuxed = nullptr;
+  AVPacket *filtered = nullptr;
+  int streamIndex = -1;
+  AVRational timeBase = { 1, 1 };
+  AVRational outputBase = { 1, 1 };
+
+  AVEnc decoder;
+  SingleArray input;
+  std::deque<FrameRef> frames;
+  bool finished = false;
+
+  bool init(const std::string &name, uint32_t flags, AVRawFormat format, const AVEncodeParams &params) {
+    if (!file.open(params.sourcePath)) {
+      return false;
+    }
+
+    auto ioBuffer = (uint8_t *)av_malloc(DEMUX_IO_BUFFER_SIZE);
+    io = ioBuffer ? avio_alloc_context(ioBuffer, DEMUX_IO_BUFFER_SIZE, 0, this, readInput, nullptr, seekInput) : nullptr;
+    fmt = avformat_alloc_context();
+    demuxed = av_packet_alloc();
+    filtered = av_packet_alloc();
+    if (!io || !fmt || !demuxed || !filtered) {
+      if (!io) av_free(ioBuffer);
+      LOG_ERROR << "[DMX] Could not allocate demuxer";
+      return false;
+    }
+    fmt->pb = io;
+    fmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    char errstr[256];
+    int ret = avformat_open_input(&fmt, nullptr, nullptr, nullptr);
+    if (ret < 0) {
+      // avformat_open_input frees the context on failure
+      fmt = nullptr;
+      LOG_ERROR << "[DMX] Could not open " << params.sourcePath << ": " << av_make_error_string(errstr, sizeof(errstr), ret);
+      return false;
+    }
+    if (avformat_find_stream_info(fmt, nullptr) < 0) {
+      LOG_ERROR << "[DMX] Could not read stream info of " << params.sourcePath;
+      return false;
+    }
+    streamIndex = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (streamIndex < 0) {
+      LOG_ERROR << "[DMX] No video stream in " << params.sourcePath;
+      return false;
+    }
+    for (unsigned i = 0; i < fmt->nb_streams; i++) {
+      if ((int)i != streamIndex) fmt->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    auto stream = fmt->streams[streamIndex];
+    auto par = stream->codecpar;
+    timeBase = stream->time_base;
+    // frames carry pts in 1/fps like every other session, when the rate is known
+    auto rate = av_guess_frame_rate(fmt, stream, nullptr);
+    outputBase = (rate.num && rate.den) ? AVRational{ rate.den, rate.num } : timeBase;
+
+    const char *filterName = "null";
+    if (par->codec_id == AV_CODEC_ID_H264) filterName = "h264_mp4toannexb";
+    else if (par->codec_id == AV_CODEC_ID_HEVC) filterName = "hevc_mp4toannexb";
+    auto filter = av_bsf_get_by_name(filterName);
+    if (!filter || av_bsf_alloc(filter, &bsf) < 0 || avcodec_parameters_copy(bsf->par_in, par) < 0) {
+      LOG_ERROR << "[DMX] Could not set up " << filterName;
+      return false;
+    }
+    bsf->time_base_in = timeBase;
+    if (av_bsf_init(bsf) < 0) {
+      LOG_ERROR << "[DMX] Could not init " << filterName;
+      return false;
+    }
+
+    std::string decoderName = name;
+    if (decoderName.empty()) {
+      auto codec = avcodec_find_decoder(par->codec_id);
+      if (!codec) {
+        LOG_ERROR << "[DMX] No decoder for " << avcodec_get_name(par->codec_id);
+        return false;
+      }
+      decoderName = std::string("sw-") + codec->name;
+    }
+    uint32_t decodeFlags = AVInitFlagFramedInput | (flags & AVInitFlagFrameRefs);
+    decoder = createDecoder(decoderName, par->width, par->height, decodeFlags, format, params);
+    if (!decoder) {
+      return false;
+    }
+
+    codecName = decoder->getName();
+    LOG_INFO << "[DMX] File decoder opened: " << params.sourcePath << ", " << codecName << " " << par->width << "x" <<
+                par->height << ", " << file.size << " bytes mapped";
+    return true;
+  }
+
+  static int readInput(void *opaque, uint8_t *buf, int size) {
+    auto dmx = (AVFileDecoder *)opaque;
+    size_t left = dmx->file.size - (size_t)dmx->position;
+    if (!left) {
+      return AVERROR_EOF;
+    }
+    size_t bytes = std::min(left, (size_t)size);
+    memcpy(buf, dmx->file.data + dmx->position, bytes);
+    dmx->position += bytes;
+    return (int)bytes;
+  }
+
+  static int64_t seekInput(void *opaque, int64_t offset, int whence) {
+    auto dmx = (AVFileDecoder *)opaque;
+    int64_t size = (int64_t)dmx->file.size;
+    switch (whence & ~AVSEEK_FORCE) {
+      case AVSEEK_SIZE: return size;
+      case SEEK_SET: break;
+      case SEEK_CUR: offset += dmx->position; break;
+      case SEEK_END: offset += size; break;
+      default: return -1;
+    }
+    if (offset < 0 || offset > size) {
+      return -1;
+    }
+    dmx->position = offset;
+    return offset;
+  }
+
+  // Moves frames queued by an AVInitFlagFrameRefs decoder behind ours.
+  void collectFrames() {
+    while (auto frame = decoder->popFrame()) frames.push_back(std::move(frame));
+  }
+
+  // Sends a demuxed packet, or nullptr at the end, through the bitstream
+  // filter into the decoder.
+  bool decodePacket(AVPacket *packet, DoubleArray *frameData) {
+    if (av_bsf_send_packet(bsf, packet) < 0) {
+      LOG_ERROR << "[DMX] Bitstream filter rejected a packet";
+      return false;
+    }
+
+    bool ret = true;
+    while (ret && av_bsf_receive_packet(bsf, filtered) == 0) {
+      input.clear();
+      input.reserve(filtered->size + AV_PACKET_PADDING);
+      input.append(filtered->data, filtered->size);
+      if (filtered->pts != AV_NOPTS_VALUE) decoder->setNextPts(av_rescale_q(filtered->pts, timeBase, outputBase));
+      ret = decoder->process(frameData, &input);
+      av_packet_unref(filtered);
+      collectFrames();
+    }
+    return ret;
+  }
+
+  bool finish(DoubleArray *frameData) {
+    finished = true;
+    bool ret = decodePacket(nullptr, frameData);
+    ret = decoder->process(frameData, nullptr) && ret;
+    collectFrames();
+    return ret;
+  }
+
+  // Decode (packetData set, its contents unused) demuxes until a frame comes
+  // out, Flush (packetData == nullptr) ends the stream.
+  bool process(DoubleArray *frameData, SingleArray *packetData) override {
+    if (!frameData) {
+      return false;
+    }
+    if (!packetData) {
+      return finished || finish(frameData);
+    }
+    if (finished) {
+      return false;
+    }
+
+    size_t before = frameData->size();
+    while (frameData->size() == before && frames.empty()) {
+      int ret = av_read_frame(fmt, demuxed);
+      if (ret == AVERROR_EOF) {
+        return finish(frameData);
+      }
+      if (ret < 0) {
+        char errstr[256];
+        LOG_ERROR << "[DMX] Read error: " << av_make_error_string(errstr, sizeof(errstr), ret);
+        return false;
+      }
+
+      bool ok = demuxed->stream_index != streamIndex || decodePacket(demuxed, frameData);
+      av_packet_unref(demuxed);
+      if (!ok) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  FrameRef popFrame() override {
+    if (frames.empty()) {
+      return nullptr;
+    }
+    auto ref = std::move(frames.front());
+    frames.pop_front();
+    return ref;
+  }
+
+  bool isEncoder() const override { return false; }
+};
+
+AVEnc IAVEnc::createFileDecoder(const std::string &name, uint32_t flags, AVRawFormat format,
+                                const AVEncodeParams &params) {
+  auto dmx = std::make_shared<AVFileDecoder>();
+  if (!dmx) {
+    return nullptr;
+  }
+
+  if (!dmx->init(name, flags, format, params)) {
+    return nullptr;
+  }
+
+  return dmx;
+}
@@ -1,5 +1,7 @@
 #include <plog/Log.h>
 #include "av.h"
+#include "pixconv.h"
+#include "stats.h"
 #include <string>
 #include <sstream>
 #include <vector>
@@ -29,6 +31,9 @@ InitAV initAV;
 
 extern FILE *LOGFILE;
 
+#define ENC_FRAME_ALIGN    64
+#define ENC_LINESIZE_ALIGN 32
+
 class AVEncoder : public IAVEnc {
 public:
   AVEncoder() {
@@ -39,33 +44,89 @@ public:
 
   AVCodecContext *ctx = nullptr;
   AVFrame *frame = nullptr;
+  AVFrame *wrapped = nullptr;
   AVPacket *pkt = nullptr;
 
   int frameIdx = 0;
-
-  bool init(const std::string &name, int width, int height, int bps, int fps) {
-    int ret;
-    if (width <= 0 || height <= 0 || (width & 2) || (height % 2) || bps < 1000000 || fps < 1) {
+  int64_t nextPts = AV_NOPTS_VALUE;
+  bool packetInfo = false;
+  AVRawFormat inputFormat = AVRawFormat::I420;
+  PixelConvFunc convert = nullptr;
+  AVEncodeParams params;
+
+  const AVCodec *codec = nullptr;
+  int width = 0, height = 0;
+  int bitrate = 0, fps = 0;
+  bool keyframeRequested = false;
+
+  bool init(const std::string &name, int _width, int _height, int bps, int _fps, uint32_t flags, AVRawFormat format,
+            const AVEncodeParams &encodeParams) {
+    // constant quality needs no target bitrate
+    bool needsBitrate = encodeParams.rateControl != AVRateControl::CRF;
+    if (_width <= 0 || _height <= 0 || (_width % 2) || (_height % 2) || (needsBitrate && bps < 1000000) || _fps < 1) {
       return false;
     }
+    params = encodeParams;
+    packetInfo = (flags & AVInitFlagPacketInfo) != 0;
+    inputFormat = format;
+    convert = getPixelConverter(format, AVRawFormat::I420);
+    if (!convert) {
+      return false;
+    }
+
     const char *tmpName = name.c_str();
     if (name.find("sw-") == 0 || name.find("hw-") == 0) {
       tmpName += 3;
     }
 
-    auto codec = avcodec_find_encoder_by_name(tmpName);
+    codec = avcodec_find_encoder_by_name(tmpName);
     if (!codec) {
       LOG_ERROR << "[ENC] Could not find video codec: " << name;
       return false;
     }
 
+    width = _width;
+    height = _height;
+    bitrate = bps;
+    fps = _fps;
+    if (!openContext()) {
+      return false;
+    }
+
+    pkt = av_packet_alloc();
+    if (!pkt) {
+      LOG_ERROR << "[ENC] Could not allocate video packet";
+      deinit();
+      return false;
+    }
+
+    if (!allocFrame()) {
+      deinit();
+      return false;
+    }
+
+    wrapped = av_frame_alloc();
+    if (!wrapped) {
+      LOG_ERROR << "[ENC] Could not allocate video frame";
+      deinit();
+      return false;
+    }
+
+    codecName = codec->name;
+    LOG_INFO << "[ENC] Encoder opened: " << codec->name << ", input " << rawFormatName(inputFormat);
+
+    return true;
+  }
+
+  // Creates and opens the codec context for the current size and bitrate.
+  bool openContext() {
     ctx = avcodec_alloc_context3(codec);
     if (!ctx) {
       LOG_ERROR << "[ENC] Could not allocate video encoder context";
       return false;
     }
 
-    ctx->bit_rate = bps;
+    ctx->bit_rate = bitrate;
     /* resolution must be a multiple of two */
     ctx->width = width;
     ctx->height = height;
@@ -91,83 +152,263 @@ public:
       ctx->has_b_frames = 0;
       ctx->max_b_frames = 0;
     }
+    // forced keyframes start a new GOP, not just an I picture
+    av_opt_set(ctx->priv_data, "forced-idr", "1", 0);
+
+    if (!applyParams()) {
+      avcodec_free_context(&ctx);
+      ctx = nullptr;
+      return false;
+    }
 
     char errstr[256];
-    ret = avcodec_open2(ctx, codec, NULL);
+    int ret = avcodec_open2(ctx, codec, NULL);
     if (ret < 0) {
       LOG_ERROR << "[ENC] Could not open codec '" << codec->name << "': " << av_make_error_string(errstr, sizeof(errstr), ret);
       if (ctx) avcodec_free_context(&ctx);
       ctx = nullptr;
       return false;
     }
+    return true;
+  }
 
-    pkt = av_packet_alloc();
-    if (!pkt) {
-      LOG_ERROR << "[ENC] Could not allocate video packet";
-      deinit();
-      return false;
-    }
-
+  bool allocFrame() {
+    if (frame) av_frame_free(&frame);
     frame = av_frame_alloc();
     if (!frame) {
       LOG_ERROR << "[ENC] Could not allocate video frame";
-      deinit();
       return false;
     }
     frame->format = ctx->pix_fmt;
     frame->width = ctx->width;
     frame->height = ctx->height;
 
-    ret = av_frame_get_buffer(frame, 0);
-    if (ret < 0) {
+    if (av_frame_get_buffer(frame, 0) < 0) {
       LOG_ERROR << "[ENC] Could not allocate the video frame data";
-      deinit();
       return false;
     }
+    return true;
+  }
 
-    codecName = codec->name;
-    LOG_INFO << "[ENC] Encoder opened: " << codec->name;
+  // Drains the current context into 'packetData' and opens a new one with the
+  // current settings. The packet and wrapper frames are kept, the input frame
+  // only changes when the size does.
+  bool reopen(SingleArray *packetData) {
+    bool drained = !ctx || process(nullptr, packetData);
+    bool resized = !ctx || ctx->width != width || ctx->height != height;
+    if (ctx) avcodec_free_context(&ctx);
+    ctx = nullptr;
+    if (!openContext() || (resized && !allocFrame())) {
+      return false;
+    }
+    return drained;
+  }
 
+  bool setBitrate(uint32_t bps, uint32_t maxrate, uint32_t bufsize, SingleArray *packetData) override {
+    if (!ctx || !bps || params.rateControl == AVRateControl::CRF) {
+      return false;
+    }
+    bitrate = bps;
+    if (maxrate) params.maxrate = maxrate;
+    if (bufsize) params.bufsize = bufsize;
+
+    // libx264 compares these fields on every frame and reconfigures in place
+    if (!strcmp(codec->name, "libx264") || !strcmp(codec->name, "libx264rgb")) {
+      ctx->bit_rate = bps;
+      if (params.rateControl == AVRateControl::CBR) {
+        ctx->rc_min_rate = ctx->rc_max_rate = bps;
+        ctx->rc_buffer_size = params.bufsize ? params.bufsize : bps;
+      } else {
+        if (params.maxrate) ctx->rc_max_rate = params.maxrate;
+        if (params.bufsize) ctx->rc_buffer_size = params.bufsize;
+      }
+      LOG_INFO << "[ENC] Bitrate changed to " << bps;
+      return true;
+    }
+
+    LOG_INFO << "[ENC] Reopening " << codec->name << " for bitrate " << bps;
+    return reopen(packetData);
+  }
+
+  void setNextPts(int64_t pts) override {
+    nextPts = pts;
+  }
+
+  bool forceKeyframe() override {
+    keyframeRequested = true;
+    return true;
+  }
+
+  bool setResolution(int _width, int _height, SingleArray *packetData) override {
+    if (_width <= 0 || _height <= 0 || (_width % 2) || (_height % 2)) {
+      return false;
+    }
+    if (_width == width && _height == height) {
+      return true;
+    }
+    width = _width;
+    height = _height;
+
+    LOG_INFO << "[ENC] Reopening " << codec->name << " at " << width << "x" << height;
+    return reopen(packetData);
+  }
+
+  // Applies the client's AVInitExt settings over the defaults above.
+  bool applyParams() {
+    switch (params.threadType) {
+      case AVThreadType::Frame: ctx->thread_type = FF_THREAD_FRAME; break;
+      case AVThreadType::Slice: ctx->thread_type = FF_THREAD_SLICE; break;
+      case AVThreadType::FrameAndSlice: ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE; break;
+      default: break;
+    }
+    if (params.threadType != AVThreadType::Default || params.threadCount) {
+      ctx->thread_count = params.threadCount;
+    }
+
+    if (params.gop > 0) ctx->gop_size = params.gop;
+    if (params.bframes >= 0) ctx->max_b_frames = params.bframes;
+
+    if (params.preset.length() && av_opt_set(ctx->priv_data, "preset", params.preset.c_str(), 0) < 0) {
+      LOG_ERROR << "[ENC] Unsupported preset: " << params.preset;
+      return false;
+    }
+    if (params.tune.length() && av_opt_set(ctx->priv_data, "tune", params.tune.c_str(), 0) < 0) {
+      LOG_ERROR << "[ENC] Unsupported tune: " << params.tune;
+      return false;
+    }
+
+    switch (params.rateControl) {
+      case AVRateControl::CBR: {
+        ctx->rc_min_rate = ctx->rc_max_rate = ctx->bit_rate;
+        ctx->rc_buffer_size = params.bufsize ? params.bufsize : (int)ctx->bit_rate;
+        av_opt_set(ctx->priv_data, "nal-hrd", "cbr", 0);
+        break;
+      }
+      case AVRateControl::VBR: {
+        if (params.maxrate) ctx->rc_max_rate = params.maxrate;
+        if (params.bufsize) ctx->rc_buffer_size = params.bufsize;
+        break;
+      }
+      case AVRateControl::CRF: {
+        ctx->bit_rate = 0;
+        if (av_opt_set_double(ctx->priv_data, "crf", params.crf, 0) < 0) {
+          // encoders without crf take a fixed quantizer scale instead
+          ctx->flags |= AV_CODEC_FLAG_QSCALE;
+          ctx->global_quality = FF_QP2LAMBDA * params.crf;
+        }
+        if (params.maxrate) ctx->rc_max_rate = params.maxrate;
+        if (params.bufsize) ctx->rc_buffer_size = params.bufsize;
+        break;
+      }
+      default: break;
+    }
+
+    for (auto &opt : params.options) {
+      if (av_opt_set(ctx, opt.first.c_str(), opt.second.c_str(), AV_OPT_SEARCH_CHILDREN) < 0) {
+        LOG_ERROR << "[ENC] Could not set option " << opt.first << "=" << opt.second;
+        return false;
+      }
+    }
     return true;
   }
 
   void deinit() {
     if (ctx) avcodec_free_context(&ctx); ctx = nullptr;
     if (frame) av_frame_free(&frame); frame = nullptr;
+    if (wrapped) av_frame_free(&wrapped); wrapped = nullptr;
     if (pkt) av_packet_free(&pkt); pkt = nullptr;
   }
 
+  // Hands a tightly packed I420 buffer to the encoder without copying when
+  // its planes already meet libavcodec's alignment. The buffer moves into a
+  // ref-counted AVBufferRef and returns to the pool once the encoder (and any
+  // lookahead holding the frame) drops its last reference.
+  bool wrapFrame(SingleArray &data) {
+    if (inputFormat != AVRawFormat::I420) {
+      return false;
+    }
+
+    size_t lumaSize = (size_t)ctx->width * ctx->height;
+    size_t chromaSize = lumaSize / 4;
+    if ((uintptr_t)data.data() % ENC_FRAME_ALIGN || (lumaSize % ENC_FRAME_ALIGN) || (chromaSize % ENC_FRAME_ALIGN) ||
+        (ctx->width / 2) % ENC_LINESIZE_ALIGN || data.capacity() - data.size() < AV_INPUT_BUFFER_PADDING_SIZE) {
+      return false;
+    }
+
+    auto holder = new SingleArray(std::move(data));
+    wrapped->buf[0] = av_buffer_create(holder->data(), (int)holder->size(), releaseBuffer, holder, 0);
+    if (!wrapped->buf[0]) {
+      data = std::move(*holder);
+      delete holder;
+      return false;
+    }
+
+    wrapped->format = ctx->pix_fmt;
+    wrapped->width = ctx->width;
+    wrapped->height = ctx->height;
+    wrapped->data[0] = holder->data();
+    wrapped->data[1] = wrapped->data[0] + lumaSize;
+    wrapped->data[2] = wrapped->data[1] + chromaSize;
+    wrapped->linesize[0] = ctx->width;
+    wrapped->linesize[1] = wrapped->linesize[2] = ctx->width / 2;
+    return true;
+  }
+
+  static void releaseBuffer(void *opaque, uint8_t *) {
+    delete (SingleArray *)opaque;
+  }
+
+  // Converts the buffer into the encoder owned frame, used when it cannot be wrapped.
+  bool copyFrame(SingleArray &data) {
+    // the encoder may still reference the previous picture
+    if (av_frame_make_writable(frame) < 0) {
+      return false;
+    }
+
+    PixelPlanes dst = {
+      { frame->data[0], frame->data[1], frame->data[2] },
+      { frame->linesize[0], frame->linesize[1], frame->linesize[2] },
+    };
+    StatTimer timer(AVStatLatency::Convert);
+    convert(rawFramePlanes(inputFormat, data.data(), ctx->width, ctx->height), dst, ctx->width, ctx->height);
+    return true;
+  }
+
   bool process(DoubleArray *frameData, SingleArray *packetData) override {
     int ret = 0;
+    if (!ctx) {
+      LOG_ERROR << "[ENC] Encoder is not open";
+      return false;
+    }
     for (size_t i = 0; frameData && i < frameData->size(); i++) {
-      {
-        auto dataPtr = frameData->at(i).data();
-        int stride = frame->width;
-        for (int y = 0; y < ctx->height; y++) {
-          memcpy(&frame->data[0][y * frame->linesize[0]], dataPtr, stride);
-          dataPtr += stride;
-        }
-
-        stride /= 2;
-        int scanline = ctx->height / 2;
-        for (int y = 0; y < ctx->height; y++) {
-          int planeIdx = 1 + (y / scanline);
-          memcpy(&frame->data[planeIdx][(y % scanline) * frame->linesize[planeIdx]], dataPtr, stride);
-          dataPtr += stride;
-        }
+      auto &data = frameData->at(i);
+      if (data.size() < rawFrameSize(inputFormat, ctx->width, ctx->height)) {
+        frameData->erase(frameData->begin(), frameData->begin() + i + 1);
+        LOG_ERROR << "[ENC] Frame data too small: " << data.size();
+        return false;
+      }
 
-        frame->pts = frameIdx++;
+      AVFrame *input = frame;
+      if (wrapFrame(data)) {
+        input = wrapped;
+      } else if (!copyFrame(data)) {
+        frameData->erase(frameData->begin(), frameData->begin() + i + 1);
+        LOG_ERROR << "[ENC] Could not make the video frame writable";
+        return false;
       }
 
-      ret = avcodec_send_frame(ctx, frame);
+      // libavcodec takes its own reference, the wrapper is reused right away
+      ret = sendFrame(input);
+      if (input == wrapped) av_frame_unref(wrapped);
       if (ret < 0) {
-        frameData->erase(frameData->begin(), frameData->begin() + i - 1);
+        frameData->erase(frameData->begin(), frameData->begin() + i + 1);
         LOG_ERROR << "[ENC] Error sending a frame for encoding";
         return false;
       }
     }
 
     if (!frameData) {
+      StatTimer timer(AVStatLatency::CodecSend);
       ret = avcodec_send_frame(ctx, 0);
       if (ret < 0) {
         LOG_ERROR << "[ENC] Error sending a frame for encoding";
@@ -177,18 +418,74 @@ public:
       frameData->clear();
     }
 
+    return receivePackets(packetData, !frameData);
+  }
+
+  int sendFrame(AVFrame *input) {
+    input->pts = (nextPts != AV_NOPTS_VALUE) ? nextPts : frameIdx;
+    nextPts = AV_NOPTS_VALUE;
+    frameIdx++;
+    input->pict_type = keyframeRequested ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    keyframeRequested = false;
+    ServiceStats::get().add(ServiceStats::get().framesIn);
+    StatTimer timer(AVStatLatency::CodecSend);
+    return avcodec_send_frame(ctx, input);
+  }
+
+  bool encodeFrame(const FrameRef &input, SingleArray *packetData) override {
+    if (!ctx) {
+      LOG_ERROR << "[ENC] Encoder is not open";
+      return false;
+    }
+    if ((input->format != AV_PIX_FMT_YUV420P && input->format != AV_PIX_FMT_YUVJ420P) ||
+        input->width != ctx->width || input->height != ctx->height) {
+      LOG_ERROR << "[ENC] Frame " << input->width << "x" << input->height << " format " << input->format <<
+                   " does not match the encoder";
+      return false;
+    }
+
+    // a new reference to the same buffers, its properties are ours to change
+    if (av_frame_ref(wrapped, input.get()) < 0) {
+      LOG_ERROR << "[ENC] Could not reference the video frame";
+      return false;
+    }
+    wrapped->format = ctx->pix_fmt;
+    int ret = sendFrame(wrapped);
+    av_frame_unref(wrapped);
+    if (ret < 0) {
+      LOG_ERROR << "[ENC] Error sending a frame for encoding";
+      return false;
+    }
+    return receivePackets(packetData, false);
+  }
+
+  bool receivePackets(SingleArray *packetData, bool draining) {
+    int ret = 0;
     while (ret >= 0) {
-      ret = avcodec_receive_packet(ctx, pkt);
+      {
+        StatTimer timer(AVStatLatency::CodecReceive);
+        ret = avcodec_receive_packet(ctx, pkt);
+      }
       if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-        if (ret == AVERROR_EOF) return (frameData) ? false : true;
+        if (ret == AVERROR_EOF) return draining;
         continue;
       } else if (ret < 0) {
         LOG_ERROR << "[ENC] Error during encoding";
         return false;
       }
-
+      ServiceStats::get().add(ServiceStats::get().packetsOut);
+
+      if (packetData && packetInfo) {
+        AVPacketInfo info;
+        info.pts    = pkt->pts;
+        info.dts    = pkt->dts;
+        info.size   = pkt->size;
+        info.flags  = (pkt->flags & AV_PKT_FLAG_KEY) ? AVPacketFlagKey : 0;
+        info.stream = 0;
+        packetData->append(&info, sizeof(info));
+      }
       if (packetData) {
-        packetData->insert(packetData->end(), pkt->data, pkt->data + pkt->size);
+        packetData->append(pkt->data, pkt->size);
       }
 
       av_packet_unref(pkt);
@@ -197,6 +494,10 @@ public:
     return true;
   }
 
+  bool getCodecParameters(AVCodecParameters *par) const override {
+    return ctx && avcodec_parameters_from_context(par, ctx) >= 0;
+  }
+
   bool isEncoder() const override { return true; }
 
 };
@@ -221,13 +522,14 @@ std::set<std::string> IAVEnc::getEncoders() {
   return codecs;
 }
 
-AVEnc IAVEnc::createEncoder(const std::string &name, int width, int height, int fps, int bps) {
+AVEnc IAVEnc::createEncoder(const std::string &name, int width, int height, int fps, int bps, uint32_t flags,
+                            AVRawFormat format, const AVEncodeParams &params) {
   auto enc = std::make_shared<AVEncoder>();
   if (!enc) {
     return nullptr;
   }
 
-  if (!enc->init(name, width, height, bps, fps)) {
+  if (!enc->init(name, width, height, bps, fps, flags, format, params)) {
     return nullptr;
   }
 
@@ -0,0 +1,265 @@
+#include <plog/Log.h>
+#include "av.h"
+#include "pixconv.h"
+#include "stats.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#if defined (__cplusplus)
+}
+#endif
+
+// One rung of the ladder and the thread running its encoder.
+struct AVRenditionWorker {
+  AVEnc enc;
+  AVRendition rung;
+  std::thread thread;
+  FrameRef input;       // nullptr flushes the encoder
+  SingleArray packets;
+  bool result = true;
+};
+
+// Encodes each input frame at every rung. The source is converted to I420
+// once and scaled down the ladder, the encoders run in parallel on their own
+// threads.
+class AVLadder : public IAVEnc {
+public:
+  ~AVLadder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &r : renditions) {
+      if (r->thread.joinable()) r->thread.join();
+    }
+  }
+
+  std::vector<std::unique_ptr<AVRenditionWorker>> renditions;
+  std::vector<size_t> order;    // rendition indices, largest rung first
+  int width = 0, height = 0;
+  AVRawFormat inputFormat = AVRawFormat::I420;
+  PixelConvFunc convert = nullptr;
+  int64_t nextPts = AV_NOPTS_VALUE;
+
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  uint64_t generation = 0;
+  size_t remaining = 0;
+  bool stopping = false;
+
+  bool init(const std::string &name, int _width, int _height, int fps, uint32_t flags, AVRawFormat format,
+            const AVEncodeParams &params) {
+    if (_width <= 0 || _height <= 0 || params.renditions.empty() || params.renditions.size() > AV_MAX_RENDITIONS) {
+      return false;
+    }
+    width = _width;
+    height = _height;
+    inputFormat = format;
+    convert = getPixelConverter(format, AVRawFormat::I420);
+    if (!convert) {
+      return false;
+    }
+
+    AVEncodeParams rungParams = params;
+    rungParams.renditions.clear();
+    uint32_t rungFlags = AVInitFlagPacketInfo | (flags & AVInitFlagClientPts);
+    for (auto &rung : params.renditions) {
+      // 4:2:0 rungs need even dimensions, the encoders refuse others
+      if (!rung.width || !rung.height || (rung.width % 2) || (rung.height % 2)) {
+        LOG_ERROR << "[LAD] Invalid rendition " << rung.width << "x" << rung.height <<
+                     ", width and height must be positive and even";
+        return false;
+      }
+      auto r = std::make_unique<AVRenditionWorker>();
+      r->rung = rung;
+      r->enc = createEncoder(name, rung.width, rung.height, fps, rung.bps, rungFlags, AVRawFormat::I420, rungParams);
+      if (!r->enc) {
+        LOG_ERROR << "[LAD] Could not open rendition " << rung.width << "x" << rung.height;
+        return false;
+      }
+      renditions.push_back(std::move(r));
+    }
+
+    for (size_t i = 0; i < renditions.size(); i++) order.push_back(i);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      auto &ra = renditions[a]->rung, &rb = renditions[b]->rung;
+      return (int)ra.width * ra.height > (int)rb.width * rb.height;
+    });
+
+    for (auto &r : renditions) {
+      r->thread = std::thread(&AVLadder::run, this, r.get());
+    }
+
+    codecName = renditions[0]->enc->getName();
+    LOG_INFO << "[LAD] Ladder opened: " << codecName << ", " << renditions.size() << " renditions from " <<
+                width << "x" << height;
+    return true;
+  }
+
+  void run(AVRenditionWorker *r) {
+    uint64_t seen = 0;
+    while (1) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stopping || generation != seen; });
+        if (stopping) return;
+        seen = generation;
+      }
+
+      if (r->input) r->result = r->enc->encodeFrame(r->input, &r->packets);
+      else r->result = r->enc->process(nullptr, &r->packets);
+      r->input = nullptr;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--remaining == 0) done.notify_one();
+    }
+  }
+
+  // Runs every rendition on its prepared input and collects the packets,
+  // tagging each AVPacketInfo record with its rendition index.
+  bool dispatch(SingleArray *packetData) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      remaining = renditions.size();
+      generation++;
+    }
+    wake.notify_all();
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [&]() { return remaining == 0; });
+    }
+
+    bool ret = true;
+    for (size_t i = 0; i < renditions.size(); i++) {
+      auto &packets = renditions[i]->packets;
+      AVPacketInfo info;
+      for (size_t offset = 0; offset + sizeof(info) <= packets.size(); offset += sizeof(info) + info.size) {
+        memcpy(&info, packets.data() + offset, sizeof(info));
+        info.stream = (uint16_t)i;
+        memcpy(packets.data() + offset, &info, sizeof(info));
+      }
+      if (packetData) packetData->append(packets.data(), packets.size());
+      packets.clear();
+      ret = ret && renditions[i]->result;
+    }
+    return ret;
+  }
+
+  FrameRef convertSource(SingleArray &data) {
+    auto frame = av_frame_alloc();
+    if (!frame) {
+      return nullptr;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width  = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+      av_frame_free(&frame);
+      return nullptr;
+    }
+
+    PixelPlanes dst = {
+      { frame->data[0], frame->data[1], frame->data[2] },
+      { frame->linesize[0], frame->linesize[1], frame->linesize[2] },
+    };
+    {
+      StatTimer timer(AVStatLatency::Convert);
+      convert(rawFramePlanes(inputFormat, data.data(), width, height), dst, width, height);
+    }
+    return FrameRef(frame, [](AVFrame *f) { av_frame_free(&f); });
+  }
+
+  // Scales the source for every rung, largest first, each from the smallest
+  // picture made so far that still covers it.
+  bool prepareInputs(const FrameRef &source) {
+    std::vector<FrameRef> levels = { source };
+    for (auto i : order) {
+      auto &r = renditions[i];
+      FrameRef from = source;
+      for (auto &level : levels) {
+        if (level->width >= r->rung.width && level->height >= r->rung.height &&
+            level->width * level->height < from->width * from->height) {
+          from = level;
+        }
+      }
+      if (from->width == r->rung.width && from->height == r->rung.height) r->input = from;
+      else r->input = scaleFrame(from, r->rung.width, r->rung.height);
+      if (!r->input) {
+        LOG_ERROR << "[LAD] Could not scale rendition " << i;
+        for (auto &other : renditions) other->input = nullptr;
+        return false;
+      }
+      levels.push_back(r->input);
+      if (nextPts != AV_NOPTS_VALUE) r->enc->setNextPts(nextPts);
+    }
+    nextPts = AV_NOPTS_VALUE;
+    return true;
+  }
+
+  bool process(DoubleArray *frameData, SingleArray *packetData) override {
+    if (!frameData) {
+      return dispatch(packetData);
+    }
+
+    bool ret = true;
+    for (auto &data : *frameData) {
+      if (data.size() < rawFrameSize(inputFormat, width, height)) {
+        LOG_ERROR << "[LAD] Frame data too small: " << data.size();
+        ret = false;
+        break;
+      }
+      auto source = convertSource(data);
+      if (!source) {
+        LOG_ERROR << "[LAD] Could not allocate video frame";
+        ret = false;
+        break;
+      }
+
+      if (!prepareInputs(source) || !dispatch(packetData)) {
+        ret = false;
+        break;
+      }
+    }
+    frameData->clear();
+    return ret;
+  }
+
+  void setNextPts(int64_t pts) override {
+    nextPts = pts;
+  }
+
+  // Keyframes stay aligned across renditions so players can switch there.
+  bool forceKeyframe() override {
+    bool ret = true;
+    for (auto &r : renditions) ret = r->enc->forceKeyframe() && ret;
+    return ret;
+  }
+
+  bool isEncoder() const override { return true; }
+};
+
+AVEnc IAVEnc::createLadder(const std::string &name, int width, int height, int fps, uint32_t flags,
+                           AVRawFormat format, const AVEncodeParams &params) {
+  auto ladder = std::make_shared<AVLadder>();
+  if (!ladder) {
+    return nullptr;
+  }
+
+  if (!ladder->init(name, width, height, fps, flags, format, params)) {
+    return nullptr;
+  }
+
+  return ladder;
+}
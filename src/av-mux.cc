@@ -0,0 +1,261 @@
+#include <plog/Log.h>
+#include "av.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+#if defined (__cplusplus)
+}
+#endif
+
+#define MUX_IO_BUFFER_SIZE (64 * 1024)
+
+// Encoder output muxed into fMP4 or MPEG-TS segments inside the service.
+// libavformat writes through a custom AVIOContext into the open segment,
+// which closes on the first keyframe past the segment length and goes out
+// as an AVSegmentInfo record.
+class AVMuxer : public IAVEnc {
+public:
+  ~AVMuxer() {
+    deinit();
+  }
+
+  AVEnc encoder;
+  AVContainer container = AVContainer::None;
+  int fps = 0;
+  int64_t segmentLength = 0;   // in 1/fps
+  AVFormatContext *fmt = nullptr;
+  AVStream *stream = nullptr;
+  AVPacket *pkt = nullptr;
+  bool finished = false;
+
+  SingleArray packets;   // encoder output, AVPacketInfo records
+  SingleArray segment;   // bytes of the open segment
+  SingleArray ready;     // closed segments not handed out yet
+  bool segmentOpen = false;
+  int64_t segmentPts = 0;
+  int64_t segmentEnd = 0;
+  uint32_t sequence = 0;
+
+  bool init(const std::string &name, int width, int height, int _fps, int bps, uint32_t flags, AVRawFormat format,
+            const AVEncodeParams &params) {
+    if (params.container == AVContainer::None || params.renditions.size()) {
+      LOG_ERROR << "[MUX] Only single output encoders can be muxed";
+      return false;
+    }
+    container = params.container;
+    fps = _fps;
+    segmentLength = (int64_t)params.segmentMs * fps / 1000;
+
+    // mp4 keeps the parameter sets in the init segment, TS repeats them in-band
+    AVEncodeParams encodeParams = params;
+    encodeParams.container = AVContainer::None;
+    if (container == AVContainer::FMP4) encodeParams.options.emplace_back("flags", "+global_header");
+    encoder = createEncoder(name, width, height, fps, bps, AVInitFlagPacketInfo | (flags & AVInitFlagClientPts),
+                            format, encodeParams);
+    if (!encoder) {
+      return false;
+    }
+
+    char errstr[256];
+    const char *formatName = (container == AVContainer::FMP4) ? "mp4" : "mpegts";
+    int ret = avformat_alloc_output_context2(&fmt, nullptr, formatName, nullptr);
+    if (ret < 0) {
+      LOG_ERROR << "[MUX] Could not create " << formatName << " muxer: " << av_make_error_string(errstr, sizeof(errstr), ret);
+      return false;
+    }
+
+    auto ioBuffer = (uint8_t *)av_malloc(MUX_IO_BUFFER_SIZE);
+    fmt->pb = ioBuffer ? avio_alloc_context(ioBuffer, MUX_IO_BUFFER_SIZE, 1, this, nullptr, writeOutput, nullptr) : nullptr;
+    if (!fmt->pb) {
+      av_free(ioBuffer);
+      LOG_ERROR << "[MUX] Could not allocate output context";
+      return false;
+    }
+    fmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    stream = avformat_new_stream(fmt, nullptr);
+    pkt = av_packet_alloc();
+    if (!stream || !pkt || !encoder->getCodecParameters(stream->codecpar)) {
+      LOG_ERROR << "[MUX] Could not set up the video stream";
+      return false;
+    }
+    stream->time_base = { 1, fps };
+    stream->avg_frame_rate = { fps, 1 };
+
+    AVDictionary *options = nullptr;
+    // every fragment is cut by hand, at segment boundaries
+    if (container == AVContainer::FMP4) av_dict_set(&options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+    ret = avformat_write_header(fmt, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+      LOG_ERROR << "[MUX] Could not write " << formatName << " header: " << av_make_error_string(errstr, sizeof(errstr), ret);
+      return false;
+    }
+    avio_flush(fmt->pb);
+    if (container == AVContainer::FMP4) {
+      emitSegment(0, 0, AVSegmentFlagInit);
+    }
+
+    codecName = encoder->getName();
+    LOG_INFO << "[MUX] Muxer opened: " << codecName << " in " << formatName << ", segments of " << segmentLength <<
+                " frames";
+    return true;
+  }
+
+  void deinit() {
+    if (fmt) {
+      if (fmt->pb) {
+        av_freep(&fmt->pb->buffer);
+        avio_context_free(&fmt->pb);
+      }
+      avformat_free_context(fmt);
+    }
+    fmt = nullptr;
+    if (pkt) av_packet_free(&pkt);
+    pkt = nullptr;
+  }
+
+  static int writeOutput(void *opaque, uint8_t *data, int size) {
+    ((AVMuxer *)opaque)->segment.append(data, size);
+    return size;
+  }
+
+  void emitSegment(int64_t pts, int64_t duration, uint16_t flags) {
+    AVSegmentInfo info;
+    info.size     = (uint32_t)segment.size();
+    info.sequence = sequence;
+    info.pts      = pts;
+    info.duration = duration;
+    info.flags    = flags;
+    ready.append(&info, sizeof(info));
+    ready.append(segment.data(), segment.size());
+    segment.clear();
+  }
+
+  bool closeSegment(uint16_t flags) {
+    if (container == AVContainer::FMP4 && av_write_frame(fmt, nullptr) < 0) {
+      LOG_ERROR << "[MUX] Could not write fragment " << sequence;
+      return false;
+    }
+    avio_flush(fmt->pb);
+    emitSegment(segmentPts, segmentEnd - segmentPts, flags);
+    sequence++;
+    segmentOpen = false;
+    return true;
+  }
+
+  // Muxes the encoder's packets, starting a new segment at keyframes.
+  bool muxPackets() {
+    bool ret = true;
+    size_t offset = 0;
+    AVPacketInfo info;
+    while (ret && offset + sizeof(info) <= packets.size()) {
+      memcpy(&info, packets.data() + offset, sizeof(info));
+      offset += sizeof(info);
+      if (offset + info.size > packets.size()) {
+        LOG_ERROR << "[MUX] Truncated packet record";
+        ret = false;
+        break;
+      }
+
+      bool key = (info.flags & AVPacketFlagKey) != 0;
+      if (key && segmentOpen && info.pts - segmentPts >= segmentLength && !closeSegment(0)) {
+        ret = false;
+        break;
+      }
+      if (!segmentOpen) {
+        segmentOpen = true;
+        segmentPts = segmentEnd = info.pts;
+        // each TS segment opens with PAT/PMT so it plays on its own
+        if (container == AVContainer::MPEGTS) av_opt_set(fmt->priv_data, "mpegts_flags", "+resend_headers", 0);
+      }
+
+      pkt->data         = packets.data() + offset;
+      pkt->size         = (int)info.size;
+      pkt->pts          = info.pts;
+      pkt->dts          = info.dts;
+      pkt->duration     = 1;
+      pkt->flags        = key ? AV_PKT_FLAG_KEY : 0;
+      pkt->stream_index = 0;
+      av_packet_rescale_ts(pkt, { 1, fps }, stream->time_base);
+      if (av_write_frame(fmt, pkt) < 0) {
+        LOG_ERROR << "[MUX] Could not mux packet " << info.pts;
+        ret = false;
+      }
+      av_packet_unref(pkt);
+      segmentEnd = std::max(segmentEnd, info.pts + 1);
+      offset += info.size;
+    }
+    packets.clear();
+    return ret;
+  }
+
+  bool output(bool ret, SingleArray *packetData) {
+    ret = muxPackets() && ret;
+    if (packetData) packetData->append(ready.data(), ready.size());
+    ready.clear();
+    return ret;
+  }
+
+  bool process(DoubleArray *frameData, SingleArray *packetData) override {
+    if (finished) {
+      LOG_ERROR << "[MUX] Stream already finished";
+      return false;
+    }
+    if (frameData) {
+      return output(encoder->process(frameData, &packets), packetData);
+    }
+
+    // the last segment closes with the stream, the trailer adds nothing a
+    // fragmented or segmented stream needs
+    bool ret = encoder->process(nullptr, &packets);
+    ret = muxPackets() && ret;
+    if (segmentOpen) ret = closeSegment(AVSegmentFlagLast) && ret;
+    av_write_trailer(fmt);
+    segment.clear();
+    finished = true;
+    return output(ret, packetData);
+  }
+
+  void setNextPts(int64_t pts) override {
+    encoder->setNextPts(pts);
+  }
+
+  bool setBitrate(uint32_t bps, uint32_t maxrate, uint32_t bufsize, SingleArray *packetData) override {
+    return output(encoder->setBitrate(bps, maxrate, bufsize, &packets), packetData);
+  }
+
+  bool forceKeyframe() override {
+    return encoder->forceKeyframe();
+  }
+
+  bool setResolution(int width, int height, SingleArray *packetData) override {
+    LOG_ERROR << "[MUX] Muxed streams keep their size";
+    return false;
+  }
+
+  bool isEncoder() const override { return true; }
+};
+
+AVEnc IAVEnc::createMuxer(const std::string &name, int width, int height, int fps, int bps, uint32_t flags,
+                          AVRawFormat format, const AVEncodeParams &params) {
+  auto mux = std::make_shared<AVMuxer>();
+  if (!mux) {
+    return nullptr;
+  }
+
+  if (!mux->init(name, width, height, fps, bps, flags, format, params)) {
+    return nullptr;
+  }
+
+  return mux;
+}
@@ -0,0 +1,262 @@
+#include <plog/Log.h>
+#include "av-sink.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+// O_DIRECT wants buffer address, length and file offset aligned to the
+// logical block size, 4K covers every common device.
+#define SINK_DIRECT_ALIGN (4 * 1024)
+#define SINK_DIRECT_BATCH (1024 * 1024)
+
+#ifndef _WIN32
+// Pipes have no MSG_NOSIGNAL. SIGPIPE is blocked around the write and the
+// one it raised is consumed, so a reader going away is an EPIPE error of
+// this sink, not the end of the process.
+static ssize_t writeNoSignal(int fd, const void *data, size_t size) {
+  sigset_t pipeSet, oldSet, pending;
+  sigemptyset(&pipeSet);
+  sigaddset(&pipeSet, SIGPIPE);
+  sigpending(&pending);
+  bool wasPending = sigismember(&pending, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+
+  ssize_t ret = ::write(fd, data, size);
+  int err = errno;
+  if (ret < 0 && err == EPIPE && !wasPending) {
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&pipeSet, nullptr, &zero) < 0 && errno == EINTR) {}
+  }
+
+  pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+  errno = err;
+  return ret;
+}
+#endif
+
+class AVSinkImpl : public IAVSink {
+public:
+  ~AVSinkImpl() {
+    flush();
+#ifdef _WIN32
+    if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+#else
+    if (fd >= 0) ::close(fd);
+#endif
+    if (batch) ::operator delete(batch, std::align_val_t(SINK_DIRECT_ALIGN));
+  }
+
+  bool init(const AVSinkInfo &info, const std::string &path, int _fd) {
+#ifdef _WIN32
+    if (info.type == AVSinkType::Fd) {
+      LOG_ERROR << "[SNK] Descriptor sinks are not supported";
+      return false;
+    }
+    // Windows has no page cache bypass without sector aligned writes at
+    // every call, write-through is the nearest match
+    bool append = info.type == AVSinkType::File && (info.flags & AVSinkFlagAppend);
+    DWORD attributes = FILE_ATTRIBUTE_NORMAL;
+    if (info.type == AVSinkType::File && (info.flags & AVSinkFlagDirect)) attributes |= FILE_FLAG_WRITE_THROUGH;
+    DWORD disposition = (info.type == AVSinkType::File) ? (append ? OPEN_ALWAYS : CREATE_ALWAYS) : OPEN_EXISTING;
+    hFile = CreateFileA(path.c_str(), append ? FILE_APPEND_DATA : GENERIC_WRITE, FILE_SHARE_READ, NULL, disposition,
+                        attributes, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+      LOG_ERROR << "[SNK] Could not open " << path << ". Error " << GetLastError();
+      return false;
+    }
+#else
+    switch (info.type) {
+      case AVSinkType::File: {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | ((info.flags & AVSinkFlagAppend) ? O_APPEND : O_TRUNC);
+        direct = (info.flags & AVSinkFlagDirect) != 0;
+        fd = ::open(path.c_str(), flags | (direct ? O_DIRECT : 0), 0644);
+        if (fd < 0 && direct && errno == EINVAL) {
+          // tmpfs and some network file systems refuse O_DIRECT
+          LOG_INFO << "[SNK] " << path << " does not support direct I/O";
+          direct = false;
+          fd = ::open(path.c_str(), flags, 0644);
+        }
+        if (fd >= 0 && direct && (::lseek(fd, 0, SEEK_END) % SINK_DIRECT_ALIGN)) {
+          setDirect(false);
+        }
+        break;
+      }
+      case AVSinkType::Fd: {
+        fd = _fd;
+        break;
+      }
+      case AVSinkType::Socket: {
+        fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (fd >= 0 && ::connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+          LOG_ERROR << "[SNK] Could not connect " << path << ". Error " << errno;
+          ::close(fd);
+          fd = -1;
+        }
+        break;
+      }
+      default: break;
+    }
+    if (fd < 0) {
+      LOG_ERROR << "[SNK] Could not open sink " << path << ". Error " << errno;
+      return false;
+    }
+
+    struct stat st;
+    if (!::fstat(fd, &st)) {
+      isSocket = S_ISSOCK(st.st_mode);
+      isPipe = S_ISFIFO(st.st_mode);
+    }
+#endif
+
+    batchSize = info.batchSize;
+    if (direct) {
+      if (!batchSize) batchSize = SINK_DIRECT_BATCH;
+      batchSize = (batchSize + SINK_DIRECT_ALIGN - 1) / SINK_DIRECT_ALIGN * SINK_DIRECT_ALIGN;
+    }
+    if (batchSize) {
+      batch = (uint8_t *)::operator new(batchSize, std::align_val_t(SINK_DIRECT_ALIGN));
+    }
+    LOG_INFO << "[SNK] Sink opened: " << (path.empty() ? "fd" : path) << ", batch " << batchSize <<
+                (direct ? ", direct" : "");
+    return true;
+  }
+
+  bool write(const void *data, size_t size) override {
+    if (counters.error) {
+      return false;
+    }
+    counters.bytes += size;
+    if (!batchSize) {
+      return writeOut(data, size);
+    }
+
+    auto ptr = (const uint8_t *)data;
+    // whole batches skip the copy unless direct I/O needs the aligned buffer
+    if (!batchUsed && !direct && size >= batchSize) {
+      return writeOut(ptr, size);
+    }
+    while (size) {
+      size_t chunk = std::min(size, batchSize - batchUsed);
+      memcpy(batch + batchUsed, ptr, chunk);
+      batchUsed += chunk;
+      ptr += chunk;
+      size -= chunk;
+      if (batchUsed == batchSize) {
+        batchUsed = 0;
+        if (!writeOut(batch, batchSize)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // A partial batch cannot be written with O_DIRECT, so the sink falls back
+  // to buffered writes from then on; flushes are meant for the stream end.
+  bool flush() override {
+    if (!batchUsed || counters.error) {
+      return !counters.error;
+    }
+    if (direct && (batchUsed % SINK_DIRECT_ALIGN)) {
+      setDirect(false);
+    }
+    size_t size = batchUsed;
+    batchUsed = 0;
+    return writeOut(batch, size);
+  }
+
+protected:
+  bool writeOut(const void *data, size_t size) {
+    auto ptr = (const uint8_t *)data;
+    size_t totalBytes = 0;
+#ifdef _WIN32
+    DWORD bytesWritten = 0;
+    while (totalBytes < size) {
+      DWORD chunk = (DWORD)std::min(size - totalBytes, (size_t)0x40000000);
+      if (!WriteFile(hFile, &ptr[totalBytes], chunk, &bytesWritten, NULL)) {
+        counters.error = (int32_t)GetLastError();
+        break;
+      }
+      totalBytes += bytesWritten;
+    }
+#else
+    while (totalBytes < size) {
+      ssize_t ret = isSocket ? ::send(fd, &ptr[totalBytes], size - totalBytes, MSG_NOSIGNAL) :
+                    isPipe ? writeNoSignal(fd, &ptr[totalBytes], size - totalBytes) :
+                             ::write(fd, &ptr[totalBytes], size - totalBytes);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // inherited descriptors may be non-blocking
+        struct pollfd fds = { fd, POLLOUT, 0 };
+        ::poll(&fds, 1, -1);
+        continue;
+      }
+      if (ret <= 0) {
+        counters.error = (ret < 0) ? errno : EIO;
+        break;
+      }
+      totalBytes += ret;
+    }
+#endif
+    counters.written += totalBytes;
+    if (counters.error) {
+      LOG_ERROR << "[SNK] Write failed. Error " << counters.error <<
+                   ((counters.error == EPIPE) ? ", the reader has gone away" : "");
+      return false;
+    }
+    return true;
+  }
+
+#ifndef _WIN32
+  void setDirect(bool enable) {
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags != -1) ::fcntl(fd, F_SETFL, enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT));
+    direct = enable;
+  }
+#endif
+
+#ifdef _WIN32
+  HANDLE hFile = INVALID_HANDLE_VALUE;
+#else
+  int fd = -1;
+  bool isSocket = false;
+  bool isPipe = false;
+#endif
+  bool direct = false;
+  uint8_t *batch = nullptr;
+  size_t batchSize = 0;
+  size_t batchUsed = 0;
+};
+
+AVSink IAVSink::open(const AVSinkInfo &info, const std::string &path, int fd) {
+  auto sink = std::make_shared<AVSinkImpl>();
+  if (!sink) {
+    return nullptr;
+  }
+
+  if (!sink->init(info, path, fd)) {
+    return nullptr;
+  }
+
+  return sink;
+}
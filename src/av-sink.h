@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "libav_service.h"
+
+class IAVSink;
+typedef std::shared_ptr<IAVSink> AVSink;
+
+// Destination of a session's encoded output inside the service. Writes are
+// gathered into batches of AVSinkInfo::batchSize bytes, the rest goes out on
+// flush() or when the sink is destroyed.
+class IAVSink {
+public:
+  virtual ~IAVSink() {}
+
+  virtual bool write(const void *data, size_t size) = 0;
+  virtual bool flush() = 0;
+
+  const AVSinkStatus &status() const { return counters; }
+
+  // 'fd' is the descriptor received for AVSinkType::Fd, the sink owns it.
+  static AVSink open(const AVSinkInfo &info, const std::string &path, int fd);
+
+protected:
+  AVSinkStatus counters = {};
+};
@@ -0,0 +1,155 @@
+#include <plog/Log.h>
+#include "av.h"
+#include "pixconv.h"
+#include <string>
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#if defined (__cplusplus)
+}
+#endif
+
+// Decoder chained into an encoder. Decoded frames stay ref-counted AVFrames
+// from the decoder to the encoder; only a size or pixel format change adds a
+// converted copy.
+class AVTranscoder : public IAVEnc {
+public:
+  AVEnc decoder;
+  AVEnc encoder;
+  int width = 0, height = 0;
+  bool clientPts = false;
+
+  bool init(const std::string &decoderName, const std::string &encoderName, int _width, int _height,
+            int fps, int bps, uint32_t flags, const AVEncodeParams &params) {
+    if (params.sourceWidth <= 0 || params.sourceHeight <= 0) {
+      LOG_ERROR << "[TRC] Missing source size";
+      return false;
+    }
+
+    // most of a large reduction is done by the decoder's box filter, the
+    // bilinear stage only covers the remaining factor of up to 2
+    AVEncodeParams decodeParams;
+    decodeParams.threadType    = params.threadType;
+    decodeParams.threadCount   = params.threadCount;
+    decodeParams.decodeProfile = params.decodeProfile;
+    decodeParams.skipFrames    = params.skipFrames;
+    decodeParams.downscale     = params.downscale;
+    while (!params.downscale && decodeParams.downscale < AV_DOWNSCALE_MAX &&
+           downscaledSize(params.sourceWidth, decodeParams.downscale + 1) >= _width &&
+           downscaledSize(params.sourceHeight, decodeParams.downscale + 1) >= _height) {
+      decodeParams.downscale++;
+    }
+
+    uint32_t decodeFlags = AVInitFlagFrameRefs | (flags & AVInitFlagFramedInput);
+    decoder = createDecoder(decoderName, params.sourceWidth, params.sourceHeight, decodeFlags, AVRawFormat::I420,
+                            decodeParams);
+    if (!decoder) {
+      return false;
+    }
+
+    uint32_t encodeFlags = flags & (AVInitFlagPacketInfo | AVInitFlagClientPts);
+    encoder = createEncoder(encoderName, _width, _height, fps, bps, encodeFlags, AVRawFormat::I420, params);
+    if (!encoder) {
+      return false;
+    }
+
+    width = _width;
+    height = _height;
+    clientPts = (flags & AVInitFlagClientPts) != 0;
+    codecName = decoder->getName() + ">" + encoder->getName();
+    LOG_INFO << "[TRC] Transcoder opened: " << codecName << ", " << params.sourceWidth << "x" << params.sourceHeight <<
+                " -> " << width << "x" << height;
+    return true;
+  }
+
+  bool encodeDecoded(SingleArray *packetData) {
+    while (auto frame = decoder->popFrame()) {
+      // the encoders take I420, high bit depth and 4:2:2/4:4:4 sources are
+      // converted here
+      if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+        frame = convertToI420(frame.get());
+        if (!frame) {
+          LOG_ERROR << "[TRC] Could not convert video frame to I420";
+          return false;
+        }
+      }
+      if (frame->width != width || frame->height != height) {
+        frame = scaleFrame(frame, width, height);
+        if (!frame) {
+          LOG_ERROR << "[TRC] Could not scale video frame";
+          return false;
+        }
+      }
+      if (clientPts) {
+        encoder->setNextPts(frame->pts);
+      }
+      if (!encoder->encodeFrame(frame, packetData)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool transcode(SingleArray &input, SingleArray *packetData) override {
+    DoubleArray unused;
+    if (!decoder->process(&unused, &input)) {
+      return false;
+    }
+    return encodeDecoded(packetData);
+  }
+
+  // Raw frames are not accepted, only the flush (frameData == nullptr).
+  bool process(DoubleArray *frameData, SingleArray *packetData) override {
+    if (frameData) {
+      LOG_ERROR << "[TRC] Transcoders take packets, not frames";
+      return false;
+    }
+
+    DoubleArray unused;
+    bool drained = decoder->process(&unused, nullptr);
+    if (!encodeDecoded(packetData)) {
+      return false;
+    }
+    return encoder->process(nullptr, packetData) && drained;
+  }
+
+  void setNextPts(int64_t pts) override {
+    decoder->setNextPts(pts);
+  }
+
+  bool setBitrate(uint32_t bps, uint32_t maxrate, uint32_t bufsize, SingleArray *packetData) override {
+    return encoder->setBitrate(bps, maxrate, bufsize, packetData);
+  }
+
+  bool forceKeyframe() override {
+    return encoder->forceKeyframe();
+  }
+
+  bool setResolution(int _width, int _height, SingleArray *packetData) override {
+    if (!encoder->setResolution(_width, _height, packetData)) {
+      return false;
+    }
+    width = _width;
+    height = _height;
+    return true;
+  }
+
+  bool isEncoder() const override { return true; }
+  bool isTranscoder() const override { return true; }
+};
+
+AVEnc IAVEnc::createTranscoder(const std::string &decoderName, const std::string &encoderName, int width, int height,
+                               int fps, int bps, uint32_t flags, const AVEncodeParams &params) {
+  auto trc = std::make_shared<AVTranscoder>();
+  if (!trc) {
+    return nullptr;
+  }
+
+  if (!trc->init(decoderName, encoderName, width, height, fps, bps, flags, params)) {
+    return nullptr;
+  }
+
+  return trc;
+}
@@ -6,10 +6,63 @@
 #include <set>
 #include <string>
 #include <vector>
+#include "buffer-pool.h"
+#include "libav_service.h"
 
-typedef std::vector<uint8_t> SingleArray;
+typedef PoolBuffer SingleArray;
 typedef std::vector<SingleArray> DoubleArray;
 
+// Room reserved behind decoder input, AV_INPUT_BUFFER_PADDING_SIZE.
+#define AV_PACKET_PADDING 64
+
+struct AVFrame;
+struct AVCodecParameters;
+// Decoded frame still owned by libavcodec's buffer pool.
+typedef std::shared_ptr<AVFrame> FrameRef;
+
+// Plane layout of a FrameRef, data[i] points into the frame itself.
+struct FramePlanes {
+  AVFramePlanes desc;
+  const uint8_t *data[AV_FRAME_MAX_PLANES];
+  size_t totalSize;
+};
+bool getFramePlanes(const FrameRef &frame, uint32_t frameId, FramePlanes &planes);
+// Resized copy of an I420 frame: box filtered by powers of two while at least
+// twice the target, bilinear for the rest.
+FrameRef scaleFrame(const FrameRef &frame, int width, int height);
+// I420 copy of a frame in any other software pixel format, via libswscale.
+FrameRef convertToI420(const AVFrame *frame);
+
+// Codec settings of an AVInitExt block, empty/zero fields keep the defaults.
+// Decoders use the thread settings, decodeProfile, skipFrames, downscale and
+// options. Transcoders pass the source and decoder fields to their decoder,
+// the thread settings to both and everything else to their encoder.
+struct AVEncodeParams {
+  AVThreadType threadType = AVThreadType::Default;
+  int threadCount = 0;
+  AVRateControl rateControl = AVRateControl::Default;
+  int crf = 0;
+  uint32_t maxrate = 0;
+  uint32_t bufsize = 0;
+  int gop = 0;
+  int bframes = -1;
+  std::string preset;
+  std::string tune;
+  AVDecodeProfile decodeProfile = AVDecodeProfile::Default;
+  AVSkipFrames skipFrames = AVSkipFrames::Default;
+  int downscale = 0;
+  std::string sourceCodec;
+  int sourceWidth = 0;
+  int sourceHeight = 0;
+  std::vector<AVRendition> renditions;
+  int chunkFrames = 0;
+  int chunkEncoders = 0;
+  AVContainer container = AVContainer::None;
+  int segmentMs = 0;
+  std::string sourcePath;
+  std::vector<std::pair<std::string, std::string>> options;
+};
+
 class IAVEnc;
 typedef std::shared_ptr<IAVEnc> AVEnc;
 class IAVEnc {
@@ -20,12 +73,59 @@ public:
 
   static std::set<std::string> getEncoders();
   static std::set<std::string> getDecoders();
+  // Every getEncoders/getDecoders candidate, probed with avcodec_open2 once
+  // per libav build and host. The result is kept in a per-user cache file,
+  // 'refresh' probes again and rewrites it.
+  static std::vector<AVCodecCaps> getCapabilities(bool refresh = false);
 
-  static AVEnc createEncoder(const std::string &name, int width, int height, int framesPerSecond, int bitsPerSecond);
-  static AVEnc createDecoder(const std::string &name, int width, int height);
+  static AVEnc createEncoder(const std::string &name, int width, int height, int framesPerSecond, int bitsPerSecond,
+                             uint32_t flags = 0, AVRawFormat format = AVRawFormat::I420,
+                             const AVEncodeParams &params = AVEncodeParams());
+  static AVEnc createDecoder(const std::string &name, int width, int height, uint32_t flags = 0,
+                             AVRawFormat format = AVRawFormat::I420,
+                             const AVEncodeParams &params = AVEncodeParams());
+  // ABR ladder fed at width x height, one encoder thread per rendition.
+  static AVEnc createLadder(const std::string &name, int width, int height, int framesPerSecond, uint32_t flags,
+                            AVRawFormat format, const AVEncodeParams &params);
+  // Offline encoder splitting the input into closed-GOP chunks of
+  // params.chunkFrames, encoded concurrently without B-frames and stitched
+  // back in order.
+  static AVEnc createChunked(const std::string &name, int width, int height, int framesPerSecond, int bitsPerSecond,
+                             uint32_t flags, AVRawFormat format, const AVEncodeParams &params);
+  // Decoder reading the file params.sourcePath itself, see AVInitFlagFileInput.
+  // An empty name picks the decoder for the file's video codec.
+  static AVEnc createFileDecoder(const std::string &name, uint32_t flags, AVRawFormat format,
+                                 const AVEncodeParams &params);
+  // Encoder whose packets are muxed into params.container segments, returned
+  // as AVSegmentInfo records.
+  static AVEnc createMuxer(const std::string &name, int width, int height, int framesPerSecond, int bitsPerSecond,
+                           uint32_t flags, AVRawFormat format, const AVEncodeParams &params);
+  static AVEnc createTranscoder(const std::string &decoderName, const std::string &encoderName, int width, int height,
+                                int framesPerSecond, int bitsPerSecond, uint32_t flags,
+                                const AVEncodeParams &params);
 
 
   virtual bool isEncoder() const = 0;
+  // Transcoders report isEncoder() for their output, their input are packets.
+  virtual bool isTranscoder() const { return false; }
   virtual bool process(DoubleArray *frameData, SingleArray *packetData) = 0;
+  // Next decoded frame of an AVInitFlagFrameRefs decoder, process() leaves
+  // frameData empty in that mode.
+  virtual FrameRef popFrame() { return nullptr; }
+  // pts of the next input handed to process(), AVInitFlagClientPts sessions.
+  virtual void setNextPts(int64_t pts) {}
+  // Encoders: sends a decoded I420 frame by reference, without copying it.
+  virtual bool encodeFrame(const FrameRef &frame, SingleArray *packetData) { return false; }
+  // Transcoders: decodes 'input' and appends the re-encoded packets.
+  virtual bool transcode(SingleArray &input, SingleArray *packetData) { return false; }
+
+  // Live encoder reconfiguration. Codecs that cannot change in place drain
+  // their pending packets into 'packetData' and reopen the codec context.
+  virtual bool setBitrate(uint32_t bps, uint32_t maxrate, uint32_t bufsize, SingleArray *packetData) { return false; }
+  virtual bool forceKeyframe() { return false; }
+  virtual bool setResolution(int width, int height, SingleArray *packetData) { return false; }
+  // Stream parameters of an encoder's output, extradata included when the
+  // codec was opened with global headers.
+  virtual bool getCodecParameters(AVCodecParameters *par) const { return false; }
   const std::string &getName() const { return codecName; }
 };
\ No newline at end of file
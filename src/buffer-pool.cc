@@ -0,0 +1,189 @@
+#include <plog/Log.h>
+#include "buffer-pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Every buffer is preceded by one alignment unit holding its bookkeeping,
+// so release() needs nothing but the data pointer.
+struct BufferHeader {
+  size_t capacity;
+  bool mapped;
+};
+static_assert(sizeof(BufferHeader) <= BUFFER_POOL_ALIGN, "buffer header must fit the alignment");
+
+static BufferHeader *headerOf(uint8_t *data) {
+  return (BufferHeader *)(data - BUFFER_POOL_ALIGN);
+}
+
+BufferPool &BufferPool::get() {
+  // never destroyed, buffers may still be released during static destruction
+  static BufferPool *pool = new BufferPool();
+  return *pool;
+}
+
+uint8_t *BufferPool::allocate(size_t capacity) {
+  size_t total = capacity + BUFFER_POOL_ALIGN;
+  uint8_t *base = nullptr;
+  bool mapped = false;
+
+#ifdef _WIN32
+  base = (uint8_t *)_aligned_malloc(total, BUFFER_POOL_ALIGN);
+#else
+  if (hugePages && capacity >= HUGE_PAGE_SIZE) {
+    void *ptr = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+      madvise(ptr, total, MADV_HUGEPAGE);
+#endif
+      base = (uint8_t *)ptr;
+      mapped = true;
+    }
+  }
+  if (!base) {
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, BUFFER_POOL_ALIGN, total) == 0) base = (uint8_t *)ptr;
+  }
+#endif
+
+  if (!base) {
+    LOG_ERROR << "[POOL] Failed to allocate " << capacity << " bytes";
+    return nullptr;
+  }
+
+  auto data = base + BUFFER_POOL_ALIGN;
+  headerOf(data)->capacity = capacity;
+  headerOf(data)->mapped = mapped;
+  return data;
+}
+
+void BufferPool::free(uint8_t *data) {
+  auto header = headerOf(data);
+#ifdef _WIN32
+  _aligned_free(header);
+#else
+  if (header->mapped) munmap(header, header->capacity + BUFFER_POOL_ALIGN);
+  else ::free(header);
+#endif
+}
+
+uint8_t *BufferPool::acquire(size_t size, size_t *capacity) {
+  // small buffers round to the alignment, large ones to whole pages
+  size_t round = (size < 4096) ? BUFFER_POOL_ALIGN : 4096;
+  size_t cap = (size + round - 1) & ~(round - 1);
+  if (!cap) cap = BUFFER_POOL_ALIGN;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // reuse a pooled buffer unless it would waste more than a quarter
+    auto it = freeBuffers.lower_bound(cap);
+    if (it != freeBuffers.end() && it->first <= cap + cap / 4) {
+      auto data = it->second;
+      *capacity = it->first;
+      counters.hits++;
+      counters.bytesPooled -= it->first;
+      freeBuffers.erase(it);
+      return data;
+    }
+    counters.misses++;
+  }
+
+  auto data = allocate(cap);
+  if (!data) {
+    *capacity = 0;
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  counters.bytesResident += cap;
+  *capacity = cap;
+  return data;
+}
+
+void BufferPool::release(uint8_t *data) {
+  if (!data) {
+    return;
+  }
+
+  size_t cap = headerOf(data)->capacity;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (counters.bytesPooled + cap <= BUFFER_POOL_MAX_BYTES) {
+      freeBuffers.emplace(cap, data);
+      counters.bytesPooled += cap;
+      return;
+    }
+    counters.bytesResident -= cap;
+  }
+  free(data);
+}
+
+BufferPool::Stats BufferPool::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+void BufferPool::trim() {
+  std::multimap<size_t, uint8_t *> buffers;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffers.swap(freeBuffers);
+    counters.bytesResident -= counters.bytesPooled;
+    counters.bytesPooled = 0;
+  }
+  for (auto &b : buffers) free(b.second);
+}
+
+
+void PoolBuffer::reserve(size_t size) {
+  if (size <= cap) {
+    return;
+  }
+
+  size_t newCap = 0;
+  auto newPtr = BufferPool::get().acquire(size, &newCap);
+  if (!newPtr) {
+    throw std::bad_alloc();
+  }
+  size_t used = length;
+  if (used) memcpy(newPtr, ptr, used);
+  release();
+  ptr = newPtr;
+  length = used;
+  cap = newCap;
+}
+
+void PoolBuffer::release() {
+  if (done) done(opaque);
+  else BufferPool::get().release(ptr);
+  done = nullptr;
+  opaque = nullptr;
+  ptr = nullptr;
+  length = cap = 0;
+}
+
+PoolBuffer PoolBuffer::wrap(uint8_t *data, size_t size, size_t capacity, void (*done)(void *), void *opaque) {
+  PoolBuffer buffer;
+  buffer.ptr = data;
+  buffer.length = size;
+  buffer.cap = capacity;
+  buffer.done = done;
+  buffer.opaque = opaque;
+  return buffer;
+}
+
+void PoolBuffer::append(const void *data, size_t size) {
+  if (length + size > cap) reserve(std::max(length + size, cap + cap / 2));
+  if (size) memcpy(ptr + length, data, size);
+  length += size;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#define BUFFER_POOL_ALIGN     64
+#define BUFFER_POOL_MAX_BYTES (512 * 1024 * 1024)
+
+// Process wide pool of 64-byte aligned, uninitialized buffers. Freed buffers
+// are kept per capacity and handed out again for requests of a similar size,
+// so steady streams of frames and packets stop hitting the allocator.
+class BufferPool {
+public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytesResident;
+    uint64_t bytesPooled;
+  };
+
+  static BufferPool &get();
+
+  uint8_t *acquire(size_t size, size_t *capacity);
+  void release(uint8_t *data);
+
+  // Large buffers are backed by transparent huge pages where available.
+  void setHugePages(bool enable) { hugePages = enable; }
+  Stats stats();
+  void trim();
+
+protected:
+  BufferPool() {}
+
+  uint8_t *allocate(size_t capacity);
+  void free(uint8_t *data);
+
+  std::mutex mutex;
+  std::multimap<size_t, uint8_t *> freeBuffers;
+  Stats counters = {};
+  bool hugePages = false;
+};
+
+// Move-only byte array drawing its storage from BufferPool. It mirrors the
+// parts of std::vector the codecs use, but resize() does not zero new bytes.
+class PoolBuffer {
+public:
+  PoolBuffer() {}
+  explicit PoolBuffer(size_t size) { resize(size); }
+  PoolBuffer(PoolBuffer &&other) { swap(other); }
+  // Memory owned elsewhere, e.g. a shared memory slot. 'done' gets 'opaque'
+  // once the buffer lets go of it, growing past 'capacity' copies into
+  // pooled storage first.
+  static PoolBuffer wrap(uint8_t *data, size_t size, size_t capacity, void (*done)(void *), void *opaque);
+  PoolBuffer(const PoolBuffer &) = delete;
+  ~PoolBuffer() { release(); }
+
+  PoolBuffer &operator = (PoolBuffer &&other) {
+    if (this != &other) {
+      release();
+      swap(other);
+    }
+    return *this;
+  }
+  PoolBuffer &operator = (const PoolBuffer &) = delete;
+
+  uint8_t *data() { return ptr; }
+  const uint8_t *data() const { return ptr; }
+  size_t size() const { return length; }
+  size_t capacity() const { return cap; }
+  bool empty() const { return !length; }
+
+  uint8_t &operator [] (size_t idx) { return ptr[idx]; }
+  const uint8_t &operator [] (size_t idx) const { return ptr[idx]; }
+  uint8_t *begin() { return ptr; }
+  uint8_t *end() { return ptr + length; }
+  const uint8_t *begin() const { return ptr; }
+  const uint8_t *end() const { return ptr + length; }
+
+  void reserve(size_t size);
+  void resize(size_t size) { if (size > cap) reserve(size); length = size; }
+  void clear() { length = 0; }
+  // Returns the storage to the pool, clear() keeps it.
+  void release();
+
+  void append(const void *data, size_t size);
+  void push_back(uint8_t value) { append(&value, 1); }
+
+  void swap(PoolBuffer &other) {
+    std::swap(ptr, other.ptr);
+    std::swap(length, other.length);
+    std::swap(cap, other.cap);
+    std::swap(done, other.done);
+    std::swap(opaque, other.opaque);
+  }
+
+protected:
+  uint8_t *ptr = nullptr;
+  size_t length = 0;
+  size_t cap = 0;
+  void (*done)(void *) = nullptr;   // wrapped memory
+  void *opaque = nullptr;
+};
@@ -1,4 +1,5 @@
 #include "common.h"
+#include <algorithm>
 
 std::string to_string(const std::wstring& str) {
   std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> utf16conv;
@@ -12,9 +13,9 @@ bool readAVCmd(IPCPipe pipe, AVCmd* cmd, int timeoutMs) {
   return true;
 }
 
-void sendAVCmdResult(IPCPipe pipe, AVCmdResult res, size_t size) {
-  pipe->write(&res, sizeof(res));
-  pipe->write(&size, sizeof(size));
+void sendAVCmdResult(IPCPipe pipe, AVCmdResult res, size_t size, const void *data) {
+  IPCBuffer parts[] = { { &res, sizeof(res) }, { &size, sizeof(size) }, { data, (data) ? size : 0 } };
+  pipe->writev(parts, 3);
 }
 
 AVCmdResult readAVCmdResult(IPCPipe pipe, size_t* size) {
@@ -39,12 +40,14 @@ AVCmdResult sendAVCmd(IPCPipe pipe, const AVCmd& cmd, size_t* size) {
 
 AVCmdResult sendAVCmd(IPCPipe pipe, AVCmdType cmd) {
   AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
   cmdMsg.type = cmd;
   return sendAVCmd(pipe, cmdMsg);
 }
 
-AVCmdResult getPacket(IPCPipe pipe, std::vector<uint8_t>& data) {
+AVCmdResult getPacket(IPCPipe pipe, SingleArray& data) {
   AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
   size_t size = 0;
 
   data.clear();
@@ -55,15 +58,16 @@ AVCmdResult getPacket(IPCPipe pipe, std::vector<uint8_t>& data) {
   }
 
   data.resize(size);
-  if (pipe->read(data.data(), size, 5000) != size) {
+  if (pipe->readPayload(data.data(), size, 5000) != size) {
     data.clear();
     return AVCmdResult::Nack;
   }
   return AVCmdResult::Ack;
 }
 
-AVCmdResult getFrame(IPCPipe pipe, std::vector<uint8_t>& data) {
+AVCmdResult getFrame(IPCPipe pipe, SingleArray& data) {
   AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
   size_t size = 0;
 
   data.clear();
@@ -74,20 +78,427 @@ AVCmdResult getFrame(IPCPipe pipe, std::vector<uint8_t>& data) {
   }
 
   data.resize(size);
-  if (pipe->read(data.data(), size, 5000) != size) {
+  if (pipe->readPayload(data.data(), size, 5000) != size) {
     data.clear();
     return AVCmdResult::Nack;
   }
   return AVCmdResult::Ack;
 }
 
+AVCmdResult getSegment(IPCPipe pipe, SingleArray &data) {
+  AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
+  size_t size = 0;
+
+  data.clear();
+
+  cmdMsg.type = AVCmdType::GetSegment;
+  if (sendAVCmd(pipe, cmdMsg, &size) != AVCmdResult::Ack || size == 0) {
+    return AVCmdResult::Nack;
+  }
+
+  data.resize(size);
+  if (pipe->readPayload(data.data(), size, 5000) != size) {
+    data.clear();
+    return AVCmdResult::Nack;
+  }
+  return AVCmdResult::Ack;
+}
+
+AVCmdResult getFrameRef(IPCPipe pipe, AVFramePlanes &desc, const uint8_t **payload) {
+  AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
+  size_t size = 0;
+
+  *payload = nullptr;
+  pipe->releasePayload();
+
+  cmdMsg.type = AVCmdType::GetFrame;
+  if (sendAVCmd(pipe, cmdMsg, &size) != AVCmdResult::Ack || size < sizeof(AVFramePlanes)) {
+    return AVCmdResult::Nack;
+  }
+
+  auto data = pipe->peekPayload(size, 5000);
+  if (!data) {
+    return AVCmdResult::Nack;
+  }
+  memcpy(&desc, data, sizeof(desc));
+  *payload = data;
+  return AVCmdResult::Ack;
+}
+
+AVCmdResult setSink(IPCPipe pipe, const AVSinkInfo &info, const std::string &path, int fd) {
+  AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
+  cmdMsg.type = AVCmdType::SetSink;
+  cmdMsg.size = sizeof(info) + path.size();
+
+  IPCBuffer parts[] = { { &info, sizeof(info) }, { path.data(), path.size() } };
+  if (pipe->write(&cmdMsg, sizeof(cmdMsg)) != sizeof(cmdMsg) || pipe->writePayload(parts, 2) != cmdMsg.size) {
+    return AVCmdResult::Nack;
+  }
+  if (info.type == AVSinkType::Fd && !pipe->sendFd(fd)) {
+    return AVCmdResult::Nack;
+  }
+  return readAVCmdResult(pipe);
+}
+
+AVCmdResult getSinkStatus(IPCPipe pipe, AVSinkStatus &status) {
+  AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
+  size_t size = 0;
+
+  cmdMsg.type = AVCmdType::GetSinkStatus;
+  if (sendAVCmd(pipe, cmdMsg, &size) != AVCmdResult::Ack || size != sizeof(status)) {
+    return AVCmdResult::Nack;
+  }
+  if (pipe->read(&status, sizeof(status), 5000) != sizeof(status)) {
+    return AVCmdResult::Nack;
+  }
+  return AVCmdResult::Ack;
+}
+
+AVCmdResult getStats(IPCPipe pipe, AVServiceStats &stats) {
+  AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
+  memset(&stats, 0, sizeof(stats));
+  size_t size = 0;
+
+  cmdMsg.type = AVCmdType::GetStats;
+  if (sendAVCmd(pipe, cmdMsg, &size) != AVCmdResult::Ack) {
+    return AVCmdResult::Nack;
+  }
+  // a newer service may send a longer record
+  SingleArray data(size);
+  if (size && pipe->read(data.data(), size, 5000) != size) {
+    return AVCmdResult::Nack;
+  }
+  memcpy(&stats, data.data(), std::min(size, sizeof(stats)));
+  return AVCmdResult::Ack;
+}
+
+AVCmdResult releaseFrame(IPCPipe pipe, uint32_t frameId) {
+  AVCmd cmdMsg;
+  memset(&cmdMsg, 0, sizeof(cmdMsg));
+
+  pipe->releasePayload();
+  cmdMsg.type = AVCmdType::ReleaseFrame;
+  cmdMsg.size = frameId;
+  return sendAVCmd(pipe, cmdMsg);
+}
+
+bool nextPacket(const SingleArray &payload, size_t &offset, AVPacketInfo &info, const uint8_t **data) {
+  if (offset + sizeof(info) > payload.size()) {
+    return false;
+  }
+  memcpy(&info, payload.data() + offset, sizeof(info));
+  if (offset + sizeof(info) + info.size > payload.size()) {
+    LOG_ERROR << "[AV] Truncated packet record at " << offset;
+    return false;
+  }
+  *data = payload.data() + offset + sizeof(info);
+  offset += sizeof(info) + info.size;
+  return true;
+}
+
+bool nextSegment(const SingleArray &payload, size_t &offset, AVSegmentInfo &info, const uint8_t **data) {
+  if (offset + sizeof(info) > payload.size()) {
+    return false;
+  }
+  memcpy(&info, payload.data() + offset, sizeof(info));
+  if (offset + sizeof(info) + info.size > payload.size()) {
+    LOG_ERROR << "[AV] Truncated segment record at " << offset;
+    return false;
+  }
+  *data = payload.data() + offset + sizeof(info);
+  offset += sizeof(info) + info.size;
+  return true;
+}
+
+void sendAVCmdReply(IPCPipe pipe, const AVCmd &cmd, AVCmdType type, AVCmdResult res, size_t size, const void *data) {
+  AVCmdReply reply;
+  reply.result    = res;
+  reply.type      = type;
+  reply.requestId = cmd.requestId;
+  reply.seq       = cmd.seq;
+  reply.size      = size;
+  IPCBuffer parts[] = { { &reply, sizeof(reply) }, { data, (data) ? size : 0 } };
+  pipe->writev(parts, 2);
+}
+
+void packInitExt(const AVEncodeParams &params, SingleArray &data) {
+  AVInitExt ext;
+  memset(&ext, 0, sizeof(ext));
+  ext.version     = AV_INIT_EXT_VERSION;
+  ext.headerSize  = sizeof(ext);
+  ext.threadType  = params.threadType;
+  ext.threadCount = (uint8_t)params.threadCount;
+  ext.rateControl = params.rateControl;
+  ext.bframes     = (int8_t)params.bframes;
+  ext.gop         = params.gop;
+  ext.maxrate     = params.maxrate;
+  ext.bufsize     = params.bufsize;
+  ext.crf         = (uint8_t)params.crf;
+  strncpy(ext.preset, params.preset.c_str(), sizeof(ext.preset) - 1);
+  strncpy(ext.tune, params.tune.c_str(), sizeof(ext.tune) - 1);
+  ext.decodeProfile = params.decodeProfile;
+  ext.skipFrames    = params.skipFrames;
+  ext.downscale     = (uint8_t)params.downscale;
+  strncpy(ext.sourceCodec, params.sourceCodec.c_str(), sizeof(ext.sourceCodec) - 1);
+  ext.sourceWidth   = (uint16_t)params.sourceWidth;
+  ext.sourceHeight  = (uint16_t)params.sourceHeight;
+  ext.renditionCount = (uint8_t)std::min(params.renditions.size(), (size_t)AV_MAX_RENDITIONS);
+  std::copy(params.renditions.begin(), params.renditions.begin() + ext.renditionCount, ext.renditions);
+  ext.chunkFrames   = (uint16_t)params.chunkFrames;
+  ext.chunkEncoders = (uint8_t)params.chunkEncoders;
+  ext.container     = params.container;
+  ext.segmentMs     = (uint32_t)params.segmentMs;
+  strncpy(ext.sourcePath, params.sourcePath.c_str(), sizeof(ext.sourcePath) - 1);
+
+  data.clear();
+  data.append(&ext, sizeof(ext));
+  for (auto &opt : params.options) {
+    data.append(opt.first.c_str(), opt.first.length() + 1);
+    data.append(opt.second.c_str(), opt.second.length() + 1);
+  }
+}
+
+bool parseInitExt(const uint8_t *data, size_t size, AVEncodeParams &params) {
+  AVInitExt ext;
+  memset(&ext, 0, sizeof(ext));
+  if (size < 2 * sizeof(uint16_t)) {
+    return false;
+  }
+  memcpy(&ext, data, 2 * sizeof(uint16_t));
+  if (!ext.version || ext.headerSize < 2 * sizeof(uint16_t) || ext.headerSize > size) {
+    LOG_ERROR << "[AV] Invalid init block: version " << ext.version << ", header " << ext.headerSize;
+    return false;
+  }
+  // older writers send a shorter header, newer ones fields we skip
+  memcpy(&ext, data, std::min((size_t)ext.headerSize, sizeof(ext)));
+  if (ext.headerSize < sizeof(ext)) {
+    memset((uint8_t *)&ext + ext.headerSize, 0, sizeof(ext) - ext.headerSize);
+  }
+
+  params = AVEncodeParams();
+  params.threadType  = ext.threadType;
+  params.threadCount = ext.threadCount;
+  params.rateControl = ext.rateControl;
+  params.bframes     = ext.bframes;
+  params.gop         = ext.gop;
+  params.maxrate     = ext.maxrate;
+  params.bufsize     = ext.bufsize;
+  params.crf         = ext.crf;
+  params.preset.assign(ext.preset, strnlen(ext.preset, sizeof(ext.preset)));
+  params.tune.assign(ext.tune, strnlen(ext.tune, sizeof(ext.tune)));
+  params.decodeProfile = ext.decodeProfile;
+  params.skipFrames    = ext.skipFrames;
+  params.downscale     = ext.downscale;
+  params.sourceCodec.assign(ext.sourceCodec, strnlen(ext.sourceCodec, sizeof(ext.sourceCodec)));
+  params.sourceWidth   = ext.sourceWidth;
+  params.sourceHeight  = ext.sourceHeight;
+  if (ext.renditionCount > AV_MAX_RENDITIONS) {
+    LOG_ERROR << "[AV] Too many renditions: " << (int)ext.renditionCount;
+    return false;
+  }
+  params.renditions.assign(ext.renditions, ext.renditions + ext.renditionCount);
+  params.chunkFrames   = ext.chunkFrames;
+  params.chunkEncoders = ext.chunkEncoders;
+  params.container     = ext.container;
+  params.segmentMs     = ext.segmentMs;
+  params.sourcePath.assign(ext.sourcePath, strnlen(ext.sourcePath, sizeof(ext.sourcePath)));
+
+  auto ptr = (const char *)data + ext.headerSize;
+  auto end = (const char *)data + size;
+  while (ptr < end) {
+    auto keyEnd = (const char *)memchr(ptr, 0, end - ptr);
+    auto valueEnd = keyEnd ? (const char *)memchr(keyEnd + 1, 0, end - keyEnd - 1) : nullptr;
+    if (!valueEnd) {
+      LOG_ERROR << "[AV] Unterminated option in init block";
+      return false;
+    }
+    params.options.emplace_back(std::string(ptr, keyEnd), std::string(keyEnd + 1, valueEnd));
+    ptr = valueEnd + 1;
+  }
+  return true;
+}
+
+AVCmdResult sendOpenCmd(IPCPipe pipe, AVCmd &cmd, const AVEncodeParams &params, size_t *handle) {
+  SingleArray ext;
+  packInitExt(params, ext);
+  cmd.init.extSize = (uint32_t)ext.size();
+  IPCBuffer parts[] = { { &cmd, sizeof(cmd) }, { ext.data(), ext.size() } };
+  if (pipe->writev(parts, 2) != sizeof(cmd) + ext.size()) {
+    return AVCmdResult::Nack;
+  }
+  return readAVCmdResult(pipe, handle);
+}
+
+// Requests the service queues on a session's codec thread.
+static bool isWindowed(AVCmdType type) {
+  switch (type) {
+    case AVCmdType::Encode:
+    case AVCmdType::Decode:
+    case AVCmdType::Flush:
+    case AVCmdType::SetBitrate:
+    case AVCmdType::ForceKeyframe:
+    case AVCmdType::SetResolution:
+    case AVCmdType::SetSink:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool AVPipeline::start(uint32_t _window) {
+  AVCmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.type = AVCmdType::SetPipeline;
+  cmd.size = _window;
+  size_t accepted = 0;
+  if (!_window || sendAVCmd(pipe, cmd, &accepted) != AVCmdResult::Ack || !accepted) {
+    return false;
+  }
+
+  // the service may cap the window at its session queue depth
+  window = (uint32_t)std::min<size_t>(accepted, _window);
+  nextSeq = 0;
+  outstanding = 0;
+  replies.clear();
+  headerBytes = 0;
+  return true;
+}
+
+bool AVPipeline::stop() {
+  if (!window) {
+    return true;
+  }
+
+  AVCmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.type = AVCmdType::SetPipeline;
+  cmd.size = 0;
+  auto id = submit(cmd);
+  if (!id) {
+    return false;
+  }
+
+  // outputs still in flight are dropped, callers drain before stopping
+  while (1) {
+    Reply r;
+    if (!poll(r, 5000)) {
+      return false;
+    }
+    if (r.reply.requestId == id) {
+      window = 0;
+      return r.reply.result == AVCmdResult::Ack;
+    }
+  }
+}
+
+// Part of the payload may have been read, the stream is out of step from
+// here on and the pipeline stops.
+bool AVPipeline::fail(const AVCmdReply &reply) {
+  LOG_ERROR << "[AV] Pipeline payload of request " << reply.requestId << " timed out, " << reply.size <<
+               " bytes expected";
+  broken = true;
+  return false;
+}
+
+uint32_t AVPipeline::submit(AVCmd &cmd, const void *data, size_t size) {
+  if (!window || broken || !pipe->isOpen()) {
+    return 0;
+  }
+
+  bool windowed = isWindowed(cmd.type);
+  while (windowed && outstanding >= window) {
+    if (!readReply(5000)) {
+      LOG_ERROR << "[AV] Pipeline stalled with " << outstanding << " requests in flight";
+      return 0;
+    }
+  }
+
+  cmd.requestId = nextRequestId++;
+  if (!nextRequestId) nextRequestId = 1;
+  cmd.seq = nextSeq++;
+  if (data) cmd.size = size;
+
+  if (pipe->write(&cmd, sizeof(cmd)) != sizeof(cmd)) {
+    return 0;
+  }
+  if (data && size && pipe->writePayload(data, size) != size) {
+    return 0;
+  }
+
+  if (windowed) outstanding++;
+  return cmd.requestId;
+}
+
+bool AVPipeline::poll(Reply &reply, int timeoutMs) {
+  if (replies.empty() && !readReply(timeoutMs)) {
+    return false;
+  }
+
+  reply = std::move(replies.front());
+  replies.pop_front();
+  return true;
+}
+
+bool AVPipeline::readReply(int timeoutMs) {
+  if (broken) {
+    return false;
+  }
+
+  // a read timing out mid header keeps what arrived for the next call
+  headerBytes += pipe->read(&header[headerBytes], sizeof(header) - headerBytes, timeoutMs);
+  if (headerBytes < sizeof(header)) {
+    return false;
+  }
+  headerBytes = 0;
+
+  Reply r;
+  memcpy(&r.reply, header, sizeof(r.reply));
+
+  switch (r.reply.type) {
+    case AVCmdType::GetPacket:
+    case AVCmdType::GetFrame:
+    case AVCmdType::GetSegment: {
+      r.payload.resize(r.reply.size);
+      if (r.reply.size && pipe->readPayload(r.payload.data(), r.reply.size, 5000) != r.reply.size) {
+        return fail(r.reply);
+      }
+      break;
+    }
+    case AVCmdType::GetEncoderName:
+    case AVCmdType::GetDecoderName:
+    case AVCmdType::GetCapabilities:
+    case AVCmdType::GetStats:
+    case AVCmdType::GetSinkStatus: {
+      if (r.reply.result != AVCmdResult::Ack) break;
+      r.payload.resize(r.reply.size);
+      if (r.reply.size && pipe->read(r.payload.data(), r.reply.size, 5000) != r.reply.size) {
+        return fail(r.reply);
+      }
+      break;
+    }
+    default: {
+      if (isWindowed(r.reply.type) && outstanding) outstanding--;
+      break;
+    }
+  }
+
+  replies.push_back(std::move(r));
+  return true;
+}
 
 
-bool startProccess(const std::string& path, const std::vector<std::string>& params) {
+
+bool startProccess(const std::string& path, const std::vector<std::string>& params, int64_t *pid) {
 #ifdef WIN32
   std::stringstream ss;
   for (auto& p : params) ss << p << " ";
   ShellExecute(NULL, "open", path.c_str(), ss.str().c_str(), NULL, SW_SHOW);
+  if (pid) *pid = 0;
   return true;
 #else
   pid_t child_pid;
@@ -106,23 +517,24 @@ bool startProccess(const std::string& path, const std::vector<std::string>& para
   if (s != 0) {
     return false;
   }
+  if (pid) *pid = child_pid;
   return true;
 #endif
 }
 
 bool dumpLog = false;
+bool useSharedMemory = false;
+bool refreshCapabilities = false;
 
 IPCPipe openService(const std::string& instanceId) {
   if (!startService(instanceId)) {
     return nullptr;
   }
 
-  auto pipe = IIPCPipe::open(instanceId);
-  if (pipe) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
-  }
-
-  return pipe;
+  // the listener is up once startService returns, the wait only covers a
+  // slow first accept
+  return (useSharedMemory) ? IIPCPipe::openShared(instanceId, SVC_CONNECT_TIMEOUT_MS) :
+                             IIPCPipe::open(instanceId, SVC_CONNECT_TIMEOUT_MS);
 }
 
 bool closeService(IPCPipe pipe) {
@@ -134,4 +546,158 @@ bool closeService(IPCPipe pipe) {
   waitServiceToExit();
 
   return true;
-}
\ No newline at end of file
+}
+
+#define SVC_POOL_KEEPALIVE_MS 2000
+#define SVC_POOL_RETRY_MS 1000
+// How long stop() waits for the stopped services to exit.
+#define SVC_POOL_STOP_MS 2000
+
+AVServicePool::AVServicePool(const std::string &servicePath, const std::string &_prefix, size_t _size) :
+  path(servicePath), prefix(_prefix), size(_size) {
+}
+
+AVServicePool::~AVServicePool() {
+  stop();
+}
+
+bool AVServicePool::start() {
+  if (path.empty() || prefix.empty() || !size) {
+    LOG_ERROR << "[POOL] Invalid pool settings";
+    return false;
+  }
+  if (thread.joinable()) {
+    return true;
+  }
+
+  stopping = false;
+  thread = std::thread(&AVServicePool::run, this);
+  return true;
+}
+
+void AVServicePool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  available.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+IPCPipe AVServicePool::claim(int timeoutMs) {
+  std::unique_lock<std::mutex> lock(mutex);
+  available.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]() { return stopping || !ready.empty(); });
+  if (ready.empty()) {
+    return nullptr;
+  }
+
+  auto pipe = ready.front();
+  ready.pop_front();
+  wake.notify_one();
+  return pipe;
+}
+
+IPCPipe AVServicePool::spawn(const std::string &instanceId) {
+  std::vector<std::string> params = { "-i", instanceId };
+  if (useSharedMemory) params.push_back("--shm");
+
+  int64_t pid = 0;
+  if (!startProccess(path, params, &pid)) {
+    LOG_ERROR << "[POOL] Could not start " << path;
+    return nullptr;
+  }
+  if (pid) {
+    std::lock_guard<std::mutex> lock(mutex);
+    children.push_back(pid);
+  }
+
+  // the service listens only once it is ready, connecting is the handshake
+  auto pipe = (useSharedMemory) ? IIPCPipe::openShared(instanceId, SVC_CONNECT_TIMEOUT_MS) :
+                                  IIPCPipe::open(instanceId, SVC_CONNECT_TIMEOUT_MS);
+  if (!pipe) {
+    LOG_ERROR << "[POOL] Service " << instanceId << " did not become ready";
+  }
+  return pipe;
+}
+
+void AVServicePool::run() {
+  auto lastKeepAlive = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    wake.wait_for(lock, std::chrono::milliseconds(SVC_POOL_KEEPALIVE_MS),
+                  [&]() { return stopping || ready.size() < size; });
+    if (stopping) break;
+
+    if (ready.size() < size) {
+      auto instanceId = prefix + "-" + std::to_string(nextInstance++);
+      lock.unlock();
+      auto pipe = spawn(instanceId);
+      lock.lock();
+      if (pipe) {
+        ready.push_back(pipe);
+        available.notify_one();
+      } else {
+        wake.wait_for(lock, std::chrono::milliseconds(SVC_POOL_RETRY_MS), [&]() { return stopping; });
+      }
+    }
+
+    // idle connections would hit the service's keep-alive timeout
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastKeepAlive >= std::chrono::milliseconds(SVC_POOL_KEEPALIVE_MS)) {
+      lastKeepAlive = now;
+      // one at a time and without the lock, the others stay claimable while
+      // a slow service is pinged
+      for (size_t n = ready.size(); n && !ready.empty() && !stopping; n--) {
+        auto pipe = ready.front();
+        ready.pop_front();
+        lock.unlock();
+        bool alive = sendAVCmd(pipe, AVCmdType::KeepAlive) == AVCmdResult::Ack;
+        lock.lock();
+        if (alive) {
+          ready.push_back(pipe);
+          available.notify_one();
+        } else {
+          LOG_ERROR << "[POOL] Dropping a service that stopped responding";
+        }
+      }
+    }
+
+#ifndef _WIN32
+    // services exit once their client is gone
+    for (auto it = children.begin(); it != children.end();) {
+      if (waitpid((pid_t)*it, nullptr, WNOHANG) != 0) it = children.erase(it);
+      else it++;
+    }
+#endif
+  }
+
+  for (auto &pipe : ready) {
+    sendAVCmd(pipe, AVCmdType::StopService);
+  }
+  ready.clear();
+
+#ifndef _WIN32
+  // the idle services stop now, claimed ones once their client is gone
+  std::vector<int64_t> exiting;
+  exiting.swap(children);
+  lock.unlock();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SVC_POOL_STOP_MS);
+  while (1) {
+    for (auto it = exiting.begin(); it != exiting.end();) {
+      if (waitpid((pid_t)*it, nullptr, WNOHANG) != 0) it = exiting.erase(it);
+      else it++;
+    }
+    if (exiting.empty() || std::chrono::steady_clock::now() >= deadline) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (!exiting.empty()) {
+    // reaped by a restarted pool
+    LOG_INFO << "[POOL] " << exiting.size() << " claimed services still running";
+    lock.lock();
+    children.insert(children.end(), exiting.begin(), exiting.end());
+  }
+#endif
+}
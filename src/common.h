@@ -5,6 +5,9 @@
 #ifdef max
 #undef max
 #endif
+#ifdef min
+#undef min
+#endif
 #else
 #include <errno.h>
 #include <spawn.h>
@@ -33,9 +36,18 @@
 
 #include <CLI/CLI.hpp>
 
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <mutex>
+
+// How long a client keeps retrying to connect to a starting service.
+#define SVC_CONNECT_TIMEOUT_MS 10000
 
 extern bool dumpLog;
+extern bool useSharedMemory;
+// Probe the codecs again instead of loading the capability cache.
+extern bool refreshCapabilities;
 
 class Scope {
 protected:
@@ -56,17 +68,116 @@ public:
 
 std::string to_string(const std::wstring &str);
 bool readAVCmd(IPCPipe pipe, AVCmd *cmd, int timeoutMs);
-void sendAVCmdResult(IPCPipe pipe, AVCmdResult res, size_t size = 0);
+// 'data', if given, holds 'size' bytes sent in the same write as the result.
+void sendAVCmdResult(IPCPipe pipe, AVCmdResult res, size_t size = 0, const void *data = nullptr);
 AVCmdResult readAVCmdResult(IPCPipe pipe, size_t *size = nullptr);
 AVCmdResult sendAVCmd(IPCPipe pipe, const AVCmd &cmd, size_t *size = nullptr);
 AVCmdResult sendAVCmd(IPCPipe pipe, AVCmdType cmd);
-AVCmdResult getPacket(IPCPipe pipe, std::vector<uint8_t> &data);
-AVCmdResult getFrame(IPCPipe pipe, std::vector<uint8_t> &data);
+AVCmdResult getPacket(IPCPipe pipe, SingleArray &data);
+AVCmdResult getFrame(IPCPipe pipe, SingleArray &data);
+// AVInitFlagFrameRefs decoders: 'payload' points at the descriptor and planes
+// and stays valid until releaseFrame(), which also releases it in the service.
+AVCmdResult getFrameRef(IPCPipe pipe, AVFramePlanes &desc, const uint8_t **payload);
+AVCmdResult releaseFrame(IPCPipe pipe, uint32_t frameId);
+// Sends encoded output of the last session to a sink in the service, 'fd' is
+// passed along for AVSinkType::Fd. getSinkStatus() reports its progress.
+AVCmdResult setSink(IPCPipe pipe, const AVSinkInfo &info, const std::string &path, int fd = -1);
+AVCmdResult getSinkStatus(IPCPipe pipe, AVSinkStatus &status);
+// Service wide latency histograms and counters, see AVServiceStats.
+AVCmdResult getStats(IPCPipe pipe, AVServiceStats &stats);
+// Steps through the packets of an AVInitFlagPacketInfo GetPacket payload,
+// starting at 'offset'. Returns false at the end or on a truncated record.
+bool nextPacket(const SingleArray &payload, size_t &offset, AVPacketInfo &info, const uint8_t **data);
+// Muxed encoders: the next segment, an AVSegmentInfo record parsed with
+// nextSegment(). GetPacket payloads hold several of them.
+AVCmdResult getSegment(IPCPipe pipe, SingleArray &data);
+bool nextSegment(const SingleArray &payload, size_t &offset, AVSegmentInfo &info, const uint8_t **data);
+void sendAVCmdReply(IPCPipe pipe, const AVCmd &cmd, AVCmdType type, AVCmdResult res, size_t size = 0,
+                    const void *data = nullptr);
+
+// AVInitExt block with its av_opt pairs.
+void packInitExt(const AVEncodeParams &params, SingleArray &data);
+bool parseInitExt(const uint8_t *data, size_t size, AVEncodeParams &params);
+// Sends OpenEncoder/OpenDecoder followed by the AVInitExt block of 'params',
+// 'handle' receives the session handle.
+AVCmdResult sendOpenCmd(IPCPipe pipe, AVCmd &cmd, const AVEncodeParams &params, size_t *handle = nullptr);
+
+// Client side of the pipelined protocol. Up to 'window' requests queued on
+// the codec thread (Encode/Decode, Flush, reconfiguration, SetSink) are kept
+// in flight, their outputs and completions come back as tagged replies which
+// are queued until the caller polls them. The service may cap the window at
+// its session queue depth, getWindow() is the one in effect.
+// A reply payload that does not arrive in time leaves the stream out of
+// step, the pipeline then fails every call and the pipe must be reopened.
+class AVPipeline {
+public:
+  struct Reply {
+    AVCmdReply  reply;
+    SingleArray payload;
+  };
 
-bool startProccess(const std::string &path, const std::vector<std::string> &params);
+  AVPipeline(IPCPipe _pipe) : pipe(_pipe) {}
+
+  bool start(uint32_t window);
+  bool stop();
+
+  uint32_t submit(AVCmd &cmd, const void *data = nullptr, size_t size = 0);
+  bool poll(Reply &reply, int timeoutMs);
+  size_t inFlight() const { return outstanding; }
+  uint32_t getWindow() const { return window; }
+
+protected:
+  bool readReply(int timeoutMs);
+  bool fail(const AVCmdReply &reply);
+
+  IPCPipe pipe;
+  uint32_t window = 0;
+  uint32_t nextRequestId = 1;
+  uint32_t nextSeq = 0;
+  size_t outstanding = 0;
+  std::deque<Reply> replies;
+  uint8_t header[sizeof(AVCmdReply)];   // reply header read so far
+  size_t headerBytes = 0;
+  bool broken = false;   // a payload timed out halfway
+};
+
+// 'pid' receives the child's process id where the platform reports it.
+bool startProccess(const std::string &path, const std::vector<std::string> &params, int64_t *pid = nullptr);
 
 IPCPipe openService(const std::string &instanceId);
 bool closeService(IPCPipe pipe);
 
 bool startService(const std::string &instanceId);
-void waitServiceToExit();
\ No newline at end of file
+void waitServiceToExit();
+
+// Keeps 'size' service processes started and connected ahead of time, so a
+// client claims a ready connection instead of paying for process start,
+// codec probing and connect. Idle connections are kept alive and replaced
+// once claimed. Instances are named "<prefix>-<n>".
+class AVServicePool {
+public:
+  AVServicePool(const std::string &servicePath, const std::string &prefix, size_t size);
+  ~AVServicePool();
+
+  bool start();
+  // A connected service, nullptr if none became ready within 'timeoutMs'.
+  // The service exits once the claimed connection is closed.
+  IPCPipe claim(int timeoutMs);
+  void stop();
+
+protected:
+  void run();
+  IPCPipe spawn(const std::string &instanceId);
+
+  std::string path;
+  std::string prefix;
+  size_t size = 0;
+  uint32_t nextInstance = 0;
+
+  std::mutex mutex;
+  std::condition_variable wake, available;
+  std::deque<IPCPipe> ready;
+  std::vector<int64_t> children;   // not yet reaped
+  std::thread thread;
+  bool stopping = false;
+};
\ No newline at end of file
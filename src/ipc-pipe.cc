@@ -1,6 +1,8 @@
 #include <plog/Log.h>
 #include "ipc-pipe.h"
+#include "buffer-pool.h"
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <filesystem>
@@ -16,10 +18,14 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #define ACCESS_MODE (S_IRWXU | S_IRWXG | S_IRWXO)
 #endif
 
+#define IPC_CONNECT_RETRY_MS 10
+#define IPC_MAX_PARTS 8
+
 extern FILE *LOGFILE;
 #ifdef _WIN32
 #undef errno
@@ -39,11 +45,8 @@ public:
     if (hPipe != INVALID_HANDLE_VALUE) CloseHandle(hPipe);
     hPipe = INVALID_HANDLE_VALUE;
 #else
-    if (hPipe >= 0) ::close(hPipe);
-    hPipe = -1;
     if (hClient >= 0) ::close(hClient);
     hClient = -1;
-    if (pipeName.length()) ::unlink(pipeName.c_str());
 #endif
   }
 
@@ -69,7 +72,8 @@ public:
 #else
     int ret;
     while (totalBytes < size && retry > 0) {
-      ret = ::write(hClient, &ptr[totalBytes], size - totalBytes);
+      // a client gone mid reply must not raise SIGPIPE in the service
+      ret = ::send(hClient, &ptr[totalBytes], size - totalBytes, MSG_NOSIGNAL);
       if (ret <= 0) {
         close();
         return 0;
@@ -109,65 +113,277 @@ public:
       }
     }
 #else
+    // take what the socket already holds and only poll once it runs dry,
+    // large payloads arriving in one go cost no poll per chunk
     int ret;
     struct pollfd fds;
     while (totalBytes < size) {
+      ret = ::recv(hClient, &ptr[totalBytes], size - totalBytes, MSG_DONTWAIT);
+      if (ret > 0) {
+        totalBytes += ret;
+        continue;
+      }
+      if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        close();
+        return 0;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+
       fds.fd = hClient;
       fds.events = POLLIN;
       fds.revents = 0;
       ret = ::poll(&fds, 1, timeoutMs);
-      if (ret < 0) {
+      if (ret < 0 && errno != EINTR) {
         close();
         return 0;
       } else if (ret == 0) {
         return totalBytes;
-      } else if (fds.revents & POLLIN) {
-        ret = ::read(hClient, &ptr[totalBytes], size - totalBytes);
-        if (ret <= 0) {
-          close();
-          return 0;
-        }
-        totalBytes += ret;
       }
     }
 #endif
     return totalBytes;
   }
 
+#ifndef _WIN32
+  size_t writev(const IPCBuffer *parts, size_t count) override {
+    struct iovec iov[IPC_MAX_PARTS];
+    if (count > IPC_MAX_PARTS) {
+      return IIPCPipe::writev(parts, count);
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+      iov[i].iov_base = (void *)parts[i].data;
+      iov[i].iov_len = parts[i].size;
+      size += parts[i].size;
+    }
+
+    size_t totalBytes = 0;
+    struct iovec *next = iov;
+    int left = (int)count;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    while (totalBytes < size) {
+      msg.msg_iov = next;
+      msg.msg_iovlen = left;
+      auto ret = ::sendmsg(hClient, &msg, MSG_NOSIGNAL);
+      if (ret <= 0) {
+        close();
+        return 0;
+      }
+      totalBytes += ret;
+      // skip what went out, a part may have been written halfway
+      while (left && (size_t)ret >= next->iov_len) {
+        ret -= next->iov_len;
+        next++;
+        left--;
+      }
+      if (left) {
+        next->iov_base = (uint8_t *)next->iov_base + ret;
+        next->iov_len -= ret;
+      }
+    }
+    return totalBytes;
+  }
+
+  // The descriptor rides as SCM_RIGHTS on a single marker byte.
+  bool sendFd(int fd) override {
+    char marker = 0;
+    struct iovec iov = { &marker, 1 };
+    union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (::sendmsg(hClient, &msg, MSG_NOSIGNAL) != 1) {
+      LOG_ERROR << "[IPC] Could not send descriptor. Error " << errno;
+      return false;
+    }
+    return true;
+  }
+
+  int receiveFd(int timeoutMs) override {
+    struct pollfd fds;
+    fds.fd = hClient;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    if (::poll(&fds, 1, timeoutMs) <= 0 || !(fds.revents & POLLIN)) {
+      return -1;
+    }
+
+    char marker = 0;
+    struct iovec iov = { &marker, 1 };
+    union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (::recvmsg(hClient, &msg, MSG_CMSG_CLOEXEC) != 1) {
+      close();
+      return -1;
+    }
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+      LOG_ERROR << "[IPC] No descriptor received";
+      return -1;
+    }
+    int fd = -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+  }
+#endif
+
   bool isOpen() const {
 #ifdef _WIN32
     return INVALID_HANDLE_VALUE != hPipe;
 #else
-    return -1 != hPipe && -1 != hClient;
+    return -1 != hClient;
 #endif
   }
 
+#ifndef _WIN32
+  int handle() const override {
+    return hClient;
+  }
+#endif
+
 #ifdef _WIN32
   HANDLE hPipe = INVALID_HANDLE_VALUE;
 #else
-  int hPipe = -1;
   int hClient = -1;
+#endif
+};
+
+
+class IPCListenerImpl : public IIPCListener {
+public:
+  IPCListenerImpl() {
+  }
+  ~IPCListenerImpl() {
+    close();
+  }
+
+  void close() override {
+#ifdef _WIN32
+    if (!closed.exchange(true)) {
+      // unblock a pending ConnectNamedPipe with a throwaway client
+      HANDLE h = CreateFile(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+      if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+    }
+#else
+    if (hPipe >= 0) ::close(hPipe);
+    hPipe = -1;
+    if (pipeName.length()) ::unlink(pipeName.c_str());
+    pipeName.clear();
+#endif
+  }
+
+  IPCPipe accept(int timeoutMs) override {
+    auto ipc = std::make_shared<IPCPipeImpl>();
+    if (!ipc) {
+      return nullptr;
+    }
+
+#ifdef _WIN32
+    // named pipes have no pending connection queue to poll, the wait blocks
+    // until a client connects or close() is called
+    if (closed) {
+      return nullptr;
+    }
+    ipc->hPipe = CreateNamedPipe(pipeName.c_str(), PIPE_ACCESS_DUPLEX,
+                                 PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+                                 PIPE_UNLIMITED_INSTANCES, bufferStorageSize, bufferStorageSize, 0, NULL);
+    if (ipc->hPipe == INVALID_HANDLE_VALUE) {
+      LOG_ERROR << "[IPC] Could not create pipe. Error " << errno;
+      return nullptr;
+    }
+    if (!ConnectNamedPipe(ipc->hPipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
+      LOG_ERROR << "[IPC] Failed to accept pipe client. Error " << errno;
+      return nullptr;
+    }
+    if (closed) {
+      return nullptr;
+    }
+#else
+    struct pollfd fds;
+    fds.fd = hPipe;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    int ret = ::poll(&fds, 1, timeoutMs);
+    if (ret <= 0 || !(fds.revents & POLLIN)) {
+      return nullptr;
+    }
+
+    ipc->hClient = ::accept(hPipe, NULL, NULL);
+    if (ipc->hClient == -1) {
+      LOG_ERROR << "[IPC] Failed to accept pipe client. Error " << errno;
+      return nullptr;
+    }
+#ifdef IPC_HAVE_IO_URING
+    if (auto ring = wrapUringPipe(ipc)) return ring;
+#endif
+#endif
+
+    return ipc;
+  }
+
+  bool isOpen() const override {
+#ifdef _WIN32
+    return !closed;
+#else
+    return -1 != hPipe;
+#endif
+  }
+
+#ifndef _WIN32
+  int handle() const override {
+    return hPipe;
+  }
+#endif
+
   std::string pipeName;
+#ifdef _WIN32
+  size_t bufferStorageSize = 0;
+  std::atomic<bool> closed = false;
+#else
+  int hPipe = -1;
 #endif
 };
 
 
-IPCPipe IIPCPipe::create(const std::string &name, size_t bufferStorageSize) try {
-  auto ipc = std::make_shared<IPCPipeImpl>();
+IPCListener IIPCListener::create(const std::string &name, size_t bufferStorageSize, size_t backlog) try {
+  auto ipc = std::make_shared<IPCListenerImpl>();
   if (!ipc) {
     return nullptr;
   }
 
 
 #ifdef _WIN32
-  std::string pipeName = "\\\\.\\pipe\\" + name;
-  ipc->hPipe = CreateNamedPipe(pipeName.c_str(), PIPE_ACCESS_DUPLEX,
-                               PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
-                               1, bufferStorageSize, bufferStorageSize, 0, NULL);
-  if (ipc->hPipe == INVALID_HANDLE_VALUE) {
-    LOG_ERROR << "[IPC] Could not create pipe. Error " << errno;
-    return nullptr;
-  }
+  ipc->pipeName = "\\\\.\\pipe\\" + name;
+  ipc->bufferStorageSize = bufferStorageSize;
 #else
   ipc->pipeName = "/tmp/" + name;
   ::unlink(ipc->pipeName.c_str());
@@ -188,17 +404,11 @@ IPCPipe IIPCPipe::create(const std::string &name, size_t bufferStorageSize) try
     return nullptr;
   }
 
-  ret = listen(ipc->hPipe, 1);
+  ret = listen(ipc->hPipe, (int)backlog);
   if (ret == -1) {
     LOG_ERROR << "[IPC] Could not listen pipe. Error " << errno;
     return nullptr;
   }
-
-  ipc->hClient = accept(ipc->hPipe, NULL, NULL);
-  if (ipc->hClient == -1) {
-    LOG_ERROR << "[IPC] Failed to accept pipe client. Error " << errno;
-    return nullptr;
-  }
 #endif
 
   return ipc;
@@ -207,11 +417,51 @@ IPCPipe IIPCPipe::create(const std::string &name, size_t bufferStorageSize) try
   return nullptr;
 }
 
-IPCPipe IIPCPipe::open(const std::string &name) try {
+size_t IIPCPipe::writev(const IPCBuffer *parts, size_t count) {
+  size_t totalBytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!parts[i].size) continue;
+    if (write(parts[i].data, parts[i].size) != parts[i].size) {
+      return 0;
+    }
+    totalBytes += parts[i].size;
+  }
+  return totalBytes;
+}
+
+size_t IIPCPipe::writePayload(const IPCBuffer *parts, size_t count) {
+  size_t totalBytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!parts[i].size) continue;
+    if (write(parts[i].data, parts[i].size) != parts[i].size) {
+      return 0;
+    }
+    totalBytes += parts[i].size;
+  }
+  return totalBytes;
+}
+
+bool IIPCPipe::takePayload(PoolBuffer &buffer, size_t size, size_t padding, int timeoutMs) {
+  buffer.release();
+  buffer.reserve(size + padding);
+  buffer.resize(size);
+  return !size || readPayload(buffer.data(), size, timeoutMs) == size;
+}
+
+const uint8_t *IIPCPipe::peekPayload(size_t size, int timeoutMs) {
+  if (peekBuffer.size() < size) peekBuffer.resize(size);
+  if (!size || readPayload(peekBuffer.data(), size, timeoutMs) != size) {
+    return nullptr;
+  }
+  return peekBuffer.data();
+}
+
+IPCPipe IIPCPipe::open(const std::string &name, int waitMs) try {
   auto ipc = std::make_shared<IPCPipeImpl>();
   if (!ipc) {
     return nullptr;
   }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(waitMs);
 
 #ifdef _WIN32
   while (1) {
@@ -221,6 +471,12 @@ IPCPipe IIPCPipe::open(const std::string &name) try {
       break;
     }
 
+    // no pipe instance until the service listens
+    if (GetLastError() == ERROR_FILE_NOT_FOUND && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(IPC_CONNECT_RETRY_MS));
+      continue;
+    }
+
     if (GetLastError() != ERROR_PIPE_BUSY) {
       LOG_ERROR << "[IPC] Could not open pipe. Error " << errno;
       return nullptr;
@@ -235,22 +491,36 @@ IPCPipe IIPCPipe::open(const std::string &name) try {
   }
 #else
   std::string pipeName = "/tmp/" + name;
-  ipc->hClient = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (ipc->hClient == -1) {
-    LOG_ERROR << "[IPC] Could not create pipe. Error " << errno;
-    return nullptr;
-  }
-
   struct sockaddr_un addr;
   memset(&addr, 0, sizeof(addr));
   addr.sun_family = AF_UNIX;
   strncpy(addr.sun_path, pipeName.c_str(), sizeof(addr.sun_path) - 1);
 
-  int ret = connect(ipc->hClient, (const struct sockaddr *)&addr, sizeof(addr));
-  if (ret == -1) {
-    LOG_ERROR << "[IPC] Could not connect pipe. Error " << errno;
+  while (1) {
+    ipc->hClient = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ipc->hClient == -1) {
+      LOG_ERROR << "[IPC] Could not create pipe. Error " << errno;
+      return nullptr;
+    }
+
+    int ret = connect(ipc->hClient, (const struct sockaddr *)&addr, sizeof(addr));
+    if (ret != -1) {
+      break;
+    }
+
+    int err = errno;
+    ipc->close();
+    // the socket file appears, and accepts, once the service listens
+    if ((err == ENOENT || err == ECONNREFUSED) && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(IPC_CONNECT_RETRY_MS));
+      continue;
+    }
+    LOG_ERROR << "[IPC] Could not connect pipe. Error " << err;
     return nullptr;
   }
+#ifdef IPC_HAVE_IO_URING
+  if (auto ring = wrapUringPipe(ipc)) return ring;
+#endif
 #endif
 
   return ipc;
@@ -1,10 +1,18 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <vector>
 #include <string>
 
 class IIPCPipe;
 typedef std::shared_ptr<IIPCPipe> IPCPipe;
+class PoolBuffer;
+
+struct IPCBuffer {
+  const void *data;
+  size_t size;
+};
 
 class IIPCPipe {
 public:
@@ -14,7 +22,69 @@ public:
 
   virtual size_t write(const void *data, size_t size) = 0;
   virtual size_t read(void *data, size_t size, int timeoutMs = -1) = 0;
+  // Writes the parts back to back with as few system calls as the pipe
+  // allows, for headers and the small records following them.
+  virtual size_t writev(const IPCBuffer *parts, size_t count);
+
+  // Bulk frame/packet data. Plain pipes stream the bytes, shared memory
+  // pipes place them in a ring slot and send only the slot index.
+  virtual size_t writePayload(const void *data, size_t size) { return write(data, size); }
+  virtual size_t readPayload(void *data, size_t size, int timeoutMs = -1) { return read(data, size, timeoutMs); }
+
+  // Writes the parts as one payload, without gathering them into a buffer first.
+  virtual size_t writePayload(const IPCBuffer *parts, size_t count);
+
+  // Reads a payload into 'buffer', with at least 'padding' spare bytes past
+  // it. Shared memory pipes hand over the ring slot itself, which stays
+  // taken until the buffer releases it, from any thread; the pipe must
+  // outlive the buffer.
+  virtual bool takePayload(PoolBuffer &buffer, size_t size, size_t padding, int timeoutMs = -1);
+
+  // Reads a payload without copying it out of shared memory. The pointer stays
+  // valid until releasePayload(), plain pipes read into an internal buffer.
+  virtual const uint8_t *peekPayload(size_t size, int timeoutMs = -1);
+  virtual void releasePayload() {}
+
+  // Hands an open descriptor to the peer, which takes it with receiveFd() at
+  // the same point of the stream. Local sockets only, elsewhere these fail.
+  virtual bool sendFd(int fd) { return false; }
+  virtual int receiveFd(int timeoutMs = -1) { return -1; }
+
+  // Descriptor that turns readable when a command arrives, for a Reactor.
+  // -1 where there is none, e.g. Windows named pipes.
+  virtual int handle() const { return -1; }
+
+  // 'waitMs' keeps retrying while the service is still starting up and has
+  // no listener yet.
+  static IPCPipe open(const std::string &name, int waitMs = 0);
+  static IPCPipe openShared(const std::string &name, int waitMs = 0);
+
+protected:
+  std::vector<uint8_t> peekBuffer;
+};
+
+#ifdef IPC_HAVE_IO_URING
+// io_uring backed pipe on the socket of 'pipe', which it takes over.
+// nullptr if the kernel lacks the needed operations, 'pipe' stays usable then.
+IPCPipe wrapUringPipe(const IPCPipe &pipe);
+#endif
+
+class IIPCListener;
+typedef std::shared_ptr<IIPCListener> IPCListener;
+
+class IIPCListener {
+public:
+  virtual ~IIPCListener() {}
+
+  virtual bool isOpen() const = 0;
+  virtual void close() = 0;
+
+  // Returns the next client connection, or nullptr on timeout or close().
+  virtual IPCPipe accept(int timeoutMs = -1) = 0;
+  // Readable while a client waits to be accepted, -1 where there is none.
+  virtual int handle() const { return -1; }
 
-  static IPCPipe create(const std::string &name, size_t bufferStorageSize);
-  static IPCPipe open(const std::string &name);
+  static IPCListener create(const std::string &name, size_t bufferStorageSize, size_t backlog);
+  static IPCListener createShared(const std::string &name, size_t bufferStorageSize, size_t backlog,
+                                  size_t slotCount, size_t slotSize);
 };
@@ -0,0 +1,485 @@
+#include <plog/Log.h>
+#include "ipc-pipe.h"
+#include "buffer-pool.h"
+
+#include <atomic>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+#undef errno
+#define errno GetLastError()
+#endif
+
+#define SHM_MAGIC   0x4d48534c  // "LSHM"
+#define SHM_INLINE  0xffffffff  // payload follows on the socket
+#define SHM_ALIGN   4096
+
+// Shared layout: header, slot states of both rings, then the slot data.
+// Ring 0 carries client -> service payloads, ring 1 service -> client.
+struct ShmHeader {
+  uint32_t magic;
+  uint32_t slotCount;
+  uint64_t slotSize;
+  uint64_t dataOffset;
+};
+
+struct ShmSlot {
+  std::atomic<uint32_t> busy;
+  uint32_t reserved;
+  uint64_t size;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared slot state must be lock free");
+
+class IPCShmPipeImpl : public IIPCPipe {
+public:
+  IPCShmPipeImpl() {
+  }
+  ~IPCShmPipeImpl() {
+    close();
+  }
+
+  void close() {
+    if (base) releasePayload();
+#ifdef _WIN32
+    if (base) UnmapViewOfFile(base);
+    if (hMap) CloseHandle(hMap);
+    hMap = NULL;
+#else
+    if (base) ::munmap(base, mapSize);
+    if (segmentFd >= 0) ::close(segmentFd);
+    segmentFd = -1;
+#endif
+    base = nullptr;
+    socket = nullptr;
+  }
+
+  // POSIX segments are unlinked right after they are created, the client
+  // maps the descriptor it receives ('fd'), so a crashed peer leaves nothing
+  // behind in /dev/shm. The creator keeps its descriptor in segmentFd until
+  // it is sent.
+  bool map(bool create, size_t slotCount, size_t slotSize, int fd = -1) {
+    if (create) {
+      slotSize = (slotSize + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+      size_t dataOffset = sizeof(ShmHeader) + 2 * slotCount * sizeof(ShmSlot);
+      dataOffset = (dataOffset + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+      mapSize = dataOffset + 2 * slotCount * slotSize;
+    }
+
+#ifdef _WIN32
+    if (create) {
+      hMap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                               (DWORD)((uint64_t)mapSize >> 32), (DWORD)(mapSize & 0xffffffff), shmName.c_str());
+    } else {
+      hMap = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, shmName.c_str());
+    }
+    if (!hMap) {
+      LOG_ERROR << "[IPC] Could not open shared memory. Error " << errno;
+      return false;
+    }
+    base = (uint8_t *)MapViewOfFile(hMap, FILE_MAP_ALL_ACCESS, 0, 0, create ? mapSize : 0);
+    if (!base) {
+      LOG_ERROR << "[IPC] Could not map shared memory. Error " << errno;
+      return false;
+    }
+    if (!create) {
+      MEMORY_BASIC_INFORMATION info;
+      VirtualQuery(base, &info, sizeof(info));
+      mapSize = info.RegionSize;
+    }
+#else
+    if (create) {
+      fd = ::shm_open(shmName.c_str(), O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+      if (fd != -1) ::shm_unlink(shmName.c_str());
+    }
+    if (fd == -1) {
+      LOG_ERROR << "[IPC] Could not open shared memory. Error " << errno;
+      return false;
+    }
+
+    struct stat st;
+    if (create && ::ftruncate(fd, mapSize) == -1) {
+      LOG_ERROR << "[IPC] Could not size shared memory. Error " << errno;
+      ::close(fd);
+      return false;
+    } else if (!create) {
+      if (::fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ShmHeader)) {
+        LOG_ERROR << "[IPC] Invalid shared memory. Error " << errno;
+        ::close(fd);
+        return false;
+      }
+      mapSize = st.st_size;
+    }
+
+    void *ptr = ::mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (create) segmentFd = fd;
+    else ::close(fd);
+    if (ptr == MAP_FAILED) {
+      LOG_ERROR << "[IPC] Could not map shared memory. Error " << errno;
+      return false;
+    }
+    base = (uint8_t *)ptr;
+#endif
+
+    header = (ShmHeader *)base;
+    if (create) {
+      header->slotCount = (uint32_t)slotCount;
+      header->slotSize = slotSize;
+      header->dataOffset = mapSize - 2 * slotCount * slotSize;
+      for (size_t i = 0; i < 2 * slotCount; i++) {
+        new (&slots()[i]) ShmSlot();
+        slots()[i].busy.store(0, std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+      header->magic = SHM_MAGIC;
+    } else {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header->magic != SHM_MAGIC ||
+          header->dataOffset + 2 * (size_t)header->slotCount * header->slotSize > mapSize) {
+        LOG_ERROR << "[IPC] Shared memory layout mismatch";
+        return false;
+      }
+    }
+
+    // the service writes ring 1, the client writes ring 0
+    writeRing = create ? 1 : 0;
+    return true;
+  }
+
+  ShmSlot *slots() const {
+    return (ShmSlot *)(base + sizeof(ShmHeader));
+  }
+
+  ShmSlot &slot(int ring, uint32_t idx) const {
+    return slots()[ring * header->slotCount + idx];
+  }
+
+  uint8_t *slotData(int ring, uint32_t idx) const {
+    return base + header->dataOffset + (ring * header->slotCount + idx) * header->slotSize;
+  }
+
+  size_t write(const void *data, size_t size) override {
+    return socket->write(data, size);
+  }
+
+  size_t read(void *data, size_t size, int timeoutMs) override {
+    return socket->read(data, size, timeoutMs);
+  }
+
+  size_t writev(const IPCBuffer *parts, size_t count) override {
+    return socket->writev(parts, count);
+  }
+
+  size_t writePayload(const void *data, size_t size) override {
+    IPCBuffer part = { data, size };
+    return writePayload(&part, 1);
+  }
+
+  size_t writePayload(const IPCBuffer *parts, size_t count) override {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (parts[i].data) size += parts[i].size;
+    }
+    if (!size) {
+      return 0;
+    }
+
+    uint32_t idx = SHM_INLINE;
+    if (size <= header->slotSize) {
+      for (uint32_t i = 0; i < header->slotCount; i++) {
+        uint32_t tmp = (nextSlot + i) % header->slotCount;
+        if (!slot(writeRing, tmp).busy.load(std::memory_order_acquire)) {
+          idx = tmp;
+          break;
+        }
+      }
+    }
+
+    if (idx == SHM_INLINE) {
+      // ring full or payload too large, stream it through the socket
+      if (socket->write(&idx, sizeof(idx)) != sizeof(idx)) {
+        return 0;
+      }
+      return socket->writePayload(parts, count);
+    }
+
+    auto &s = slot(writeRing, idx);
+    auto dst = slotData(writeRing, idx);
+    for (size_t i = 0; i < count; i++) {
+      if (!parts[i].data || !parts[i].size) continue;
+      memcpy(dst, parts[i].data, parts[i].size);
+      dst += parts[i].size;
+    }
+    s.size = size;
+    s.busy.store(1, std::memory_order_release);
+    nextSlot = (idx + 1) % header->slotCount;
+
+    if (socket->write(&idx, sizeof(idx)) != sizeof(idx)) {
+      s.busy.store(0, std::memory_order_release);
+      return 0;
+    }
+    return size;
+  }
+
+  // Returns the index of a filled slot of the read ring, or SHM_INLINE when
+  // the payload follows on the socket.
+  bool readSlot(size_t size, int timeoutMs, uint32_t &idx) {
+    if (socket->read(&idx, sizeof(idx), timeoutMs) != sizeof(idx)) {
+      return false;
+    }
+    if (idx == SHM_INLINE) {
+      return true;
+    }
+
+    if (idx >= header->slotCount) {
+      LOG_ERROR << "[IPC] Invalid shared memory slot " << idx;
+      return false;
+    }
+
+    auto &s = slot(1 - writeRing, idx);
+    if (!s.busy.load(std::memory_order_acquire)) {
+      LOG_ERROR << "[IPC] Shared memory slot " << idx << " is empty";
+      return false;
+    }
+    if (s.size != size) {
+      LOG_ERROR << "[IPC] Shared memory slot size mismatch: " << s.size << " != " << size;
+      s.busy.store(0, std::memory_order_release);
+      return false;
+    }
+    return true;
+  }
+
+  size_t readPayload(void *data, size_t size, int timeoutMs) override {
+    if (!data || !size) {
+      return 0;
+    }
+
+    uint32_t idx;
+    if (!readSlot(size, timeoutMs, idx)) {
+      return 0;
+    }
+    if (idx == SHM_INLINE) {
+      return socket->read(data, size, timeoutMs);
+    }
+
+    int readRing = 1 - writeRing;
+    memcpy(data, slotData(readRing, idx), size);
+    slot(readRing, idx).busy.store(0, std::memory_order_release);
+    return size;
+  }
+
+  // The slot is wrapped instead of copied out. Slots held by a codec make
+  // the writer stream further payloads through the socket.
+  bool takePayload(PoolBuffer &buffer, size_t size, size_t padding, int timeoutMs) override {
+    if (!size || size + padding > header->slotSize) {
+      return IIPCPipe::takePayload(buffer, size, padding, timeoutMs);
+    }
+
+    uint32_t idx;
+    if (!readSlot(size, timeoutMs, idx)) {
+      return false;
+    }
+    buffer.release();
+    if (idx == SHM_INLINE) {
+      buffer.reserve(size + padding);
+      buffer.resize(size);
+      return socket->read(buffer.data(), size, timeoutMs) == size;
+    }
+
+    int readRing = 1 - writeRing;
+    buffer = PoolBuffer::wrap(slotData(readRing, idx), size, header->slotSize, releaseSlot, &slot(readRing, idx).busy);
+    return true;
+  }
+
+  static void releaseSlot(void *busy) {
+    ((std::atomic<uint32_t> *)busy)->store(0, std::memory_order_release);
+  }
+
+  const uint8_t *peekPayload(size_t size, int timeoutMs) override {
+    releasePayload();
+    if (!size) {
+      return nullptr;
+    }
+
+    uint32_t idx;
+    if (!readSlot(size, timeoutMs, idx)) {
+      return nullptr;
+    }
+    if (idx == SHM_INLINE) {
+      return socket->peekPayload(size, timeoutMs);
+    }
+
+    // the slot stays busy, and the writer skips it, until releasePayload()
+    peekSlot = idx;
+    return slotData(1 - writeRing, idx);
+  }
+
+  void releasePayload() override {
+    if (peekSlot != SHM_INLINE) {
+      slot(1 - writeRing, peekSlot).busy.store(0, std::memory_order_release);
+      peekSlot = SHM_INLINE;
+    }
+  }
+
+  bool sendFd(int fd) override {
+    return socket->sendFd(fd);
+  }
+
+  int receiveFd(int timeoutMs) override {
+    return socket->receiveFd(timeoutMs);
+  }
+
+  bool isOpen() const override {
+    return base && socket && socket->isOpen();
+  }
+
+  int handle() const override {
+    return (socket) ? socket->handle() : -1;
+  }
+
+  IPCPipe socket;
+  std::string shmName;
+  uint8_t *base = nullptr;
+  size_t mapSize = 0;
+  ShmHeader *header = nullptr;
+  int writeRing = 0;
+  uint32_t nextSlot = 0;
+  uint32_t peekSlot = SHM_INLINE;
+#ifdef _WIN32
+  HANDLE hMap = NULL;
+#else
+  int segmentFd = -1;
+#endif
+};
+
+static std::string shmNameFor(const std::string &name) {
+#ifdef _WIN32
+  return "Local\\libav-node-" + name;
+#else
+  return "/libav-node-" + name;
+#endif
+}
+
+// Every accepted connection gets its own ring, the ring number is the first
+// thing sent to the client so it can map the matching segment.
+class IPCShmListenerImpl : public IIPCListener {
+public:
+  void close() override {
+    if (socket) socket->close();
+  }
+
+  bool isOpen() const override {
+    return socket && socket->isOpen();
+  }
+
+  int handle() const override {
+    return (socket) ? socket->handle() : -1;
+  }
+
+  IPCPipe accept(int timeoutMs) override {
+    auto client = socket->accept(timeoutMs);
+    if (!client) {
+      return nullptr;
+    }
+
+    auto ipc = std::make_shared<IPCShmPipeImpl>();
+    uint32_t ring = nextRing++;
+    ipc->shmName = shmNameFor(name + "-" + std::to_string(ring));
+    if (!ipc->map(true, slotCount, slotSize)) {
+      return nullptr;
+    }
+
+    ipc->socket = client;
+    if (client->write(&ring, sizeof(ring)) != sizeof(ring)) {
+      return nullptr;
+    }
+#ifndef _WIN32
+    bool sent = client->sendFd(ipc->segmentFd);
+    ::close(ipc->segmentFd);
+    ipc->segmentFd = -1;
+    if (!sent) {
+      LOG_ERROR << "[IPC] Could not pass shared memory ring " << ring;
+      return nullptr;
+    }
+#endif
+
+    LOG_INFO << "[IPC] Shared memory ring " << ring << ": " << slotCount << " slots of " << ipc->header->slotSize << " bytes";
+    return ipc;
+  }
+
+  IPCListener socket;
+  std::string name;
+  size_t slotCount = 0;
+  size_t slotSize = 0;
+  uint32_t nextRing = 0;
+};
+
+IPCListener IIPCListener::createShared(const std::string &name, size_t bufferStorageSize, size_t backlog,
+                                       size_t slotCount, size_t slotSize) try {
+  auto ipc = std::make_shared<IPCShmListenerImpl>();
+  if (!ipc || !slotCount || !slotSize) {
+    return nullptr;
+  }
+
+  ipc->name = name;
+  ipc->slotCount = slotCount;
+  ipc->slotSize = slotSize;
+  ipc->socket = IIPCListener::create(name, bufferStorageSize, backlog);
+  if (!ipc->socket) {
+    return nullptr;
+  }
+
+  return ipc;
+} catch (std::exception &e) {
+  LOG_ERROR << "[IPC] Create shared error: " << e.what();
+  return nullptr;
+}
+
+IPCPipe IIPCPipe::openShared(const std::string &name, int waitMs) try {
+  auto ipc = std::make_shared<IPCShmPipeImpl>();
+  if (!ipc) {
+    return nullptr;
+  }
+
+  ipc->socket = IIPCPipe::open(name, waitMs);
+  if (!ipc->socket) {
+    return nullptr;
+  }
+
+  uint32_t ring;
+  if (ipc->socket->read(&ring, sizeof(ring), 5000) != sizeof(ring)) {
+    LOG_ERROR << "[IPC] No shared memory ring assigned";
+    return nullptr;
+  }
+
+  ipc->shmName = shmNameFor(name + "-" + std::to_string(ring));
+#ifdef _WIN32
+  if (!ipc->map(false, 0, 0)) {
+    return nullptr;
+  }
+#else
+  int fd = ipc->socket->receiveFd(5000);
+  if (fd < 0) {
+    LOG_ERROR << "[IPC] No shared memory ring received";
+    return nullptr;
+  }
+  if (!ipc->map(false, 0, 0, fd)) {
+    return nullptr;
+  }
+#endif
+
+  return ipc;
+} catch (std::exception &e) {
+  LOG_ERROR << "[IPC] Open shared error: " << e.what();
+  return nullptr;
+}
@@ -0,0 +1,335 @@
+#include <plog/Log.h>
+#include "ipc-pipe.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <errno.h>
+#include <liburing.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define URING_QUEUE_DEPTH  8
+#define URING_STAGING_SIZE (64 * 1024)
+#define URING_MAX_PARTS    8
+
+// user_data of the operations, told apart when reaping
+#define URING_OP_IO       1
+#define URING_OP_TIMEOUT  2
+#define URING_OP_DEFERRED 3   // the size written is kept above URING_OP_BITS
+#define URING_OP_BITS     2
+#define URING_OP_MASK     ((1 << URING_OP_BITS) - 1)
+
+// Writes up to this size, reply headers and small records, are submitted
+// without waiting for their completion.
+#define URING_DEFER_SIZE 256
+
+// Socket pipe driving its I/O through io_uring. The socket is a fixed file
+// of two rings, one for the reading connection thread and one for the
+// writers, which reply from codec threads too. Writes of headers and small
+// records are gathered into a staging buffer and leave as one send, larger
+// ones as one vectored sendmsg, both with MSG_NOSIGNAL. Headers are submitted without
+// waiting: the payload write following them is drained behind them and
+// reaps all completions at once, so a reply costs a single wait. A failed
+// deferred write closes the pipe at the next write. A read is a recv with a
+// linked timeout, submitted and reaped with a single io_uring_enter instead
+// of a poll and a read. Descriptor passing and the reactor handle stay on
+// the plain socket.
+class IPCUringPipeImpl : public IIPCPipe {
+public:
+  ~IPCUringPipeImpl() {
+    if (readReady) io_uring_queue_exit(&readRing);
+    if (writeReady) io_uring_queue_exit(&writeRing);
+  }
+
+  bool init(const IPCPipe &pipe) {
+    socket = pipe;
+    int fd = socket->handle();
+    if (fd < 0) {
+      return false;
+    }
+
+    if (io_uring_queue_init(URING_QUEUE_DEPTH, &readRing, 0) < 0) {
+      return false;
+    }
+    readReady = true;
+    if (io_uring_queue_init(URING_QUEUE_DEPTH, &writeRing, 0) < 0) {
+      return false;
+    }
+    writeReady = true;
+
+    // recv, sendmsg and linked timeouts arrived in different kernels
+    auto probe = io_uring_get_probe_ring(&readRing);
+    bool supported = probe && io_uring_opcode_supported(probe, IORING_OP_RECV) &&
+                     io_uring_opcode_supported(probe, IORING_OP_SENDMSG) &&
+                     io_uring_opcode_supported(probe, IORING_OP_SEND) &&
+                     io_uring_opcode_supported(probe, IORING_OP_LINK_TIMEOUT);
+    if (probe) io_uring_free_probe(probe);
+    if (!supported) {
+      return false;
+    }
+
+    staging.resize(URING_STAGING_SIZE);
+    return io_uring_register_files(&readRing, &fd, 1) == 0 && io_uring_register_files(&writeRing, &fd, 1) == 0;
+  }
+
+  // the plain pipe keeps the descriptor until it goes away with this one
+  void close() {
+    if (!closed.exchange(true)) ::shutdown(socket->handle(), SHUT_RDWR);
+  }
+
+  size_t write(const void *data, size_t size) override {
+    IPCBuffer part = { data, size };
+    return writev(&part, 1);
+  }
+
+  size_t writev(const IPCBuffer *parts, size_t count) override {
+    if (count > URING_MAX_PARTS) {
+      return IIPCPipe::writev(parts, count);
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) size += parts[i].size;
+    if (!size || closed) {
+      return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(writeMutex);
+    if (size <= staging.size()) {
+      if (stagedBytes + size > staging.size() || deferred + 1 >= URING_QUEUE_DEPTH) {
+        if (!reapWrites()) {
+          return 0;
+        }
+      }
+      auto ptr = &staging[stagedBytes];
+      size_t offset = 0;
+      for (size_t i = 0; i < count; i++) {
+        if (parts[i].size) memcpy(ptr + offset, parts[i].data, parts[i].size);
+        offset += parts[i].size;
+      }
+
+      // a reply header goes out without waiting, the payload write following
+      // it reaps both completions with a single wait
+      if (size <= URING_DEFER_SIZE) {
+        auto sqe = prepWrite(ptr, size);
+        io_uring_sqe_set_data64(sqe, ((uint64_t)size << URING_OP_BITS) | URING_OP_DEFERRED);
+        if (io_uring_submit(&writeRing) < 1) {
+          close();
+          return 0;
+        }
+        stagedBytes += size;
+        deferred++;
+        return size;
+      }
+
+      for (offset = 0; offset < size;) {
+        prepWrite(ptr + offset, size - offset);
+        int ret = submitWrite();
+        if (ret <= 0) {
+          close();
+          return 0;
+        }
+        offset += ret;
+      }
+      return size;
+    }
+
+    struct iovec iov[URING_MAX_PARTS];
+    for (size_t i = 0; i < count; i++) {
+      iov[i].iov_base = (void *)parts[i].data;
+      iov[i].iov_len = parts[i].size;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    size_t totalBytes = 0;
+    while (totalBytes < size) {
+      auto sqe = io_uring_get_sqe(&writeRing);
+      io_uring_prep_sendmsg(sqe, 0, &msg, MSG_NOSIGNAL);
+      sqe->flags |= IOSQE_FIXED_FILE | (deferred ? IOSQE_IO_DRAIN : 0);
+      io_uring_sqe_set_data64(sqe, URING_OP_IO);
+      int ret = submitWrite();
+      if (ret <= 0) {
+        close();
+        return 0;
+      }
+      totalBytes += ret;
+      // skip what went out, a part may have been sent halfway
+      while (msg.msg_iovlen && (size_t)ret >= msg.msg_iov->iov_len) {
+        ret -= (int)msg.msg_iov->iov_len;
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+      if (msg.msg_iovlen) {
+        msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + ret;
+        msg.msg_iov->iov_len -= ret;
+      }
+    }
+    return totalBytes;
+  }
+
+  size_t read(void *data, size_t size, int timeoutMs) override {
+    if (!data || !size || closed) {
+      return 0;
+    }
+
+    auto ptr = (uint8_t *)data;
+    size_t totalBytes = 0;
+    struct __kernel_timespec ts;
+    ts.tv_sec = (timeoutMs > 0) ? timeoutMs / 1000 : 0;
+    ts.tv_nsec = (timeoutMs > 0) ? (long long)(timeoutMs % 1000) * 1000000 : 0;
+
+    while (totalBytes < size) {
+      auto sqe = io_uring_get_sqe(&readRing);
+      io_uring_prep_recv(sqe, 0, &ptr[totalBytes], size - totalBytes, 0);
+      sqe->flags |= IOSQE_FIXED_FILE;
+      io_uring_sqe_set_data64(sqe, URING_OP_IO);
+      unsigned waitCount = 1;
+      if (timeoutMs >= 0) {
+        sqe->flags |= IOSQE_IO_LINK;
+        auto tsqe = io_uring_get_sqe(&readRing);
+        io_uring_prep_link_timeout(tsqe, &ts, 0);
+        io_uring_sqe_set_data64(tsqe, URING_OP_TIMEOUT);
+        waitCount = 2;
+      }
+
+      int ret = io_uring_submit_and_wait(&readRing, waitCount);
+      if (ret < 0 && ret != -EINTR) {
+        close();
+        return 0;
+      }
+      ret = -EINTR;
+      for (unsigned i = 0; i < waitCount; i++) {
+        struct io_uring_cqe *cqe;
+        int err;
+        do {
+          err = io_uring_wait_cqe(&readRing, &cqe);
+        } while (err == -EINTR);
+        if (err < 0) {
+          close();
+          return 0;
+        }
+        if (io_uring_cqe_get_data64(cqe) == URING_OP_IO) ret = cqe->res;
+        io_uring_cqe_seen(&readRing, cqe);
+      }
+
+      if (ret > 0) {
+        totalBytes += ret;
+      } else if (ret == -ECANCELED) {
+        return totalBytes;   // the linked timeout fired
+      } else if (ret != -EINTR && ret != -EAGAIN) {
+        close();
+        return 0;
+      }
+    }
+    return totalBytes;
+  }
+
+  bool sendFd(int fd) override {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    return reapWrites() && socket->sendFd(fd);
+  }
+
+  int receiveFd(int timeoutMs) override {
+    return socket->receiveFd(timeoutMs);
+  }
+
+  int handle() const override {
+    return socket->handle();
+  }
+
+  bool isOpen() const override {
+    return !closed && socket->isOpen();
+  }
+
+protected:
+  // Send of staged bytes, started only after the writes still in flight. A
+  // fixed write would raise SIGPIPE once the peer is gone, a send need not.
+  struct io_uring_sqe *prepWrite(uint8_t *data, size_t size) {
+    auto sqe = io_uring_get_sqe(&writeRing);
+    io_uring_prep_send(sqe, 0, data, size, MSG_NOSIGNAL);
+    sqe->flags |= IOSQE_FIXED_FILE | (deferred ? IOSQE_IO_DRAIN : 0);
+    io_uring_sqe_set_data64(sqe, URING_OP_IO);
+    return sqe;
+  }
+
+  // Submits the queued write and waits for it along with the deferred ones.
+  // Result of the queued write, or an error if a deferred write fell short.
+  int submitWrite() {
+    int ret = io_uring_submit_and_wait(&writeRing, deferred + 1);
+    if (ret < 0 && ret != -EINTR) {
+      return ret;
+    }
+    int result = -EIO;
+    for (unsigned pending = deferred + 1; pending; pending--) {
+      int err = reapOne(&result);
+      if (err < 0) {
+        return err;
+      }
+    }
+    deferred = 0;
+    stagedBytes = 0;
+    return failed ? -EIO : result;
+  }
+
+  // Waits for the deferred writes, before the staging buffer is reused or
+  // the socket is written around the ring.
+  bool reapWrites() {
+    for (; deferred; deferred--) {
+      if (reapOne(nullptr) < 0) {
+        break;
+      }
+    }
+    stagedBytes = 0;
+    if (deferred || failed) {
+      deferred = 0;
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  int reapOne(int *result) {
+    struct io_uring_cqe *cqe;
+    int err;
+    do {
+      err = io_uring_wait_cqe(&writeRing, &cqe);
+    } while (err == -EINTR);
+    if (err < 0) {
+      return err;
+    }
+    auto data = io_uring_cqe_get_data64(cqe);
+    if ((data & URING_OP_MASK) == URING_OP_DEFERRED) {
+      // a deferred write has nobody to resume it, it must go out whole
+      if (cqe->res < 0 || (uint64_t)cqe->res != (data >> URING_OP_BITS)) failed = true;
+    } else if (result) {
+      *result = cqe->res;
+    }
+    io_uring_cqe_seen(&writeRing, cqe);
+    return 0;
+  }
+
+  IPCPipe socket;
+  struct io_uring readRing, writeRing;
+  bool readReady = false, writeReady = false;
+  std::atomic<bool> closed = false;
+  std::mutex writeMutex;
+  std::vector<uint8_t> staging;   // small writes gathered for one send
+  size_t stagedBytes = 0;         // of staging, held by deferred writes
+  unsigned deferred = 0;          // writes submitted but not reaped
+  bool failed = false;
+};
+
+IPCPipe wrapUringPipe(const IPCPipe &pipe) {
+  static std::atomic<bool> warned = false;
+  auto ipc = std::make_shared<IPCUringPipeImpl>();
+  if (!ipc || !ipc->init(pipe)) {
+    if (!warned.exchange(true)) LOG_INFO << "[IPC] io_uring unavailable, using plain socket I/O";
+    return nullptr;
+  }
+  return ipc;
+}
@@ -1,5 +1,9 @@
 #include "common.h"
 
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
 #ifdef _WIN32
 int WINAPI wWinMain(HINSTANCE hInstance,
                     HINSTANCE hPrevInstance,
@@ -10,10 +14,18 @@ int main(int argc, char **argv) {
 #endif
 
   std::string instanceId;
+  bool hugePages = false;
+  bool announceReady = false;
+  bool dumpCaps = false;
 
   CLI::App app("libAV Node Service");
   app.add_option("-i", instanceId, "Service instance. Required unless a test is ran");
   app.add_flag("--log", dumpLog, "Save logs to a file");
+  app.add_flag("--shm", useSharedMemory, "Transfer frames and packets through shared memory");
+  app.add_flag("--hugepages", hugePages, "Back large frame buffers with huge pages");
+  app.add_flag("--refresh-caps", refreshCapabilities, "Probe the codecs again and rewrite the capability cache");
+  app.add_flag("--caps", dumpCaps, "Print the codec capabilities and exit");
+  app.add_flag("--ready", announceReady, "Print \"ready <instance>\" to stdout once clients can connect");
 
 #ifdef _WIN32
   try {
@@ -31,6 +43,12 @@ int main(int argc, char **argv) {
   }
 #endif
 
+#ifndef _WIN32
+  // a peer going away surfaces as EPIPE on the write to it instead of
+  // terminating the service with every other client's sessions
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
   if (dumpLog) {
     std::string fname = "libav-node-" + instanceId + ".log";
     std::remove(fname.c_str());
@@ -38,10 +56,36 @@ int main(int argc, char **argv) {
     plog::init(plog::debug, &fileAppender);
   }
 
+  if (dumpCaps) {
+    std::stringstream ss;
+    for (auto &c : IAVEnc::getCapabilities(refreshCapabilities)) {
+      ss << ((c.flags & AVCapsFlagEncoder) ? "encoder " : "decoder ") << c.name
+         << ((c.flags & AVCapsFlagOpens) ? " opens" : " fails");
+      if (c.maxWidth) ss << " max " << c.maxWidth << "x" << c.maxHeight;
+      ss << " pix_fmts";
+      for (int i = 0; i < c.pixFmtCount; i++) ss << " " << c.pixFmts[i];
+      ss << "\n";
+    }
+    printf("%s", ss.str().c_str());
+    return 0;
+  }
+
+  BufferPool::get().setHugePages(hugePages);
+
   if (!startService(instanceId)) {
     LOG_ERROR << "Failed to start the service";
     return 2;
   }
+  if (announceReady) {
+    std::string line = "ready " + instanceId + "\n";
+#ifdef _WIN32
+    DWORD written = 0;
+    WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), line.c_str(), (DWORD)line.size(), &written, NULL);
+#else
+    fputs(line.c_str(), stdout);
+    fflush(stdout);
+#endif
+  }
   waitServiceToExit();
 
   return 0;
@@ -0,0 +1,687 @@
+#include <plog/Log.h>
+#include "pixconv.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PIXCONV_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PIXCONV_TARGET(isa)
+#else
+#define PIXCONV_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+enum class PixelIsa {
+  Scalar,
+  Sse41,
+  Avx2,
+};
+
+// BT.601 limited range in 8 bit fixed point. The SIMD rows evaluate the same
+// integer expressions, so every ISA produces identical pictures.
+#define PIX_Y_R   66
+#define PIX_Y_G   129
+#define PIX_Y_B   25
+#define PIX_U_R   -38
+#define PIX_U_G   -74
+#define PIX_U_B   112
+#define PIX_V_R   112
+#define PIX_V_G   -94
+#define PIX_V_B   -18
+#define PIX_C_Y   298
+#define PIX_R_V   409
+#define PIX_G_U   -100
+#define PIX_G_V   -208
+#define PIX_B_U   516
+
+static inline uint8_t clampPixel(int value) {
+  return (value < 0) ? 0 : (value > 255) ? 255 : (uint8_t)value;
+}
+
+// Row kernels. Packed RGB rows are BGRA when Bgra is set, RGBA otherwise.
+template<PixelIsa Isa> struct PixelRows;
+
+template<>
+struct PixelRows<PixelIsa::Scalar> {
+  static void splitUV(const uint8_t *uv, uint8_t *u, uint8_t *v, int count) {
+    for (int i = 0; i < count; i++) {
+      u[i] = uv[2 * i];
+      v[i] = uv[2 * i + 1];
+    }
+  }
+
+  static void mergeUV(const uint8_t *u, const uint8_t *v, uint8_t *uv, int count) {
+    for (int i = 0; i < count; i++) {
+      uv[2 * i] = u[i];
+      uv[2 * i + 1] = v[i];
+    }
+  }
+
+  template<bool Bgra>
+  static void rgbToY(const uint8_t *rgb, uint8_t *y, int width) {
+    for (int x = 0; x < width; x++, rgb += 4) {
+      int r = rgb[Bgra ? 2 : 0], g = rgb[1], b = rgb[Bgra ? 0 : 2];
+      y[x] = ((PIX_Y_R * r + PIX_Y_G * g + PIX_Y_B * b + 128) >> 8) + 16;
+    }
+  }
+
+  // Averages each 2x2 block of rows 'rgb0'/'rgb1', odd widths repeat the last column.
+  template<bool Bgra>
+  static void rgbToUV(const uint8_t *rgb0, const uint8_t *rgb1, uint8_t *u, uint8_t *v, int width) {
+    for (int x = 0; x < width; x += 2) {
+      int next = (x + 1 < width) ? 4 : 0;
+      auto p0 = rgb0 + 4 * x, p1 = rgb1 + 4 * x;
+      int sum[3];
+      for (int c = 0; c < 3; c++) {
+        sum[c] = (p0[c] + p0[c + next] + p1[c] + p1[c + next] + 2) >> 2;
+      }
+      int r = sum[Bgra ? 2 : 0], g = sum[1], b = sum[Bgra ? 0 : 2];
+      u[x / 2] = ((PIX_U_R * r + PIX_U_G * g + PIX_U_B * b + 128) >> 8) + 128;
+      v[x / 2] = ((PIX_V_R * r + PIX_V_G * g + PIX_V_B * b + 128) >> 8) + 128;
+    }
+  }
+
+  template<bool Bgra>
+  static void yuvToRgb(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *rgb, int width) {
+    for (int x = 0; x < width; x++, rgb += 4) {
+      int c = y[x] - 16, d = u[x / 2] - 128, e = v[x / 2] - 128;
+      uint8_t r = clampPixel((PIX_C_Y * c + PIX_R_V * e + 128) >> 8);
+      uint8_t g = clampPixel((PIX_C_Y * c + PIX_G_U * d + PIX_G_V * e + 128) >> 8);
+      uint8_t b = clampPixel((PIX_C_Y * c + PIX_B_U * d + 128) >> 8);
+      rgb[0] = Bgra ? b : r;
+      rgb[1] = g;
+      rgb[2] = Bgra ? r : b;
+      rgb[3] = 255;
+    }
+  }
+};
+
+#ifdef PIXCONV_X86
+// 16 bit coefficient pairs of one pixel for _mm_madd_epi16, in memory order.
+#define PIX_COEFFS(Bgra, r, g, b) \
+  ((Bgra) ? (int16_t)(b) : (int16_t)(r)), (int16_t)(g), ((Bgra) ? (int16_t)(r) : (int16_t)(b)), 0
+#define PIX_PAIR(lo, hi) ((int)(((uint32_t)(uint16_t)(int16_t)(hi) << 16) | (uint16_t)(int16_t)(lo)))
+
+template<>
+struct PixelRows<PixelIsa::Sse41> {
+  typedef PixelRows<PixelIsa::Scalar> Tail;
+
+  PIXCONV_TARGET("sse4.1")
+  static void splitUV(const uint8_t *uv, uint8_t *u, uint8_t *v, int count) {
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(uv + 2 * i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 16));
+      _mm_storeu_si128((__m128i *)(u + i), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+      _mm_storeu_si128((__m128i *)(v + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    Tail::splitUV(uv + 2 * i, u + i, v + i, count - i);
+  }
+
+  PIXCONV_TARGET("sse4.1")
+  static void mergeUV(const uint8_t *u, const uint8_t *v, uint8_t *uv, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(u + i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(v + i));
+      _mm_storeu_si128((__m128i *)(uv + 2 * i), _mm_unpacklo_epi8(a, b));
+      _mm_storeu_si128((__m128i *)(uv + 2 * i + 16), _mm_unpackhi_epi8(a, b));
+    }
+    Tail::mergeUV(u + i, v + i, uv + 2 * i, count - i);
+  }
+
+  // Weighted channel sums of four pixels as 32 bit lanes.
+  PIXCONV_TARGET("sse4.1")
+  static __m128i dot4(__m128i pixels, __m128i coeffs) {
+    __m128i lo = _mm_madd_epi16(_mm_cvtepu8_epi16(pixels), coeffs);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, _mm_setzero_si128()), coeffs);
+    return _mm_hadd_epi32(lo, hi);
+  }
+
+  template<bool Bgra>
+  PIXCONV_TARGET("sse4.1")
+  static void rgbToY(const uint8_t *rgb, uint8_t *y, int width) {
+    const __m128i coeffs = _mm_setr_epi16(PIX_COEFFS(Bgra, PIX_Y_R, PIX_Y_G, PIX_Y_B),
+                                          PIX_COEFFS(Bgra, PIX_Y_R, PIX_Y_G, PIX_Y_B));
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i offset = _mm_set1_epi16(16);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      __m128i a = dot4(_mm_loadu_si128((const __m128i *)(rgb + 4 * x)), coeffs);
+      __m128i b = dot4(_mm_loadu_si128((const __m128i *)(rgb + 4 * x + 16)), coeffs);
+      a = _mm_srai_epi32(_mm_add_epi32(a, round), 8);
+      b = _mm_srai_epi32(_mm_add_epi32(b, round), 8);
+      __m128i luma = _mm_add_epi16(_mm_packs_epi32(a, b), offset);
+      _mm_storel_epi64((__m128i *)(y + x), _mm_packus_epi16(luma, luma));
+    }
+    Tail::rgbToY<Bgra>(rgb + 4 * x, y + x, width - x);
+  }
+
+  // Rounded 2x2 averages of eight pixels from each row, two blocks per 64 bits.
+  PIXCONV_TARGET("sse4.1")
+  static void average2x2(const uint8_t *rgb0, const uint8_t *rgb1, __m128i &first, __m128i &second) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(2);
+    __m128i avg[2];
+    for (int h = 0; h < 2; h++) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(rgb0 + 16 * h));
+      __m128i b = _mm_loadu_si128((const __m128i *)(rgb1 + 16 * h));
+      __m128i lo = _mm_add_epi16(_mm_cvtepu8_epi16(a), _mm_cvtepu8_epi16(b));
+      __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+      lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+      hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+      avg[h] = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), round), 2);
+    }
+    first = avg[0];
+    second = avg[1];
+  }
+
+  PIXCONV_TARGET("sse4.1")
+  static void storeChroma(uint8_t *dst, __m128i first, __m128i second, __m128i coeffs) {
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i offset = _mm_set1_epi16(128);
+    __m128i sum = _mm_hadd_epi32(_mm_madd_epi16(first, coeffs), _mm_madd_epi16(second, coeffs));
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, round), 8);
+    __m128i chroma = _mm_add_epi16(_mm_packs_epi32(sum, sum), offset);
+    int value = _mm_cvtsi128_si32(_mm_packus_epi16(chroma, chroma));
+    memcpy(dst, &value, sizeof(value));
+  }
+
+  template<bool Bgra>
+  PIXCONV_TARGET("sse4.1")
+  static void rgbToUV(const uint8_t *rgb0, const uint8_t *rgb1, uint8_t *u, uint8_t *v, int width) {
+    const __m128i coeffsU = _mm_setr_epi16(PIX_COEFFS(Bgra, PIX_U_R, PIX_U_G, PIX_U_B),
+                                           PIX_COEFFS(Bgra, PIX_U_R, PIX_U_G, PIX_U_B));
+    const __m128i coeffsV = _mm_setr_epi16(PIX_COEFFS(Bgra, PIX_V_R, PIX_V_G, PIX_V_B),
+                                           PIX_COEFFS(Bgra, PIX_V_R, PIX_V_G, PIX_V_B));
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      __m128i first, second;
+      average2x2(rgb0 + 4 * x, rgb1 + 4 * x, first, second);
+      storeChroma(u + x / 2, first, second, coeffsU);
+      storeChroma(v + x / 2, first, second, coeffsV);
+    }
+    Tail::rgbToUV<Bgra>(rgb0 + 4 * x, rgb1 + 4 * x, u + x / 2, v + x / 2, width - x);
+  }
+
+  template<bool Bgra>
+  PIXCONV_TARGET("sse4.1")
+  static void yuvToRgb(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *rgb, int width) {
+    const __m128i lumaOffset = _mm_set1_epi16(16);
+    const __m128i chromaOffset = _mm_set1_epi16(128);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i alpha = _mm_set1_epi8((char)255);
+    const __m128i coeffsR = _mm_set1_epi32(PIX_PAIR(PIX_C_Y, PIX_R_V));
+    const __m128i coeffsG0 = _mm_set1_epi32(PIX_PAIR(PIX_C_Y, PIX_G_U));
+    const __m128i coeffsG1 = _mm_set1_epi32(PIX_PAIR(PIX_G_V, 128));
+    const __m128i coeffsB = _mm_set1_epi32(PIX_PAIR(PIX_C_Y, PIX_B_U));
+    const __m128i round = _mm_set1_epi32(128);
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      int u4, v4;
+      memcpy(&u4, u + x / 2, sizeof(u4));
+      memcpy(&v4, v + x / 2, sizeof(v4));
+      __m128i c = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(y + x))), lumaOffset);
+      __m128i d = _mm_cvtsi32_si128(u4);
+      __m128i e = _mm_cvtsi32_si128(v4);
+      d = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_unpacklo_epi8(d, d)), chromaOffset);
+      e = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_unpacklo_epi8(e, e)), chromaOffset);
+
+      __m128i ce[2] = { _mm_unpacklo_epi16(c, e), _mm_unpackhi_epi16(c, e) };
+      __m128i cd[2] = { _mm_unpacklo_epi16(c, d), _mm_unpackhi_epi16(c, d) };
+      __m128i e1[2] = { _mm_unpacklo_epi16(e, one), _mm_unpackhi_epi16(e, one) };
+      __m128i r[2], g[2], b[2];
+      for (int h = 0; h < 2; h++) {
+        r[h] = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(ce[h], coeffsR), round), 8);
+        g[h] = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(cd[h], coeffsG0), _mm_madd_epi16(e1[h], coeffsG1)), 8);
+        b[h] = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(cd[h], coeffsB), round), 8);
+      }
+      __m128i r8 = _mm_packs_epi32(r[0], r[1]);
+      __m128i g8 = _mm_packs_epi32(g[0], g[1]);
+      __m128i b8 = _mm_packs_epi32(b[0], b[1]);
+      r8 = _mm_packus_epi16(r8, r8);
+      g8 = _mm_packus_epi16(g8, g8);
+      b8 = _mm_packus_epi16(b8, b8);
+
+      __m128i first = _mm_unpacklo_epi8(Bgra ? b8 : r8, g8);
+      __m128i second = _mm_unpacklo_epi8(Bgra ? r8 : b8, alpha);
+      _mm_storeu_si128((__m128i *)(rgb + 4 * x), _mm_unpacklo_epi16(first, second));
+      _mm_storeu_si128((__m128i *)(rgb + 4 * x + 16), _mm_unpackhi_epi16(first, second));
+    }
+    Tail::yuvToRgb<Bgra>(y + x, u + x / 2, v + x / 2, rgb + 4 * x, width - x);
+  }
+};
+
+// AVX2 rows work on 128 bit lanes, the permutes restore pixel order.
+template<>
+struct PixelRows<PixelIsa::Avx2> {
+  typedef PixelRows<PixelIsa::Sse41> Tail;
+
+  PIXCONV_TARGET("avx2")
+  static void splitUV(const uint8_t *uv, uint8_t *u, uint8_t *v, int count) {
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(uv + 2 * i));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 32));
+      __m256i cu = _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+      __m256i cv = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+      _mm256_storeu_si256((__m256i *)(u + i), _mm256_permute4x64_epi64(cu, 0xd8));
+      _mm256_storeu_si256((__m256i *)(v + i), _mm256_permute4x64_epi64(cv, 0xd8));
+    }
+    Tail::splitUV(uv + 2 * i, u + i, v + i, count - i);
+  }
+
+  PIXCONV_TARGET("avx2")
+  static void mergeUV(const uint8_t *u, const uint8_t *v, uint8_t *uv, int count) {
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(u + i));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(v + i));
+      __m256i lo = _mm256_unpacklo_epi8(a, b);
+      __m256i hi = _mm256_unpackhi_epi8(a, b);
+      _mm256_storeu_si256((__m256i *)(uv + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+      _mm256_storeu_si256((__m256i *)(uv + 2 * i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    Tail::mergeUV(u + i, v + i, uv + 2 * i, count - i);
+  }
+
+  // Weighted channel sums of eight pixels as 32 bit lanes.
+  PIXCONV_TARGET("avx2")
+  static __m256i dot8(__m256i pixels, __m256i coeffs) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), coeffs);
+    __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), coeffs);
+    return _mm256_hadd_epi32(lo, hi);
+  }
+
+  template<bool Bgra>
+  PIXCONV_TARGET("avx2")
+  static void rgbToY(const uint8_t *rgb, uint8_t *y, int width) {
+    const __m256i coeffs = _mm256_setr_epi16(PIX_COEFFS(Bgra, PIX_Y_R, PIX_Y_G, PIX_Y_B),
+                                             PIX_COEFFS(Bgra, PIX_Y_R, PIX_Y_G, PIX_Y_B),
+                                             PIX_COEFFS(Bgra, PIX_Y_R, PIX_Y_G, PIX_Y_B),
+                                             PIX_COEFFS(Bgra, PIX_Y_R, PIX_Y_G, PIX_Y_B));
+    const __m256i round = _mm256_set1_epi32(128);
+    const __m256i offset = _mm256_set1_epi16(16);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      __m256i a = dot8(_mm256_loadu_si256((const __m256i *)(rgb + 4 * x)), coeffs);
+      __m256i b = dot8(_mm256_loadu_si256((const __m256i *)(rgb + 4 * x + 32)), coeffs);
+      a = _mm256_srai_epi32(_mm256_add_epi32(a, round), 8);
+      b = _mm256_srai_epi32(_mm256_add_epi32(b, round), 8);
+      __m256i luma = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+      luma = _mm256_add_epi16(luma, offset);
+      luma = _mm256_permute4x64_epi64(_mm256_packus_epi16(luma, luma), 0xd8);
+      _mm_storeu_si128((__m128i *)(y + x), _mm256_castsi256_si128(luma));
+    }
+    Tail::rgbToY<Bgra>(rgb + 4 * x, y + x, width - x);
+  }
+
+  // Rounded 2x2 averages of eight pixels from each row, block order 0 1 | 2 3.
+  PIXCONV_TARGET("avx2")
+  static __m256i average2x2(const uint8_t *rgb0, const uint8_t *rgb1) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i a = _mm256_loadu_si256((const __m256i *)rgb0);
+    __m256i b = _mm256_loadu_si256((const __m256i *)rgb1);
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_set1_epi16(2)), 2);
+  }
+
+  PIXCONV_TARGET("avx2")
+  static void storeChroma(uint8_t *dst, __m256i first, __m256i second, __m256i coeffs) {
+    const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    __m256i sum = _mm256_hadd_epi32(_mm256_madd_epi16(first, coeffs), _mm256_madd_epi16(second, coeffs));
+    sum = _mm256_permutevar8x32_epi32(sum, order);
+    sum = _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8);
+    __m256i chroma = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, sum), 0xd8);
+    chroma = _mm256_add_epi16(chroma, _mm256_set1_epi16(128));
+    chroma = _mm256_packus_epi16(chroma, chroma);
+    _mm_storel_epi64((__m128i *)dst, _mm256_castsi256_si128(chroma));
+  }
+
+  template<bool Bgra>
+  PIXCONV_TARGET("avx2")
+  static void rgbToUV(const uint8_t *rgb0, const uint8_t *rgb1, uint8_t *u, uint8_t *v, int width) {
+    const __m256i coeffsU = _mm256_setr_epi16(PIX_COEFFS(Bgra, PIX_U_R, PIX_U_G, PIX_U_B),
+                                              PIX_COEFFS(Bgra, PIX_U_R, PIX_U_G, PIX_U_B),
+                                              PIX_COEFFS(Bgra, PIX_U_R, PIX_U_G, PIX_U_B),
+                                              PIX_COEFFS(Bgra, PIX_U_R, PIX_U_G, PIX_U_B));
+    const __m256i coeffsV = _mm256_setr_epi16(PIX_COEFFS(Bgra, PIX_V_R, PIX_V_G, PIX_V_B),
+                                              PIX_COEFFS(Bgra, PIX_V_R, PIX_V_G, PIX_V_B),
+                                              PIX_COEFFS(Bgra, PIX_V_R, PIX_V_G, PIX_V_B),
+                                              PIX_COEFFS(Bgra, PIX_V_R, PIX_V_G, PIX_V_B));
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      __m256i first = average2x2(rgb0 + 4 * x, rgb1 + 4 * x);
+      __m256i second = average2x2(rgb0 + 4 * x + 32, rgb1 + 4 * x + 32);
+      storeChroma(u + x / 2, first, second, coeffsU);
+      storeChroma(v + x / 2, first, second, coeffsV);
+    }
+    Tail::rgbToUV<Bgra>(rgb0 + 4 * x, rgb1 + 4 * x, u + x / 2, v + x / 2, width - x);
+  }
+
+  template<bool Bgra>
+  PIXCONV_TARGET("avx2")
+  static void yuvToRgb(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *rgb, int width) {
+    const __m256i lumaOffset = _mm256_set1_epi16(16);
+    const __m256i chromaOffset = _mm256_set1_epi16(128);
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i alpha = _mm256_set1_epi8((char)255);
+    const __m256i coeffsR = _mm256_set1_epi32(PIX_PAIR(PIX_C_Y, PIX_R_V));
+    const __m256i coeffsG0 = _mm256_set1_epi32(PIX_PAIR(PIX_C_Y, PIX_G_U));
+    const __m256i coeffsG1 = _mm256_set1_epi32(PIX_PAIR(PIX_G_V, 128));
+    const __m256i coeffsB = _mm256_set1_epi32(PIX_PAIR(PIX_C_Y, PIX_B_U));
+    const __m256i round = _mm256_set1_epi32(128);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      __m128i u8 = _mm_loadl_epi64((const __m128i *)(u + x / 2));
+      __m128i v8 = _mm_loadl_epi64((const __m128i *)(v + x / 2));
+      __m256i c = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + x))), lumaOffset);
+      __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(u8, u8)), chromaOffset);
+      __m256i e = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v8, v8)), chromaOffset);
+
+      __m256i ce[2] = { _mm256_unpacklo_epi16(c, e), _mm256_unpackhi_epi16(c, e) };
+      __m256i cd[2] = { _mm256_unpacklo_epi16(c, d), _mm256_unpackhi_epi16(c, d) };
+      __m256i e1[2] = { _mm256_unpacklo_epi16(e, one), _mm256_unpackhi_epi16(e, one) };
+      __m256i r[2], g[2], b[2];
+      for (int h = 0; h < 2; h++) {
+        r[h] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(ce[h], coeffsR), round), 8);
+        g[h] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(cd[h], coeffsG0),
+                                                  _mm256_madd_epi16(e1[h], coeffsG1)), 8);
+        b[h] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(cd[h], coeffsB), round), 8);
+      }
+      __m256i r8 = _mm256_packs_epi32(r[0], r[1]);
+      __m256i g8 = _mm256_packs_epi32(g[0], g[1]);
+      __m256i b8 = _mm256_packs_epi32(b[0], b[1]);
+      r8 = _mm256_packus_epi16(r8, r8);
+      g8 = _mm256_packus_epi16(g8, g8);
+      b8 = _mm256_packus_epi16(b8, b8);
+
+      __m256i first = _mm256_unpacklo_epi8(Bgra ? b8 : r8, g8);
+      __m256i second = _mm256_unpacklo_epi8(Bgra ? r8 : b8, alpha);
+      __m256i lo = _mm256_unpacklo_epi16(first, second);
+      __m256i hi = _mm256_unpackhi_epi16(first, second);
+      _mm256_storeu_si256((__m256i *)(rgb + 4 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+      _mm256_storeu_si256((__m256i *)(rgb + 4 * x + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    Tail::yuvToRgb<Bgra>(y + x, u + x / 2, v + x / 2, rgb + 4 * x, width - x);
+  }
+};
+#endif
+
+static void copyPlane(const uint8_t *src, int srcLinesize, uint8_t *dst, int dstLinesize, int width, int height) {
+  if (srcLinesize == width && dstLinesize == width) {
+    memcpy(dst, src, (size_t)width * height);
+    return;
+  }
+  for (int y = 0; y < height; y++) {
+    memcpy(dst + (size_t)y * dstLinesize, src + (size_t)y * srcLinesize, width);
+  }
+}
+
+// Picture converters, specialized per format pair and instantiated per ISA.
+template<AVRawFormat Src, AVRawFormat Dst> struct PixelConv;
+
+template<>
+struct PixelConv<AVRawFormat::I420, AVRawFormat::I420> {
+  template<PixelIsa Isa>
+  static void run(const PixelPlanes &src, const PixelPlanes &dst, int width, int height) {
+    copyPlane(src.data[0], src.linesize[0], dst.data[0], dst.linesize[0], width, height);
+    copyPlane(src.data[1], src.linesize[1], dst.data[1], dst.linesize[1], (width + 1) / 2, (height + 1) / 2);
+    copyPlane(src.data[2], src.linesize[2], dst.data[2], dst.linesize[2], (width + 1) / 2, (height + 1) / 2);
+  }
+};
+
+template<>
+struct PixelConv<AVRawFormat::NV12, AVRawFormat::I420> {
+  template<PixelIsa Isa>
+  static void run(const PixelPlanes &src, const PixelPlanes &dst, int width, int height) {
+    copyPlane(src.data[0], src.linesize[0], dst.data[0], dst.linesize[0], width, height);
+    for (int y = 0; y < (height + 1) / 2; y++) {
+      PixelRows<Isa>::splitUV(src.data[1] + (size_t)y * src.linesize[1],
+                              dst.data[1] + (size_t)y * dst.linesize[1],
+                              dst.data[2] + (size_t)y * dst.linesize[2], (width + 1) / 2);
+    }
+  }
+};
+
+template<>
+struct PixelConv<AVRawFormat::I420, AVRawFormat::NV12> {
+  template<PixelIsa Isa>
+  static void run(const PixelPlanes &src, const PixelPlanes &dst, int width, int height) {
+    copyPlane(src.data[0], src.linesize[0], dst.data[0], dst.linesize[0], width, height);
+    for (int y = 0; y < (height + 1) / 2; y++) {
+      PixelRows<Isa>::mergeUV(src.data[1] + (size_t)y * src.linesize[1],
+                              src.data[2] + (size_t)y * src.linesize[2],
+                              dst.data[1] + (size_t)y * dst.linesize[1], (width + 1) / 2);
+    }
+  }
+};
+
+template<bool Bgra>
+struct RgbToI420 {
+  template<PixelIsa Isa>
+  static void run(const PixelPlanes &src, const PixelPlanes &dst, int width, int height) {
+    for (int y = 0; y < height; y += 2) {
+      auto rgb0 = src.data[0] + (size_t)y * src.linesize[0];
+      auto rgb1 = (y + 1 < height) ? rgb0 + src.linesize[0] : rgb0;
+      PixelRows<Isa>::template rgbToY<Bgra>(rgb0, dst.data[0] + (size_t)y * dst.linesize[0], width);
+      if (y + 1 < height) {
+        PixelRows<Isa>::template rgbToY<Bgra>(rgb1, dst.data[0] + (size_t)(y + 1) * dst.linesize[0], width);
+      }
+      PixelRows<Isa>::template rgbToUV<Bgra>(rgb0, rgb1, dst.data[1] + (size_t)(y / 2) * dst.linesize[1],
+                                             dst.data[2] + (size_t)(y / 2) * dst.linesize[2], width);
+    }
+  }
+};
+
+template<bool Bgra>
+struct I420ToRgb {
+  template<PixelIsa Isa>
+  static void run(const PixelPlanes &src, const PixelPlanes &dst, int width, int height) {
+    for (int y = 0; y < height; y++) {
+      PixelRows<Isa>::template yuvToRgb<Bgra>(src.data[0] + (size_t)y * src.linesize[0],
+                                              src.data[1] + (size_t)(y / 2) * src.linesize[1],
+                                              src.data[2] + (size_t)(y / 2) * src.linesize[2],
+                                              dst.data[0] + (size_t)y * dst.linesize[0], width);
+    }
+  }
+};
+
+template<> struct PixelConv<AVRawFormat::BGRA, AVRawFormat::I420> : RgbToI420<true> {};
+template<> struct PixelConv<AVRawFormat::RGBA, AVRawFormat::I420> : RgbToI420<false> {};
+template<> struct PixelConv<AVRawFormat::I420, AVRawFormat::BGRA> : I420ToRgb<true> {};
+template<> struct PixelConv<AVRawFormat::I420, AVRawFormat::RGBA> : I420ToRgb<false> {};
+
+static PixelIsa detectIsa() {
+#ifdef PIXCONV_X86
+  bool sse41 = false, avx2 = false;
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  int maxId = info[0];
+  __cpuid(info, 1);
+  sse41 = (info[2] & (1 << 19)) != 0;
+  bool osAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+  if (maxId >= 7 && osAvx) {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  sse41 = __builtin_cpu_supports("sse4.1");
+  avx2 = __builtin_cpu_supports("avx2");
+#endif
+  if (avx2) return PixelIsa::Avx2;
+  if (sse41) return PixelIsa::Sse41;
+#endif
+  return PixelIsa::Scalar;
+}
+
+template<AVRawFormat Src, AVRawFormat Dst>
+static PixelConvFunc selectConverter(PixelIsa isa) {
+  switch (isa) {
+#ifdef PIXCONV_X86
+    case PixelIsa::Avx2:  return PixelConv<Src, Dst>::template run<PixelIsa::Avx2>;
+    case PixelIsa::Sse41: return PixelConv<Src, Dst>::template run<PixelIsa::Sse41>;
+#endif
+    default:              return PixelConv<Src, Dst>::template run<PixelIsa::Scalar>;
+  }
+}
+
+PixelConvFunc getPixelConverter(AVRawFormat src, AVRawFormat dst) {
+  static const PixelIsa isa = detectIsa();
+
+  if (dst == AVRawFormat::I420) {
+    switch (src) {
+      case AVRawFormat::I420: return selectConverter<AVRawFormat::I420, AVRawFormat::I420>(isa);
+      case AVRawFormat::NV12: return selectConverter<AVRawFormat::NV12, AVRawFormat::I420>(isa);
+      case AVRawFormat::BGRA: return selectConverter<AVRawFormat::BGRA, AVRawFormat::I420>(isa);
+      case AVRawFormat::RGBA: return selectConverter<AVRawFormat::RGBA, AVRawFormat::I420>(isa);
+    }
+  } else if (src == AVRawFormat::I420) {
+    switch (dst) {
+      case AVRawFormat::NV12: return selectConverter<AVRawFormat::I420, AVRawFormat::NV12>(isa);
+      case AVRawFormat::BGRA: return selectConverter<AVRawFormat::I420, AVRawFormat::BGRA>(isa);
+      case AVRawFormat::RGBA: return selectConverter<AVRawFormat::I420, AVRawFormat::RGBA>(isa);
+      default: break;
+    }
+  }
+
+  LOG_ERROR << "[PIX] No conversion from " << rawFormatName(src) << " to " << rawFormatName(dst);
+  return nullptr;
+}
+
+size_t rawFrameSize(AVRawFormat format, int width, int height) {
+  switch (format) {
+    case AVRawFormat::I420:
+    case AVRawFormat::NV12: return (size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    case AVRawFormat::BGRA:
+    case AVRawFormat::RGBA: return 4 * (size_t)width * height;
+  }
+  return 0;
+}
+
+PixelPlanes rawFramePlanes(AVRawFormat format, uint8_t *data, int width, int height) {
+  PixelPlanes planes = {};
+  int chromaWidth = (width + 1) / 2;
+  int chromaHeight = (height + 1) / 2;
+  planes.data[0] = data;
+  switch (format) {
+    case AVRawFormat::I420:
+      planes.linesize[0] = width;
+      planes.data[1] = data + (size_t)width * height;
+      planes.linesize[1] = chromaWidth;
+      planes.data[2] = planes.data[1] + (size_t)chromaWidth * chromaHeight;
+      planes.linesize[2] = chromaWidth;
+      break;
+    case AVRawFormat::NV12:
+      planes.linesize[0] = width;
+      planes.data[1] = data + (size_t)width * height;
+      planes.linesize[1] = 2 * chromaWidth;
+      break;
+    case AVRawFormat::BGRA:
+    case AVRawFormat::RGBA:
+      planes.linesize[0] = 4 * width;
+      break;
+  }
+  return planes;
+}
+
+// Averages 2^shift square blocks, blocks at the right and bottom edges may be
+// partial. Column sums of a block row are gathered first so the source is
+// read row by row.
+static void downscalePlane(const uint8_t *src, int srcLinesize, int width, int height,
+                           uint8_t *dst, int dstLinesize, int shift, std::vector<uint32_t> &sums) {
+  int block = 1 << shift;
+  int dstWidth = downscaledSize(width, shift);
+  int dstHeight = downscaledSize(height, shift);
+  sums.resize(dstWidth);
+  for (int y = 0; y < dstHeight; y++) {
+    int rows = std::min(block, height - (y << shift));
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int r = 0; r < rows; r++) {
+      auto row = src + (size_t)((y << shift) + r) * srcLinesize;
+      for (int x = 0; x < width; x++) {
+        sums[x >> shift] += row[x];
+      }
+    }
+    auto out = dst + (size_t)y * dstLinesize;
+    for (int x = 0; x < dstWidth; x++) {
+      int count = rows * std::min(block, width - (x << shift));
+      out[x] = (uint8_t)((sums[x] + count / 2) / count);
+    }
+  }
+}
+
+void downscaleI420(const PixelPlanes &src, const PixelPlanes &dst, int width, int height, int shift) {
+  std::vector<uint32_t> sums;
+  downscalePlane(src.data[0], src.linesize[0], width, height, dst.data[0], dst.linesize[0], shift, sums);
+  for (int i = 1; i < 3; i++) {
+    downscalePlane(src.data[i], src.linesize[i], (width + 1) / 2, (height + 1) / 2,
+                   dst.data[i], dst.linesize[i], shift, sums);
+  }
+}
+
+// Source position and 8 bit weight of the next sample for each output
+// coordinate, sampling at pixel centers.
+static void scaleTaps(int srcSize, int dstSize, std::vector<int> &index, std::vector<int> &weight) {
+  index.resize(dstSize);
+  weight.resize(dstSize);
+  int64_t step = ((int64_t)srcSize << 16) / dstSize;
+  for (int i = 0; i < dstSize; i++) {
+    int64_t pos = std::max<int64_t>(i * step + step / 2 - (1 << 15), 0);
+    index[i] = std::min((int)(pos >> 16), srcSize - 1);
+    weight[i] = index[i] < srcSize - 1 ? (int)((pos >> 8) & 0xFF) : 0;
+  }
+}
+
+static void scalePlane(const uint8_t *src, int srcLinesize, int srcWidth, int srcHeight,
+                       uint8_t *dst, int dstLinesize, int width, int height) {
+  std::vector<int> xIndex, xWeight, yIndex, yWeight;
+  scaleTaps(srcWidth, width, xIndex, xWeight);
+  scaleTaps(srcHeight, height, yIndex, yWeight);
+  for (int y = 0; y < height; y++) {
+    auto top = src + (size_t)yIndex[y] * srcLinesize;
+    auto bottom = yWeight[y] ? top + srcLinesize : top;
+    int wy = yWeight[y];
+    auto out = dst + (size_t)y * dstLinesize;
+    for (int x = 0; x < width; x++) {
+      int i = xIndex[x], wx = xWeight[x];
+      int j = wx ? i + 1 : i;
+      int upper = top[i] * (256 - wx) + top[j] * wx;
+      int lower = bottom[i] * (256 - wx) + bottom[j] * wx;
+      out[x] = (uint8_t)((upper * (256 - wy) + lower * wy + (1 << 15)) >> 16);
+    }
+  }
+}
+
+void scaleI420(const PixelPlanes &src, int srcWidth, int srcHeight, const PixelPlanes &dst, int width, int height) {
+  scalePlane(src.data[0], src.linesize[0], srcWidth, srcHeight, dst.data[0], dst.linesize[0], width, height);
+  for (int i = 1; i < 3; i++) {
+    scalePlane(src.data[i], src.linesize[i], (srcWidth + 1) / 2, (srcHeight + 1) / 2,
+               dst.data[i], dst.linesize[i], (width + 1) / 2, (height + 1) / 2);
+  }
+}
+
+const char *rawFormatName(AVRawFormat format) {
+  switch (format) {
+    case AVRawFormat::I420: return "i420";
+    case AVRawFormat::NV12: return "nv12";
+    case AVRawFormat::BGRA: return "bgra";
+    case AVRawFormat::RGBA: return "rgba";
+  }
+  return "unknown";
+}
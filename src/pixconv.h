@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "libav_service.h"
+
+// Planes of a raw picture. Packed formats use plane 0 only, NV12 planes 0/1.
+struct PixelPlanes {
+  uint8_t *data[3];
+  int linesize[3];
+};
+
+typedef void (*PixelConvFunc)(const PixelPlanes &src, const PixelPlanes &dst, int width, int height);
+
+// Size of a tightly packed picture as sent by clients.
+size_t rawFrameSize(AVRawFormat format, int width, int height);
+// Describes a tightly packed picture starting at 'data'.
+PixelPlanes rawFramePlanes(AVRawFormat format, uint8_t *data, int width, int height);
+
+// Returns the fastest converter the CPU supports, nullptr for unsupported
+// pairs. Colors use BT.601 limited range.
+PixelConvFunc getPixelConverter(AVRawFormat src, AVRawFormat dst);
+const char *rawFormatName(AVRawFormat format);
+
+// Size of a picture downscaled by 2^shift, rounded up like libavcodec's lowres.
+inline int downscaledSize(int size, int shift) { return (size + (1 << shift) - 1) >> shift; }
+// Box filters an I420 picture to downscaledSize() of its width and height.
+void downscaleI420(const PixelPlanes &src, const PixelPlanes &dst, int width, int height, int shift);
+// Bilinear resize of an I420 picture to any size. Meant for factors up to 2,
+// larger reductions go through downscaleI420 first.
+void scaleI420(const PixelPlanes &src, int srcWidth, int srcHeight, const PixelPlanes &dst, int width, int height);
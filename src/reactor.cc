@@ -0,0 +1,132 @@
+#include <plog/Log.h>
+#include "reactor.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+#define REACTOR_MAX_EVENTS 8
+
+ReactorSignal::ReactorSignal() {
+#ifdef __linux__
+  fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0) {
+    LOG_ERROR << "[REACTOR] Could not create event. Error " << errno;
+  }
+#endif
+}
+
+ReactorSignal::~ReactorSignal() {
+#ifdef __linux__
+  if (fd >= 0) ::close(fd);
+#endif
+}
+
+void ReactorSignal::set() {
+#ifdef __linux__
+  uint64_t one = 1;
+  if (fd >= 0 && ::write(fd, &one, sizeof(one)) != sizeof(one)) {
+    LOG_ERROR << "[REACTOR] Could not raise event. Error " << errno;
+  }
+#endif
+}
+
+void ReactorSignal::clear() {
+#ifdef __linux__
+  uint64_t count;
+  if (fd >= 0 && ::read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG_ERROR << "[REACTOR] Could not clear event. Error " << errno;
+  }
+#endif
+}
+
+Reactor::Reactor() {
+#ifdef __linux__
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (epollFd < 0 || timerFd < 0 || !add(timerFd, Deadline)) {
+    LOG_ERROR << "[REACTOR] Could not create reactor. Error " << errno;
+    if (timerFd >= 0) ::close(timerFd);
+    if (epollFd >= 0) ::close(epollFd);
+    timerFd = epollFd = -1;
+  }
+#endif
+}
+
+Reactor::~Reactor() {
+#ifdef __linux__
+  if (timerFd >= 0) ::close(timerFd);
+  if (epollFd >= 0) ::close(epollFd);
+#endif
+}
+
+bool Reactor::add(int fd, uint32_t bit) {
+#ifdef __linux__
+  if (epollFd < 0 || fd < 0) {
+    return false;
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u32 = bit;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    LOG_ERROR << "[REACTOR] Could not watch descriptor. Error " << errno;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Reactor::remove(int fd) {
+#ifdef __linux__
+  if (epollFd >= 0 && fd >= 0) epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+bool Reactor::setDeadline(int timeoutMs) {
+#ifdef __linux__
+  if (timerFd < 0) {
+    return false;
+  }
+  // a zero it_value disarms the timer, expire right away instead
+  struct itimerspec spec = {};
+  spec.it_value.tv_sec = timeoutMs / 1000;
+  spec.it_value.tv_nsec = (timeoutMs > 0) ? (long)(timeoutMs % 1000) * 1000000 : 1;
+  return timerfd_settime(timerFd, 0, &spec, nullptr) == 0;
+#else
+  return false;
+#endif
+}
+
+uint32_t Reactor::wait(int timeoutMs) {
+#ifdef __linux__
+  if (epollFd < 0) {
+    return 0;
+  }
+
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  int count;
+  do {
+    count = epoll_wait(epollFd, events, REACTOR_MAX_EVENTS, timeoutMs);
+  } while (count < 0 && errno == EINTR);
+
+  uint32_t ready = 0;
+  for (int i = 0; i < count; i++) {
+    ready |= events[i].data.u32;
+  }
+  if (ready & Deadline) {
+    uint64_t expirations;
+    if (::read(timerFd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN) {
+      ready &= ~Deadline;   // re-armed after epoll reported it
+    }
+  }
+  return ready;
+#else
+  return 0;
+#endif
+}
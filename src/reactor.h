@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+
+// A flag other threads raise to wake a Reactor. It stays readable until
+// clear(), so one set() wakes every reactor watching it.
+class ReactorSignal {
+public:
+  ReactorSignal();
+  ~ReactorSignal();
+  ReactorSignal(ReactorSignal &) = delete;
+  ReactorSignal &operator = (ReactorSignal &) = delete;
+
+  void set();
+  void clear();
+  int handle() const { return fd; }
+
+protected:
+  int fd = -1;
+};
+
+// Sleeps until a watched descriptor is readable or the deadline passes, so
+// idle connections cost no wake-ups. Linux uses epoll and a timerfd, other
+// platforms report !isValid() and callers keep polling with timeouts.
+class Reactor {
+public:
+  // wait() bit of an expired deadline, watched descriptors use the others.
+  static constexpr uint32_t Deadline = 1u << 31;
+
+  Reactor();
+  ~Reactor();
+  Reactor(Reactor &) = delete;
+  Reactor &operator = (Reactor &) = delete;
+
+  bool isValid() const { return epollFd >= 0; }
+
+  // Level triggered, wait() reports 'bit' while 'fd' has data.
+  bool add(int fd, uint32_t bit);
+  void remove(int fd);
+
+  // One shot, a new deadline replaces the previous one.
+  bool setDeadline(int timeoutMs);
+
+  // The bits that are ready, 0 if 'timeoutMs' passed first.
+  uint32_t wait(int timeoutMs = -1);
+
+protected:
+  int epollFd = -1;
+  int timerFd = -1;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded single producer / single consumer queue. push() and pop() never
+// block or lock, callers pair them with an atomic wait when they need to sleep.
+template<class T>
+class SPSCQueue {
+public:
+  SPSCQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    slots.resize(size);
+    mask = size - 1;
+  }
+  SPSCQueue(SPSCQueue &) = delete;
+  SPSCQueue &operator = (SPSCQueue &) = delete;
+
+  bool push(T &&item) {
+    auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+    slots[t & mask] = std::move(item);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &item) {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = std::move(slots[h & mask]);
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+  size_t capacity() const { return mask + 1; }
+
+protected:
+  std::vector<T> slots;
+  size_t mask = 0;
+  alignas(64) std::atomic<size_t> head = 0;
+  alignas(64) std::atomic<size_t> tail = 0;
+};
@@ -0,0 +1,98 @@
+#include "stats.h"
+#include <algorithm>
+#include <bit>
+#include <iterator>
+
+// Values below 2 * STATS_SUB_BUCKETS have a bucket each, larger ones share
+// a bucket with those having the same top STATS_SUB_BITS + 1 bits.
+static int bucketOf(uint64_t ns) {
+  if (ns < 2 * STATS_SUB_BUCKETS) {
+    return (int)ns;
+  }
+  int msb = 63 - std::countl_zero(ns);
+  int shift = msb - STATS_SUB_BITS;
+  return 2 * STATS_SUB_BUCKETS + (msb - STATS_SUB_BITS - 1) * STATS_SUB_BUCKETS +
+         (int)((ns >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+// Middle of the bucket's range.
+static uint64_t valueOf(int bucket) {
+  if (bucket < 2 * STATS_SUB_BUCKETS) {
+    return (uint64_t)bucket;
+  }
+  int group = (bucket - 2 * STATS_SUB_BUCKETS) / STATS_SUB_BUCKETS;
+  int sub = (bucket - 2 * STATS_SUB_BUCKETS) % STATS_SUB_BUCKETS;
+  int shift = group + 1;
+  uint64_t low = (uint64_t)(STATS_SUB_BUCKETS + sub) << shift;
+  return low + ((1ull << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  buckets[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  totalNs.fetch_add(ns, std::memory_order_relaxed);
+  auto prev = maxNs.load(std::memory_order_relaxed);
+  while (prev < ns && !maxNs.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+}
+
+AVLatencyStats LatencyHistogram::snapshot() const {
+  AVLatencyStats stats = {};
+  uint64_t counts[STATS_BUCKETS];
+  uint64_t total = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    counts[i] = buckets[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  stats.count = total;
+  stats.totalNs = totalNs.load(std::memory_order_relaxed);
+  stats.maxNs = maxNs.load(std::memory_order_relaxed);
+  if (!total) {
+    return stats;
+  }
+
+  struct { double quantile; uint64_t *value; } wanted[] = {
+    { 0.5, &stats.p50Ns }, { 0.9, &stats.p90Ns }, { 0.99, &stats.p99Ns }, { 0.999, &stats.p999Ns },
+  };
+  uint64_t seen = 0;
+  size_t next = 0;
+  for (int i = 0; i < STATS_BUCKETS && next < std::size(wanted); i++) {
+    seen += counts[i];
+    while (next < std::size(wanted) && seen >= (uint64_t)(wanted[next].quantile * total + 0.5)) {
+      // never above the largest value seen
+      *wanted[next].value = std::min(valueOf(i), stats.maxNs);
+      next++;
+    }
+  }
+  return stats;
+}
+
+ServiceStats &ServiceStats::get() {
+  static ServiceStats stats;
+  return stats;
+}
+
+void ServiceStats::jobQueued() {
+  auto depth = queueDepth.fetch_add(1, std::memory_order_relaxed) + 1;
+  auto prev = maxQueueDepth.load(std::memory_order_relaxed);
+  while (prev < depth && !maxQueueDepth.compare_exchange_weak(prev, depth, std::memory_order_relaxed)) {}
+}
+
+AVServiceStats ServiceStats::snapshot() const {
+  AVServiceStats stats = {};
+  stats.version = AV_STATS_VERSION;
+  stats.headerSize = sizeof(AVServiceStats);
+  stats.uptimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  stats.commands = commands.load(std::memory_order_relaxed);
+  stats.bytesIn = bytesIn.load(std::memory_order_relaxed);
+  stats.bytesOut = bytesOut.load(std::memory_order_relaxed);
+  stats.framesIn = framesIn.load(std::memory_order_relaxed);
+  stats.framesOut = framesOut.load(std::memory_order_relaxed);
+  stats.packetsIn = packetsIn.load(std::memory_order_relaxed);
+  stats.packetsOut = packetsOut.load(std::memory_order_relaxed);
+  stats.queueDepth = (uint32_t)std::max<int64_t>(queueDepth.load(std::memory_order_relaxed), 0);
+  stats.maxQueueDepth = (uint32_t)maxQueueDepth.load(std::memory_order_relaxed);
+  for (int i = 0; i < (int)AVStatLatency::Count; i++) {
+    stats.latency[i] = latency[i].snapshot();
+  }
+  return stats;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "libav_service.h"
+
+// Histogram of nanosecond durations with log-linear buckets: each power of
+// two is split in STATS_SUB_BUCKETS, so a bucket is within 1/8 of the values
+// it holds, HDR style. record() is a few relaxed atomic adds, safe from any
+// thread; snapshots may see a record half applied.
+#define STATS_SUB_BITS    3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS     (2 * STATS_SUB_BUCKETS + (64 - STATS_SUB_BITS - 1) * STATS_SUB_BUCKETS)
+
+class LatencyHistogram {
+public:
+  void record(uint64_t ns);
+  AVLatencyStats snapshot() const;
+
+protected:
+  std::atomic<uint64_t> buckets[STATS_BUCKETS] = {};
+  std::atomic<uint64_t> count = 0;
+  std::atomic<uint64_t> totalNs = 0;
+  std::atomic<uint64_t> maxNs = 0;
+};
+
+// Process wide service metrics returned by GetStats.
+class ServiceStats {
+public:
+  static ServiceStats &get();
+
+  void record(AVStatLatency stage, uint64_t ns) { latency[(int)stage].record(ns); }
+  void add(std::atomic<uint64_t> &counter, uint64_t n = 1) { counter.fetch_add(n, std::memory_order_relaxed); }
+  void jobQueued();
+  void jobDone() { queueDepth.fetch_sub(1, std::memory_order_relaxed); }
+
+  // 'sessions' is filled in by the caller.
+  AVServiceStats snapshot() const;
+
+  std::atomic<uint64_t> commands = 0;
+  std::atomic<uint64_t> bytesIn = 0;
+  std::atomic<uint64_t> bytesOut = 0;
+  std::atomic<uint64_t> framesIn = 0;
+  std::atomic<uint64_t> framesOut = 0;
+  std::atomic<uint64_t> packetsIn = 0;
+  std::atomic<uint64_t> packetsOut = 0;
+
+protected:
+  ServiceStats() : start(std::chrono::steady_clock::now()) {}
+
+  LatencyHistogram latency[(int)AVStatLatency::Count];
+  std::atomic<int64_t> queueDepth = 0;
+  std::atomic<int64_t> maxQueueDepth = 0;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Records the lifetime of the scope into one of the service histograms.
+class StatTimer {
+public:
+  StatTimer(AVStatLatency _stage) : stage(_stage), start(std::chrono::steady_clock::now()) {}
+  ~StatTimer() {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    ServiceStats::get().record(stage, (uint64_t)ns);
+  }
+  StatTimer(StatTimer &) = delete;
+  StatTimer &operator = (StatTimer &) = delete;
+
+protected:
+  AVStatLatency stage;
+  std::chrono::steady_clock::time_point start;
+};
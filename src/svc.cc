@@ -1,75 +1,677 @@
 #include "common.h"
+#include "av-sink.h"
+#include "reactor.h"
+#include "spsc-queue.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <list>
 #include <mutex>
 #include <thread>
 
+#define SVC_MAX_PENDING_CLIENTS 64
+#define SVC_SESSION_QUEUE_DEPTH 16
+#define SVC_START_TIMEOUT_MS 10000
+#define SVC_KEEPALIVE_MS 10000
+#define SVC_POLL_MS 200
+
+// Reactor bits of the service and connection loops.
+enum : uint32_t {
+  SvcWakeCommand    = 1 << 0,
+  SvcWakeStop       = 1 << 1,
+  SvcWakeAccept     = 1 << 2,
+  SvcWakeConnection = 1 << 3,
+};
+
 static std::thread svcThread;
-static IPCPipe svcPipe;
-static bool svcExitFlag = false;
+static IPCListener svcListener;
+static std::atomic<bool> svcExitFlag = false;
+static std::atomic<bool> svcStopFlag = false;
+static std::atomic<int> svcActiveClients = 0;
+static std::mutex svcStartMutex;
+static std::condition_variable svcStartCond;
+static bool svcStarted = false, svcReady = false;
+static ReactorSignal svcStopSignal;        // raised with svcStopFlag
+static ReactorSignal svcConnectionSignal;  // a connection thread is done
+static std::set<std::string> encoders, decoders;   // the capabilities that open
+static std::vector<AVCodecCaps> capabilities;
 
-void svcWorker(const std::string &instanceId) {
+// A client connection. Replies may come from the connection thread and from
+// session codec threads, writeMutex keeps each reply and its payload together.
+struct AVClient {
+  uint32_t id = 0;
+  IPCPipe pipe;
+  std::mutex writeMutex;
+};
+typedef std::shared_ptr<AVClient> Client;
+
+// Encode/Decode/Flush request queued for a session's codec thread.
+struct AVJob {
+  AVCmd cmd;
+  bool pipelined = false;
+  bool outputsOnly = false;   // sends held back outputs, no completion reply
+  SingleArray data;
+  AVSink sink;   // SetSink, nullptr closes the current one
+};
+
+// One encoder or decoder with its pending input and output. Sessions belong
+// to the connection that opened them and are closed with it. The connection
+// thread parses requests and queues them, the session thread runs the codec;
+// packetData/frameData belong to the session thread while jobs are pending.
+struct AVSession {
+  AVSession() : jobs(SVC_SESSION_QUEUE_DEPTH) {}
+  ~AVSession() {
+    stop = true;
+    queued++;
+    queued.notify_one();
+    if (worker.joinable()) worker.join();
+  }
+
+  uint32_t handle = 0;
+  Client client;
   AVEnc enc;
-  int width, height, fps, bps;
-  std::set<std::string> encoders, decoders;
-  svcExitFlag = false;
+  int width = 0, height = 0;
+  SingleArray packetData;
+  DoubleArray frameData;
+
+  uint32_t flags = 0;
+  // muxed encoder, packetData holds AVSegmentInfo records
+  bool segmented = false;
+
+  // encoded output written in the service instead of kept for GetPacket
+  AVSink sink;
+  uint32_t sinkOutputs = 0;
+  bool sinkProgress = false;
+
+  // AVInitFlagFrameRefs decoders: frames sent to the client, kept referenced
+  // until it releases them
+  bool frameRefs = false;
+  std::mutex frameMutex;
+  std::map<uint32_t, FrameRef> heldFrames;
+  uint32_t nextFrameId = 1;
+  bool heldFull = false;   // warned about the held frames limit
+
+  SPSCQueue<AVJob> jobs;
+  std::thread worker;
+  std::atomic<bool> stop = false;
+  std::atomic<uint32_t> queued = 0;
+  std::atomic<uint64_t> submitted = 0;
+  std::atomic<uint64_t> completed = 0;
+  std::atomic<bool> lastResult = false;
+};
+typedef std::shared_ptr<AVSession> Session;
+
+static std::mutex sessionMutex;
+static std::map<uint32_t, Session> sessions;
+static uint32_t nextSessionHandle = 1;
+
+// Moves the decoder's next frame to the held frames and describes its planes.
+// Once SVC_SESSION_QUEUE_DEPTH frames are held the next ones stay in the
+// decoder until the client releases some. A frame without a plane layout is
+// dropped and flagged in 'dropped'.
+static bool holdNextFrame(AVSession *session, FramePlanes &planes, bool *dropped = nullptr) {
+  std::lock_guard<std::mutex> lock(session->frameMutex);
+  if (session->heldFrames.size() >= SVC_SESSION_QUEUE_DEPTH) {
+    if (!session->heldFull) {
+      LOG_WARNING << "[AV] Session " << session->handle << " holds " << session->heldFrames.size() <<
+                     " unreleased frames, waiting for ReleaseFrame";
+    }
+    session->heldFull = true;
+    return false;
+  }
+  session->heldFull = false;
+
+  auto frame = session->enc->popFrame();
+  if (!frame) {
+    return false;
+  }
+
+  while (!session->nextFrameId || session->heldFrames.count(session->nextFrameId)) session->nextFrameId++;
+  uint32_t frameId = session->nextFrameId++;
+  if (!getFramePlanes(frame, frameId, planes)) {
+    LOG_ERROR << "[AV] Session " << session->handle << " dropped frame pts=" << frame->pts;
+    if (dropped) *dropped = true;
+    return false;
+  }
+  session->heldFrames[frameId] = std::move(frame);
+  return true;
+}
+
+// Writes the descriptor and the planes straight from the decoder's buffers.
+static void writeFramePlanes(IPCPipe pipe, const FramePlanes &planes) {
+  IPCBuffer parts[1 + AV_FRAME_MAX_PLANES];
+  size_t count = 0;
+  parts[count++] = { &planes.desc, sizeof(planes.desc) };
+  for (int i = 0; i < planes.desc.planes; i++) {
+    parts[count++] = { planes.data[i], planes.desc.size[i] };
+  }
+  StatTimer timer(AVStatLatency::SocketWrite);
+  pipe->writePayload(parts, count);
+  ServiceStats::get().add(ServiceStats::get().bytesOut, planes.totalSize - sizeof(planes.desc));
+}
+
+// Sends an output payload, timed and counted for GetStats.
+static void writeOutput(const IPCPipe &pipe, const void *data, size_t size) {
+  StatTimer timer(AVStatLatency::SocketWrite);
+  pipe->writePayload(data, size);
+  ServiceStats::get().add(ServiceStats::get().bytesOut, size);
+}
+
+static AVSinkStatus sinkStatus(AVSession *session) {
+  auto status = session->sink->status();
+  status.outputs = session->sinkOutputs;
+  return status;
+}
+
+// Moves the job's output to the sink, flushing its batch at the stream end.
+static bool writeSink(AVSession *session, bool flush) {
+  auto &packetData = session->packetData;
+  bool ret = true;
+  if (packetData.size()) {
+    if (session->segmented) {
+      // the sink gets a playable stream, the segments back to back
+      size_t offset = 0;
+      AVSegmentInfo info;
+      const uint8_t *data;
+      while (ret && nextSegment(packetData, offset, info, &data)) {
+        ret = session->sink->write(data, info.size);
+      }
+    } else {
+      ret = session->sink->write(packetData.data(), packetData.size());
+    }
+    session->sinkOutputs++;
+    session->sinkProgress = true;
+    packetData.clear();
+  }
+  if (flush) {
+    ret = session->sink->flush() && ret;
+    session->sinkProgress = true;
+  }
+  return ret;
+}
+
+static void sendOutputs(AVSession *session, const AVCmd &cmd) {
+  auto pipe = session->client->pipe;
+  if (session->sink) {
+    // the output itself stays in the service, the client only hears progress
+    if (session->sinkProgress) {
+      auto status = sinkStatus(session);
+      sendAVCmdReply(pipe, cmd, AVCmdType::GetSinkStatus, AVCmdResult::Ack, sizeof(status), &status);
+      session->sinkProgress = false;
+    }
+  } else if (session->segmented) {
+    auto &packetData = session->packetData;
+    size_t offset = 0, start = 0;
+    AVSegmentInfo info;
+    const uint8_t *data;
+    while (nextSegment(packetData, offset, info, &data)) {
+      sendAVCmdReply(pipe, cmd, AVCmdType::GetSegment, AVCmdResult::Ack, offset - start);
+      writeOutput(pipe, packetData.data() + start, offset - start);
+      start = offset;
+    }
+    packetData.clear();
+  } else if (session->enc->isEncoder()) {
+    auto &packetData = session->packetData;
+    if (packetData.size()) {
+      sendAVCmdReply(pipe, cmd, AVCmdType::GetPacket, AVCmdResult::Ack, packetData.size());
+      writeOutput(pipe, packetData.data(), packetData.size());
+      packetData.clear();
+    }
+  } else if (session->frameRefs) {
+    FramePlanes planes;
+    bool dropped = false;
+    while (1) {
+      if (holdNextFrame(session, planes, &dropped)) {
+        sendAVCmdReply(pipe, cmd, AVCmdType::GetFrame, AVCmdResult::Ack, planes.totalSize);
+        writeFramePlanes(pipe, planes);
+      } else if (dropped) {
+        // tells the client of the frame it will not get, the next may do
+        sendAVCmdReply(pipe, cmd, AVCmdType::GetFrame, AVCmdResult::Nack);
+        dropped = false;
+      } else {
+        break;
+      }
+    }
+  } else {
+    auto &frameData = session->frameData;
+    for (auto &f : frameData) {
+      sendAVCmdReply(pipe, cmd, AVCmdType::GetFrame, AVCmdResult::Ack, f.size());
+      writeOutput(pipe, f.data(), f.size());
+    }
+    frameData.clear();
+  }
+}
+
+static bool runJob(AVSession *session, AVJob &job) {
+  if (job.outputsOnly) {
+    std::lock_guard<std::mutex> lock(session->client->writeMutex);
+    sendOutputs(session, job.cmd);
+    return session->lastResult;
+  }
+
+  auto &enc = session->enc;
+  bool ret = false;
+  switch (job.cmd.type) {
+    case AVCmdType::Encode: {
+      if (!job.pipelined) session->packetData.clear();
+      if (session->flags & AVInitFlagClientPts) enc->setNextPts(job.cmd.payload.pts);
+      session->frameData.push_back(std::move(job.data));
+      ret = enc->process(&session->frameData, &session->packetData);
+      break;
+    }
+    case AVCmdType::Decode: {
+      if (session->flags & AVInitFlagClientPts) enc->setNextPts(job.cmd.payload.pts);
+      if (enc->isTranscoder()) {
+        if (!job.pipelined) session->packetData.clear();
+        ret = enc->transcode(job.data, &session->packetData);
+        break;
+      }
+      session->packetData = std::move(job.data);
+      ret = enc->process(&session->frameData, &session->packetData);
+      // hands a shared memory slot back right away
+      session->packetData.release();
+      break;
+    }
+    case AVCmdType::Flush: {
+      if (enc->isEncoder()) ret = enc->process(nullptr, &session->packetData);
+      else ret = enc->process(&session->frameData, nullptr);
+      break;
+    }
+    case AVCmdType::SetBitrate: {
+      auto &rate = job.cmd.rate;
+      ret = enc->setBitrate(rate.bps, rate.maxrate, rate.bufsize, &session->packetData);
+      break;
+    }
+    case AVCmdType::ForceKeyframe: {
+      ret = enc->forceKeyframe();
+      break;
+    }
+    case AVCmdType::SetResolution: {
+      ret = enc->setResolution(job.cmd.init.width, job.cmd.init.height, &session->packetData);
+      if (ret) {
+        session->width = job.cmd.init.width;
+        session->height = job.cmd.init.height;
+      }
+      break;
+    }
+    case AVCmdType::SetSink: {
+      // a replaced sink writes out its batch when released
+      session->sink = std::move(job.sink);
+      session->sinkOutputs = 0;
+      session->sinkProgress = false;
+      ret = true;
+      break;
+    }
+    default: break;
+  }
+  if (session->sink && job.cmd.type != AVCmdType::SetSink) {
+    ret = writeSink(session, job.cmd.type == AVCmdType::Flush) && ret;
+  }
+  LOG_DEBUG << "[AV]    process result " << ret;
+
+  // pipelined outputs go out as soon as they are produced
+  if (job.pipelined) {
+    std::lock_guard<std::mutex> lock(session->client->writeMutex);
+    sendOutputs(session, job.cmd);
+    sendAVCmdReply(session->client->pipe, job.cmd, job.cmd.type, ret ? AVCmdResult::Ack : AVCmdResult::Nack);
+  }
+  return ret;
+}
+
+static void sessionWorker(AVSession *session) {
+  AVJob job;
+  while (1) {
+    auto signal = session->queued.load();
+    if (session->stop) {
+      break;
+    }
+    if (!session->jobs.pop(job)) {
+      session->queued.wait(signal);
+      continue;
+    }
+
+    session->lastResult = runJob(session, job);
+    job.data.release();
+    ServiceStats::get().jobDone();
+    session->completed++;
+    session->completed.notify_all();
+  }
+
+  // jobs left behind by a closed session never ran
+  while (session->jobs.pop(job)) ServiceStats::get().jobDone();
+}
+
+// Pipelined clients keep writing while a job waits for a queue slot, they
+// get a Nack instead ('block' false), lock-step clients wait for the slot.
+static bool submitJob(const Session &session, AVJob &&job, bool block = true) {
+  while (1) {
+    auto done = session->completed.load();
+    if (session->jobs.push(std::move(job))) {
+      break;
+    }
+    if (!block) {
+      if (!job.outputsOnly) {
+        LOG_WARNING << "[AV] Session " << session->handle << " queue full, request " << job.cmd.requestId <<
+                       " refused";
+      }
+      return false;
+    }
+    // queue full, wait for the codec thread to finish a job
+    session->completed.wait(done);
+  }
+  ServiceStats::get().jobQueued();
+  session->submitted++;
+  session->queued++;
+  session->queued.notify_one();
+  return true;
+}
 
-  // init service
+static void waitIdle(const Session &session) {
+  while (1) {
+    auto done = session->completed.load();
+    if (done == session->submitted) {
+      break;
+    }
+    session->completed.wait(done);
+  }
+}
+
+static Session addSession(const Client &client, AVEnc enc) {
+  auto session = std::make_shared<AVSession>();
+  session->client = client;
+  session->enc = enc;
+  session->worker = std::thread(sessionWorker, session.get());
+
+  std::lock_guard<std::mutex> lock(sessionMutex);
+  while (!nextSessionHandle || sessions.count(nextSessionHandle)) nextSessionHandle++;
+  session->handle = nextSessionHandle++;
+  sessions[session->handle] = session;
+  return session;
+}
+
+static Session findSession(const Client &client, uint32_t handle) {
+  std::lock_guard<std::mutex> lock(sessionMutex);
+  auto it = sessions.find(handle);
+  if (it == sessions.end() || it->second->client != client) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+static void removeSessions(const Client &client, uint32_t handle = 0) {
+  // codec threads are joined outside the lock
+  std::vector<Session> removed;
   {
-    LOG_INFO << "[AV] Starting libav-node service, session id \"" << instanceId << '"';
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      if (it->second->client == client && (!handle || it->first == handle)) {
+        removed.push_back(it->second);
+        it = sessions.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+}
 
-    svcPipe = IIPCPipe::create(instanceId, PIPE_BUFFER_SIZE);
-    if (!svcPipe) {
-      LOG_ERROR << "[AV] Failed to create pipe";
-      svcExitFlag = true;
-      return;
+static void wakeListener() {
+#ifdef _WIN32
+  // ConnectNamedPipe does not time out, close() unblocks it
+  svcListener->close();
+#endif
+}
+
+static void skipPayload(IPCPipe pipe, size_t size) {
+  SingleArray tmp(size);
+  if (size) pipe->readPayload(tmp.data(), size);
+}
+
+// Reads the AVInitExt block following an Open command.
+static bool readInitExt(IPCPipe pipe, const AVCmd &cmd, AVEncodeParams &params) {
+  size_t size = cmd.init.extSize;
+  if (!size) {
+    return true;
+  }
+
+  SingleArray ext(std::min(size, (size_t)AV_INIT_EXT_MAX_SIZE));
+  size_t remaining = size;
+  while (remaining) {
+    // oversized blocks are drained to keep the stream in sync
+    size_t chunk = std::min(remaining, ext.size());
+    if (pipe->read(ext.data(), chunk, 5000) != chunk) {
+      return false;
     }
+    remaining -= chunk;
+  }
+  if (size > AV_INIT_EXT_MAX_SIZE) {
+    LOG_ERROR << "[AV] Init block too large: " << size;
+    return false;
+  }
+  return parseInitExt(ext.data(), size, params);
+}
 
-    encoders = IAVEnc::getEncoders();
-    decoders = IAVEnc::getDecoders();
+// Reads the AVSinkInfo, path and descriptor of a SetSink command. The
+// descriptor is taken even if the sink is refused, to keep the stream in sync.
+static bool readSinkCmd(IPCPipe pipe, const AVCmd &cmd, AVSinkInfo &info, std::string &path, int &fd) {
+  fd = -1;
+  if (cmd.size < sizeof(info) || cmd.size > sizeof(info) + AV_INIT_EXT_MAX_SIZE) {
+    skipPayload(pipe, cmd.size);
+    return false;
+  }
 
-    if (encoders.empty() && decoders.empty()) {
-      LOG_ERROR << "[AV] No encoders and decoders available";
-      svcExitFlag = true;
-      return;
+  SingleArray data(cmd.size);
+  if (pipe->readPayload(data.data(), cmd.size, 5000) != cmd.size) {
+    return false;
+  }
+  memcpy(&info, data.data(), sizeof(info));
+  path.assign((const char *)data.data() + sizeof(info), cmd.size - sizeof(info));
+  if (info.type == AVSinkType::Fd) {
+    fd = pipe->receiveFd(5000);
+    return fd >= 0;
+  }
+  return true;
+}
+
+// The coder named exactly, otherwise every coder containing the name.
+static std::vector<std::string> matchCoders(const std::set<std::string> &coderNames, const std::string &codecName) {
+  if (coderNames.count(codecName)) {
+    return { codecName };
+  }
+
+  std::vector<std::string> matches;
+  for (auto &c : coderNames) {
+    if (c.find(codecName) != std::string::npos) {
+      matches.push_back(c);
+      LOG_INFO << "match: " << c;
     }
   }
+  return matches;
+}
 
-  LOG_INFO << "Available encoders:";
-  for (auto &e : encoders) LOG_INFO << "  Name: " << e;
+// What OpenEncoder builds, the AVInitExt extensions exclude each other.
+enum class EncoderKind {
+  Plain,
+  Muxer,     // container
+  Ladder,    // renditions
+  Chunked,   // chunkFrames
+  Invalid,
+};
 
-  LOG_INFO << "Available decoders:";
-  for (auto &d : decoders) LOG_INFO << "  Name: " << d;
+static EncoderKind encoderKind(const AVEncodeParams &params) {
+  bool muxed = params.container != AVContainer::None;
+  bool ladder = !params.renditions.empty();
+  bool chunked = params.chunkFrames > 0;
+  if (muxed + ladder + chunked > 1) return EncoderKind::Invalid;
+  if (muxed) return EncoderKind::Muxer;
+  if (ladder) return EncoderKind::Ladder;
+  if (chunked) return EncoderKind::Chunked;
+  return EncoderKind::Plain;
+}
 
-  SingleArray packetData;
-  DoubleArray frameData;
+static AVEnc openEncoder(EncoderKind kind, const std::string &name, const AVInitInfo &init,
+                         const AVEncodeParams &params) {
+  switch (kind) {
+    case EncoderKind::Muxer:
+      return IAVEnc::createMuxer(name, init.width, init.height, init.fps, init.bps, init.flags, init.format, params);
+    case EncoderKind::Ladder:
+      return IAVEnc::createLadder(name, init.width, init.height, init.fps, init.flags, init.format, params);
+    case EncoderKind::Chunked:
+      return IAVEnc::createChunked(name, init.width, init.height, init.fps, init.bps, init.flags, init.format, params);
+    case EncoderKind::Plain:
+      return IAVEnc::createEncoder(name, init.width, init.height, init.fps, init.bps, init.flags, init.format, params);
+    default:
+      return nullptr;
+  }
+}
+
+static AVEnc openCoder(const AVCmd &cmd, const AVEncodeParams &params) {
+  AVEnc enc;
+  auto &init = cmd.init;
+  std::string codecName = init.codecName;
+
+  if (cmd.type == AVCmdType::OpenEncoder) {
+    auto kind = encoderKind(params);
+    if (kind == EncoderKind::Invalid) {
+      LOG_ERROR << "[AV] container, renditions and chunkFrames cannot be combined";
+      return nullptr;
+    }
+    for (auto &name : matchCoders(encoders, codecName)) {
+      LOG_INFO << "match test: " << name;
+      enc = openEncoder(kind, name, init, params);
+      if (enc) break;
+    }
+    return enc;
+  }
+
+  if (cmd.type == AVCmdType::OpenTranscoder) {
+    auto sources = matchCoders(decoders, params.sourceCodec);
+    for (auto &name : matchCoders(encoders, codecName)) {
+      LOG_INFO << "match test: " << name;
+      for (auto &source : sources) {
+        enc = IAVEnc::createTranscoder(source, name, init.width, init.height, init.fps, init.bps, init.flags, params);
+        if (enc) return enc;
+      }
+    }
+    return enc;
+  }
+
+  // the file's video stream picks the decoder unless the client names one
+  if (init.flags & AVInitFlagFileInput) {
+    if (codecName.empty()) {
+      return IAVEnc::createFileDecoder("", init.flags, init.format, params);
+    }
+    for (auto &name : matchCoders(decoders, codecName)) {
+      enc = IAVEnc::createFileDecoder(name, init.flags, init.format, params);
+      if (enc) break;
+    }
+    return enc;
+  }
+
+  for (auto &name : matchCoders(decoders, codecName)) {
+    LOG_INFO << "match test: " << name;
+    enc = IAVEnc::createDecoder(name, init.width, init.height, init.flags, init.format, params);
+    if (enc) break;
+  }
+  return enc;
+}
+
+static const char *coderKind(AVCmdType type) {
+  switch (type) {
+    case AVCmdType::OpenDecoder: return "decoder";
+    case AVCmdType::OpenTranscoder: return "transcoder";
+    default: return "encoder";
+  }
+}
+
+// Encode takes raw frames, Decode compressed packets.
+static bool acceptsInput(const AVEnc &enc, AVCmdType type) {
+  if (type == AVCmdType::Encode) return enc->isEncoder() && !enc->isTranscoder();
+  return !enc->isEncoder() || enc->isTranscoder();
+}
+
+void connectionWorker(IPCPipe pipe, uint32_t connection) {
+  AVCmd cmd;
+  Session session;
+  uint32_t lastSession = 0;
+  uint32_t pipelineWindow = 0;
+  uint32_t expectedSeq = 0;
+
+  auto client = std::make_shared<AVClient>();
+  client->id = connection;
+  client->pipe = pipe;
+
+  LOG_INFO << "[AV] Client " << connection << " connected";
+
+  // lock-step replies until SetPipeline enables tagged replies, 'data' is
+  // written right after the reply header
+  auto reply = [&](AVCmdResult res, size_t size = 0, const void *data = nullptr) {
+    std::lock_guard<std::mutex> lock(client->writeMutex);
+    if (pipelineWindow) sendAVCmdReply(pipe, cmd, cmd.type, res, size, data);
+    else sendAVCmdResult(pipe, res, size, data);
+  };
+
+  auto replyPayload = [&](const SingleArray &data) {
+    std::lock_guard<std::mutex> lock(client->writeMutex);
+    if (pipelineWindow) sendAVCmdReply(pipe, cmd, cmd.type, AVCmdResult::Ack, data.size());
+    else sendAVCmdResult(pipe, AVCmdResult::Ack, data.size());
+    writeOutput(pipe, data.data(), data.size());
+  };
+
+  // sleep until a command, a stop or the keep-alive deadline arrives, pipes
+  // without a descriptor keep polling
+  Reactor reactor;
+  bool evented = reactor.isValid() && reactor.add(pipe->handle(), SvcWakeCommand) &&
+                 reactor.add(svcStopSignal.handle(), SvcWakeStop) && reactor.setDeadline(SVC_KEEPALIVE_MS);
 
   auto lastKeepAlive = std::chrono::system_clock::now();
-  bool stopService = false;
-  while (1) {
-    auto keepAliveDur = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - lastKeepAlive);
-    if (keepAliveDur.count() > 10) {
+  while (!svcStopFlag) {
+    auto keepAliveMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - lastKeepAlive).count();
+    if (keepAliveMs > SVC_KEEPALIVE_MS) {
       LOG_INFO << "[AV] Keep alive exit";
       break;
     }
 
-    AVCmd cmd;
-    if (!svcPipe->isOpen()) {
+    if (!pipe->isOpen()) {
       break;
     }
-    if (!readAVCmd(svcPipe, &cmd, 200)) {
+    if (evented) {
+      auto ready = reactor.wait();
+      if (ready & Reactor::Deadline) {
+        // commands move the deadline without touching the timer, re-arm it
+        // for what is left when it fires early
+        auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - lastKeepAlive).count();
+        reactor.setDeadline((int)std::max<int64_t>(SVC_KEEPALIVE_MS - elapsedMs, 0) + 1);
+      }
+      if (!(ready & SvcWakeCommand)) {
+        continue;
+      }
+    }
+    if (!readAVCmd(pipe, &cmd, SVC_POLL_MS)) {
       continue;
     }
     lastKeepAlive = std::chrono::system_clock::now();
+    ServiceStats::get().add(ServiceStats::get().commands);
+
+    if (pipelineWindow) {
+      if (cmd.seq != expectedSeq) {
+        LOG_ERROR << "[AV] Request " << cmd.requestId << " out of sequence: " << cmd.seq << " != " << expectedSeq;
+      }
+      expectedSeq = cmd.seq + 1;
+    }
+
+    session = findSession(client, (cmd.session) ? cmd.session : lastSession);
+    auto enc = (session) ? session->enc : nullptr;
 
     switch (cmd.type) {
       case AVCmdType::KeepAlive: {
         LOG_DEBUG << "[AV] KeepAlive CMD";
-        sendAVCmdResult(svcPipe, AVCmdResult::Ack);
+        reply(AVCmdResult::Ack);
         break;
       }
       case AVCmdType::GetEncoderCount: {
         LOG_INFO << "[AV] GetEncoderCount CMD: " << encoders.size();
-        sendAVCmdResult(svcPipe, AVCmdResult::Ack, encoders.size());
+        reply(AVCmdResult::Ack, encoders.size());
         break;
       }
       case AVCmdType::GetEncoderName: {
@@ -77,16 +679,15 @@ void svcWorker(const std::string &instanceId) {
         auto it = encoders.begin();
         for (size_t i = 0; it != encoders.end() && i < cmd.size; i++) it++;
         if (it != encoders.end()) {
-          sendAVCmdResult(svcPipe, AVCmdResult::Ack, it->length());
-          svcPipe->write(it->c_str(), it->length());
+          reply(AVCmdResult::Ack, it->length(), it->c_str());
         } else {
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
+          reply(AVCmdResult::Nack);
         }
         break;
       }
       case AVCmdType::GetDecoderCount: {
         LOG_INFO << "[AV] GetDecoderCount CMD: " << decoders.size();
-        sendAVCmdResult(svcPipe, AVCmdResult::Ack, decoders.size());
+        reply(AVCmdResult::Ack, decoders.size());
         break;
       }
       case AVCmdType::GetDecoderName: {
@@ -94,171 +695,444 @@ void svcWorker(const std::string &instanceId) {
         auto it = decoders.begin();
         for (size_t i = 0; it != decoders.end() && i < cmd.size; i++) it++;
         if (it != decoders.end()) {
-          sendAVCmdResult(svcPipe, AVCmdResult::Ack, it->length());
-          svcPipe->write(it->c_str(), it->length());
+          reply(AVCmdResult::Ack, it->length(), it->c_str());
         } else {
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
+          reply(AVCmdResult::Nack);
         }
         break;
       }
-      case AVCmdType::OpenEncoder:
-      case AVCmdType::OpenDecoder: {
-        std::string codecName = cmd.init.codecName;
-
-        std::set<std::string> *coderNames;
-        if (cmd.type == AVCmdType::OpenDecoder) coderNames = &decoders;
-        else coderNames = &encoders;
-
-        bool exactMatch = false;
-        std::vector<std::string> matches;
-        for (auto &c : *coderNames) {
-          if (c == codecName) { exactMatch = true; break; }
-          if (c.find(codecName) != std::string::npos) {
-            matches.push_back(c);
-            LOG_INFO << "match: " << c;
-          }
+      case AVCmdType::GetStats: {
+        LOG_DEBUG << "[AV] GetStats CMD";
+        auto stats = ServiceStats::get().snapshot();
+        {
+          std::lock_guard<std::mutex> lock(sessionMutex);
+          stats.sessions = (uint32_t)sessions.size();
         }
-
-        if (!exactMatch) {
-           for (auto &name : matches) {
-            LOG_INFO << "match test: " << name;
-            if (cmd.type == AVCmdType::OpenDecoder) enc = IAVEnc::createDecoder(name, cmd.init.width, cmd.init.height);
-            else enc = IAVEnc::createEncoder(name, cmd.init.width, cmd.init.height, cmd.init.fps, cmd.init.bps);
-            if (enc) break;
-          }
-        } else {
-          if (cmd.type == AVCmdType::OpenDecoder) enc = IAVEnc::createDecoder(codecName, cmd.init.width, cmd.init.height);
-          else enc = IAVEnc::createEncoder(codecName, cmd.init.width, cmd.init.height, cmd.init.fps, cmd.init.bps);
+        reply(AVCmdResult::Ack, sizeof(stats), &stats);
+        break;
+      }
+      case AVCmdType::GetCapabilities: {
+        LOG_INFO << "[AV] GetCapabilities CMD: " << capabilities.size();
+        reply(AVCmdResult::Ack, capabilities.size() * sizeof(AVCodecCaps), capabilities.data());
+        break;
+      }
+      case AVCmdType::OpenEncoder:
+      case AVCmdType::OpenDecoder:
+      case AVCmdType::OpenTranscoder: {
+        AVEncodeParams params;
+        if (!readInitExt(pipe, cmd, params)) {
+          reply(AVCmdResult::Nack);
+          break;
         }
 
+        enc = openCoder(cmd, params);
         if (enc) {
-          width = cmd.init.width;
-          height = cmd.init.height;
-          sendAVCmdResult(svcPipe, AVCmdResult::Ack);
-          LOG_INFO << "[AV] " << ((cmd.type == AVCmdType::OpenDecoder) ? "Decoder" : "Encoder") << " " <<
-                      "created: name=" << codecName << " " << cmd.init.width << "x" << cmd.init.height << " " <<
+          session = addSession(client, enc);
+          session->width = cmd.init.width;
+          session->height = cmd.init.height;
+          session->flags = cmd.init.flags;
+          session->frameRefs = cmd.type == AVCmdType::OpenDecoder && (cmd.init.flags & AVInitFlagFrameRefs);
+          session->segmented = cmd.type == AVCmdType::OpenEncoder && params.container != AVContainer::None;
+          lastSession = session->handle;
+          reply(AVCmdResult::Ack, session->handle);
+          LOG_INFO << "[AV] " << coderKind(cmd.type) << " " <<
+                      "created: session=" << session->handle << " name=" << enc->getName() << " " <<
+                      cmd.init.width << "x" << cmd.init.height << " " <<
                       "fps = " << cmd.init.fps << " bps=" << cmd.init.bps;
         } else {
-          width = height = 0;
-          packetData.clear(); packetData.shrink_to_fit();
-          frameData.clear(); frameData.shrink_to_fit();
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
-          LOG_INFO << "[AV] Failed to create " << ((cmd.type == AVCmdType::OpenDecoder) ? "decoder" : "encoder");
+          reply(AVCmdResult::Nack);
+          LOG_INFO << "[AV] Failed to create " << coderKind(cmd.type) << " " << cmd.init.codecName;
         }
         break;
       }
       case AVCmdType::Close: {
-        enc = nullptr;
-        width = height = 0;
-        packetData.clear(); packetData.shrink_to_fit();
-        frameData.clear(); frameData.shrink_to_fit();
-        LOG_INFO << "[AV] Closing encoder/decoder";
-        sendAVCmdResult(svcPipe, AVCmdResult::Ack);
-        break;
-      }
-      case AVCmdType::Encode: {
-        LOG_DEBUG << "[AV] Encode CMD: ";
-        if (!enc || !enc->isEncoder()) {
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
-          LOG_ERROR << "[AV]    no encoder opened";
-          break;
-        } else sendAVCmdResult(svcPipe, AVCmdResult::Ack);
-
-        frameData.push_back(SingleArray());
-        frameData.back().resize(cmd.size);
-        packetData.clear();
-        if (svcPipe->read(frameData.back().data(), cmd.size) != cmd.size) {
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
-          LOG_ERROR << "[AV]    failed to read data";
-          break;
+        if (session) {
+          LOG_INFO << "[AV] Closing encoder/decoder, session " << session->handle;
+          // pipelined requests still queued get their replies before it goes
+          waitIdle(session);
+          removeSessions(client, session->handle);
+          if (lastSession == session->handle) lastSession = 0;
+          session = nullptr;
         }
-
-        bool ret = enc->process(&frameData, &packetData);
-        LOG_DEBUG << "[AV]    process result " << ret;
-        if (ret) sendAVCmdResult(svcPipe, AVCmdResult::Ack);
-        else sendAVCmdResult(svcPipe, AVCmdResult::Nack);
+        reply(AVCmdResult::Ack);
         break;
       }
+      case AVCmdType::Encode:
       case AVCmdType::Decode: {
-        LOG_DEBUG << "[AV] Decode CMD: ";
-        if (!enc || enc->isEncoder()) {
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
-          LOG_ERROR << "[AV]    no decoder opened";
+        bool isEncode = cmd.type == AVCmdType::Encode;
+        LOG_DEBUG << "[AV] " << (isEncode ? "Encode" : "Decode") << " CMD: ";
+        if (!enc || !acceptsInput(enc, cmd.type)) {
+          // pipelined payloads follow the command without waiting for an ack
+          if (pipelineWindow) skipPayload(pipe, cmd.size);
+          reply(AVCmdResult::Nack);
+          LOG_ERROR << "[AV]    no " << (isEncode ? "encoder" : "decoder") << " opened";
           break;
-        } else sendAVCmdResult(svcPipe, AVCmdResult::Ack);
+        } else if (!pipelineWindow) reply(AVCmdResult::Ack);
 
-        packetData.resize(cmd.size);
-        if (svcPipe->read(packetData.data(), cmd.size) != cmd.size) {
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
-          LOG_ERROR << "[AV]    failed to read data";
-          break;
+        AVJob job;
+        job.cmd = cmd;
+        job.pipelined = pipelineWindow != 0;
+        // framed decoders and wrapped encoder frames hand the payload straight
+        // to libavcodec, which reads past the end of its buffers. Shared
+        // memory payloads stay in their slot until the codec is done with them.
+        {
+          StatTimer timer(AVStatLatency::SocketRead);
+          if (!pipe->takePayload(job.data, cmd.size, AV_PACKET_PADDING)) {
+            reply(AVCmdResult::Nack);
+            LOG_ERROR << "[AV]    failed to read data";
+            break;
+          }
         }
+        ServiceStats::get().add(ServiceStats::get().bytesIn, cmd.size);
 
-        bool ret = enc->process(&frameData, &packetData);
-        LOG_DEBUG << "[AV]    process result " << ret;
-        if (ret) sendAVCmdResult(svcPipe, AVCmdResult::Ack);
-        else sendAVCmdResult(svcPipe, AVCmdResult::Nack);
+        if (!submitJob(session, std::move(job), !pipelineWindow)) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+        if (!pipelineWindow) {
+          waitIdle(session);
+          reply(session->lastResult ? AVCmdResult::Ack : AVCmdResult::Nack);
+        }
         break;
       }
       case AVCmdType::GetPacket: {
+        if (!session) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+
+        waitIdle(session);
+        auto &packetData = session->packetData;
         LOG_DEBUG << "[AV] GetPacket CMD: size = " << packetData.size();
 
         if (packetData.size()) {
-          sendAVCmdResult(svcPipe, AVCmdResult::Ack, packetData.size());
-          svcPipe->write(packetData.data(), packetData.size());
+          replyPayload(packetData);
           packetData.clear();
         } else {
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
+          reply(AVCmdResult::Nack);
+        }
+        break;
+      }
+      case AVCmdType::GetSegment: {
+        if (!session || !session->segmented) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+
+        waitIdle(session);
+        auto &packetData = session->packetData;
+        size_t size = 0;
+        AVSegmentInfo info;
+        const uint8_t *data;
+        if (!nextSegment(packetData, size, info, &data)) {
+          reply(AVCmdResult::Nack);
+          break;
         }
+        LOG_DEBUG << "[AV] GetSegment CMD: sequence = " << info.sequence << " size = " << info.size;
+
+        {
+          std::lock_guard<std::mutex> lock(client->writeMutex);
+          if (pipelineWindow) sendAVCmdReply(pipe, cmd, cmd.type, AVCmdResult::Ack, size);
+          else sendAVCmdResult(pipe, AVCmdResult::Ack, size);
+          writeOutput(pipe, packetData.data(), size);
+        }
+        memmove(packetData.data(), packetData.data() + size, packetData.size() - size);
+        packetData.resize(packetData.size() - size);
         break;
       }
       case AVCmdType::GetFrame: {
         LOG_DEBUG << "[AV] GetFrame CMD";
+        if (!session || session->enc->isEncoder()) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+
+        waitIdle(session);
+        if (session->frameRefs) {
+          FramePlanes planes;
+          if (holdNextFrame(session.get(), planes)) {
+            std::lock_guard<std::mutex> lock(client->writeMutex);
+            if (pipelineWindow) sendAVCmdReply(pipe, cmd, cmd.type, AVCmdResult::Ack, planes.totalSize);
+            else sendAVCmdResult(pipe, AVCmdResult::Ack, planes.totalSize);
+            writeFramePlanes(pipe, planes);
+          } else {
+            reply(AVCmdResult::Nack);
+          }
+          break;
+        }
+
+        auto &frameData = session->frameData;
         for (auto &f : frameData) {
           LOG_DEBUG << "[AV]    frame size " << f.size();
         }
 
         if (frameData.size()) {
-          auto &data = frameData.front();
-          sendAVCmdResult(svcPipe, AVCmdResult::Ack, data.size());
-          svcPipe->write(data.data(), data.size());
+          replyPayload(frameData.front());
           frameData.erase(frameData.begin());
         } else {
-          sendAVCmdResult(svcPipe, AVCmdResult::Nack);
+          reply(AVCmdResult::Nack);
+        }
+        break;
+      }
+      case AVCmdType::ReleaseFrame: {
+        LOG_DEBUG << "[AV] ReleaseFrame CMD: " << cmd.size;
+        size_t released = 0;
+        bool resume = false;
+        if (session) {
+          std::lock_guard<std::mutex> lock(session->frameMutex);
+          released = session->heldFrames.erase((uint32_t)cmd.size);
+          resume = released && session->heldFull;
+        }
+        reply(released ? AVCmdResult::Ack : AVCmdResult::Nack);
+
+        // pipelined frames stopped at the held frames limit go out again, a
+        // full queue has jobs pending that will send them
+        if (resume && pipelineWindow) {
+          AVJob job;
+          job.cmd = cmd;
+          job.pipelined = true;
+          job.outputsOnly = true;
+          submitJob(session, std::move(job), false);
+        }
+        break;
+      }
+      case AVCmdType::SetBitrate:
+      case AVCmdType::ForceKeyframe:
+      case AVCmdType::SetResolution: {
+        LOG_INFO << "[AV] Reconfigure CMD " << (int)cmd.type;
+        if (!enc || !enc->isEncoder()) {
+          reply(AVCmdResult::Nack);
+          LOG_ERROR << "[AV]    no encoder opened";
+          break;
+        }
+
+        // queued behind pending frames, so it applies from the next frame on
+        AVJob job;
+        job.cmd = cmd;
+        job.pipelined = pipelineWindow != 0;
+        if (!submitJob(session, std::move(job), !pipelineWindow)) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+        if (!pipelineWindow) {
+          waitIdle(session);
+          reply(session->lastResult ? AVCmdResult::Ack : AVCmdResult::Nack);
         }
         break;
       }
       case AVCmdType::Flush: {
         LOG_DEBUG << "[AV] Flush CMD";
-        bool ret = false;
-        if (enc->isEncoder()) ret = enc->process(nullptr, &packetData);
-        else ret = enc->process(&frameData, nullptr);
-        if (ret) sendAVCmdResult(svcPipe, AVCmdResult::Ack);
-        else sendAVCmdResult(svcPipe, AVCmdResult::Nack);
+        if (!enc) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+
+        AVJob job;
+        job.cmd = cmd;
+        job.pipelined = pipelineWindow != 0;
+        if (!submitJob(session, std::move(job), !pipelineWindow)) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+        if (!pipelineWindow) {
+          waitIdle(session);
+          reply(session->lastResult ? AVCmdResult::Ack : AVCmdResult::Nack);
+        }
+        break;
+      }
+
+      case AVCmdType::SetSink: {
+        AVSinkInfo info;
+        std::string path;
+        int fd = -1;
+        bool valid = readSinkCmd(pipe, cmd, info, path, fd);
+        LOG_INFO << "[AV] SetSink CMD: type = " << (int)info.type << " " << path;
+
+        AVJob job;
+        if (valid && enc && enc->isEncoder() && info.type != AVSinkType::None) {
+          job.sink = IAVSink::open(info, path, fd);
+          fd = -1;
+          valid = job.sink != nullptr;
+        }
+#ifndef _WIN32
+        if (fd >= 0) ::close(fd);
+#endif
+        if (!valid || !enc || !enc->isEncoder()) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+
+        // queued, so frames submitted before still go to GetPacket
+        job.cmd = cmd;
+        job.pipelined = pipelineWindow != 0;
+        if (!submitJob(session, std::move(job), !pipelineWindow)) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+        if (!pipelineWindow) {
+          waitIdle(session);
+          reply(session->lastResult ? AVCmdResult::Ack : AVCmdResult::Nack);
+        }
+        break;
+      }
+      case AVCmdType::GetSinkStatus: {
+        LOG_DEBUG << "[AV] GetSinkStatus CMD";
+        if (session) waitIdle(session);
+        if (!session || !session->sink) {
+          reply(AVCmdResult::Nack);
+          break;
+        }
+
+        auto status = sinkStatus(session.get());
+        reply(AVCmdResult::Ack, sizeof(status), &status);
+        break;
+      }
+
+      case AVCmdType::SetPipeline: {
+        // more requests in flight than a session queue holds would fill it
+        // while the client, still writing, reads no replies
+        auto window = std::min<size_t>(cmd.size, SVC_SESSION_QUEUE_DEPTH);
+        LOG_INFO << "[AV] SetPipeline CMD: window = " << cmd.size << ", accepted " << window;
+        // the reply still uses the mode the request was sent in
+        reply(AVCmdResult::Ack, window);
+        pipelineWindow = (uint32_t)window;
+        expectedSeq = 0;
         break;
       }
 
       case AVCmdType::StopService: {
-        stopService = true;
-        enc = nullptr;
+        svcStopFlag = true;
+        svcStopSignal.set();
         LOG_INFO << "[AV] Stopping service";
-        sendAVCmdResult(svcPipe, AVCmdResult::Ack);
+        reply(AVCmdResult::Ack);
+        wakeListener();
         break;
       }
       default: {
-        sendAVCmdResult(svcPipe, AVCmdResult::Nack);
+        reply(AVCmdResult::Nack);
         break;
       }
     }
+  }
+
+  session = nullptr;
+  removeSessions(client);
+  LOG_INFO << "[AV] Client " << connection << " disconnected";
+  if (--svcActiveClients == 0) wakeListener();
+}
+
+// Wakes startService once the service accepts clients or has given up.
+static void notifyStarted(bool ready) {
+  {
+    std::lock_guard<std::mutex> lock(svcStartMutex);
+    svcStarted = true;
+    svcReady = ready;
+    if (!ready) svcExitFlag = true;
+  }
+  svcStartCond.notify_all();
+}
+
+void svcWorker(const std::string &instanceId) {
+  svcExitFlag = false;
+  svcStopFlag = false;
+  svcStopSignal.clear();
+  svcConnectionSignal.clear();
+
+  // init service; the codecs are probed before the pipe exists, so a client
+  // that manages to connect knows the service is ready
+  {
+    LOG_INFO << "[AV] Starting libav-node service, session id \"" << instanceId << '"';
+
+    capabilities = IAVEnc::getCapabilities(refreshCapabilities);
+    encoders.clear();
+    decoders.clear();
+    for (auto &c : capabilities) {
+      if (!(c.flags & AVCapsFlagOpens)) continue;
+      if (c.flags & AVCapsFlagEncoder) encoders.insert(c.name);
+      else decoders.insert(c.name);
+    }
+
+    if (encoders.empty() && decoders.empty()) {
+      LOG_ERROR << "[AV] No encoders and decoders available";
+      notifyStarted(false);
+      return;
+    }
+
+    if (useSharedMemory) svcListener = IIPCListener::createShared(instanceId, PIPE_BUFFER_SIZE, SVC_MAX_PENDING_CLIENTS,
+                                                                  SHM_SLOT_COUNT, SHM_SLOT_SIZE);
+    else svcListener = IIPCListener::create(instanceId, PIPE_BUFFER_SIZE, SVC_MAX_PENDING_CLIENTS);
+    if (!svcListener) {
+      LOG_ERROR << "[AV] Failed to create pipe";
+      notifyStarted(false);
+      return;
+    }
+  }
+  notifyStarted(true);
+
+  LOG_INFO << "Available encoders:";
+  for (auto &e : encoders) LOG_INFO << "  Name: " << e;
+
+  LOG_INFO << "Available decoders:";
+  for (auto &d : decoders) LOG_INFO << "  Name: " << d;
+
+  struct Connection {
+    std::thread thread;
+    std::atomic<bool> done = false;
+  };
+  std::list<Connection> connections;
+  uint32_t connectionCount = 0;
+
+  Reactor reactor;
+  bool evented = reactor.isValid() && reactor.add(svcListener->handle(), SvcWakeAccept) &&
+                 reactor.add(svcConnectionSignal.handle(), SvcWakeConnection) &&
+                 reactor.add(svcStopSignal.handle(), SvcWakeStop);
+
+  // the service lives until stopped or until its last client disconnects
+  while (!svcStopFlag) {
+    IPCPipe pipe;
+    if (evented) {
+      auto ready = reactor.wait();
+      if (ready & SvcWakeConnection) svcConnectionSignal.clear();
+      if (ready & SvcWakeAccept) pipe = svcListener->accept(0);
+    } else {
+      pipe = svcListener->accept(SVC_POLL_MS);
+    }
+    if (pipe) {
+      svcActiveClients++;
+      auto &c = connections.emplace_back();
+      c.thread = std::thread([pipe, &c, id = ++connectionCount]() {
+        connectionWorker(pipe, id);
+        c.done = true;
+        svcConnectionSignal.set();
+      });
+    }
+
+    for (auto it = connections.begin(); it != connections.end();) {
+      if (it->done) {
+        it->thread.join();
+        it = connections.erase(it);
+      } else {
+        it++;
+      }
+    }
 
-    if (stopService) {
+    if (connectionCount && connections.empty()) {
       break;
     }
   }
 
-  svcPipe = nullptr;
+  svcStopFlag = true;
+  svcStopSignal.set();
+  svcListener->close();
+  for (auto &c : connections) {
+    c.thread.join();
+  }
+  svcListener = nullptr;
   svcExitFlag = true;
 
+  auto poolStats = BufferPool::get().stats();
+  LOG_INFO << "[AV] Buffer pool: hits=" << poolStats.hits << " misses=" << poolStats.misses <<
+              " resident=" << poolStats.bytesResident << " pooled=" << poolStats.bytesPooled;
   LOG_DEBUG << "[AV] Exit service.";
 }
 
@@ -269,9 +1143,19 @@ bool startService(const std::string &instanceId) {
     return false;
   }
 
+  {
+    std::lock_guard<std::mutex> lock(svcStartMutex);
+    svcStarted = false;
+    svcReady = false;
+  }
   svcThread = std::thread(svcWorker, instanceId);
-  std::this_thread::sleep_for(std::chrono::milliseconds(500));
-  return !svcExitFlag;
+
+  std::unique_lock<std::mutex> lock(svcStartMutex);
+  if (!svcStartCond.wait_for(lock, std::chrono::milliseconds(SVC_START_TIMEOUT_MS), []() { return svcStarted; })) {
+    LOG_ERROR << "[AV] Service did not start in " << SVC_START_TIMEOUT_MS << " ms";
+    return false;
+  }
+  return svcReady;
 }
 
 void waitServiceToExit() {
@@ -280,4 +1164,4 @@ void waitServiceToExit() {
     svcThread.join();
   }
   LOG_INFO << "Done";
-}
\ No newline at end of file
+}
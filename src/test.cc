@@ -1,7 +1,68 @@
 #include "common.h"
+#include "pixconv.h"
 
+// Writes the elementary stream of a GetPacket payload, logging packet
+// metadata when the session returns AVPacketInfo records.
+static void writePackets(FILE *dumpFile, const SingleArray &payload, bool packetInfo) {
+  if (!dumpFile) {
+    return;
+  }
+  if (!packetInfo) {
+    fwrite(payload.data(), 1, payload.size(), dumpFile);
+    return;
+  }
+
+  size_t offset = 0;
+  AVPacketInfo info;
+  const uint8_t *data;
+  while (nextPacket(payload, offset, info, &data)) {
+    LOG_INFO << "Packet stream=" << info.stream << " pts=" << info.pts << " dts=" << info.dts << " size=" << info.size <<
+                ((info.flags & AVPacketFlagKey) ? " key" : "");
+    // ladder sessions: only the first rendition goes to the file
+    if (!info.stream) fwrite(data, 1, info.size, dumpFile);
+  }
+}
 
-bool runEncodeTest(bool &isHEVC, int testWidth, int testHeight, const std::string &testFile) {
+// Writes the segments of a muxed encoder's GetPacket/GetSegment payload.
+static void writeSegments(FILE *dumpFile, const SingleArray &payload) {
+  size_t offset = 0;
+  AVSegmentInfo info;
+  const uint8_t *data;
+  while (nextSegment(payload, offset, info, &data)) {
+    LOG_INFO << "Segment " << info.sequence << " pts=" << info.pts << " duration=" << info.duration << " size=" <<
+                info.size << ((info.flags & AVSegmentFlagInit) ? " init" : "");
+    if (dumpFile) fwrite(data, 1, info.size, dumpFile);
+  }
+}
+
+// Writes pipelined packets to the dump file until the request 'untilId'
+// completes, or until no reply is pending when 'untilId' is 0.
+static bool drainPipeline(AVPipeline &pipeline, FILE *dumpFile, bool packetInfo, uint32_t untilId) {
+  AVPipeline::Reply r;
+  while (pipeline.poll(r, untilId ? 5000 : 0)) {
+    bool output = r.reply.type == AVCmdType::GetPacket || r.reply.type == AVCmdType::GetSinkStatus ||
+                  r.reply.type == AVCmdType::GetSegment;
+    if (r.reply.type == AVCmdType::GetPacket) {
+      writePackets(dumpFile, r.payload, packetInfo);
+    } else if (r.reply.type == AVCmdType::GetSegment) {
+      writeSegments(dumpFile, r.payload);
+    } else if (r.reply.type == AVCmdType::GetSinkStatus && r.payload.size() == sizeof(AVSinkStatus)) {
+      AVSinkStatus status;
+      memcpy(&status, r.payload.data(), sizeof(status));
+      LOG_DEBUG << "[ENC] Sink bytes=" << status.bytes << " written=" << status.written;
+    } else if (r.reply.result != AVCmdResult::Ack) {
+      LOG_ERROR << "[ENC] Request " << r.reply.requestId << " got NACK response";
+    }
+    if (untilId && r.reply.requestId == untilId && !output) {
+      return true;
+    }
+  }
+  return !untilId;
+}
+
+bool runEncodeTest(bool &isHEVC, int testWidth, int testHeight, int window, AVRawFormat format,
+                   const AVEncodeParams &params, bool reconfigure, bool packetInfo, const AVSinkInfo &sink,
+                   const std::string &testFile) {
   int width  = testWidth;
   int height = testHeight;
   int fps = 30;
@@ -14,36 +75,69 @@ bool runEncodeTest(bool &isHEVC, int testWidth, int testHeight, const std::strin
 
   SingleArray packetData;
   SingleArray frameData(3 * width * height / 2);
+  // the pattern is drawn in I420 and sent in the requested format
+  SingleArray inputData(rawFrameSize(format, width, height));
+  auto convert = getPixelConverter(AVRawFormat::I420, format);
+  if (!convert) {
+    closeService(pipe);
+    return false;
+  }
 
   AVCmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
   cmd.type = AVCmdType::OpenEncoder;
   cmd.init.width    = width;
   cmd.init.height   = height;
   cmd.init.fps      = fps;
   cmd.init.bps      = bps;
+  cmd.init.format   = format;
+  if (packetInfo) cmd.init.flags = AVInitFlagPacketInfo | AVInitFlagClientPts;
 
   // try open hevc
   if (isHEVC) strcpy(cmd.init.codecName, "hevc");
   else strcpy(cmd.init.codecName, "h264");
-  if (sendAVCmd(pipe, cmd) != AVCmdResult::Ack) {
+  if (sendOpenCmd(pipe, cmd, params) != AVCmdResult::Ack) {
     isHEVC = false;
     // try open h264
     strcpy(cmd.init.codecName, "h264");
-    if (sendAVCmd(pipe, cmd) != AVCmdResult::Ack) {
+    if (sendOpenCmd(pipe, cmd, params) != AVCmdResult::Ack) {
       LOG_ERROR << "[ENC] Enc service init failed";
       closeService(pipe);
       return false;
     }
   }
 
-  FILE *dumpFile = fopen(testFile.c_str(), "wb");
-  if (!dumpFile) {
+  // a sink has the service write the file, GetPacket then stays empty
+  FILE *dumpFile = nullptr;
+  if (sink.type != AVSinkType::None) {
+    if (setSink(pipe, sink, testFile) != AVCmdResult::Ack) {
+      LOG_ERROR << "[ENC] Failed to set sink " << testFile;
+      closeService(pipe);
+      return false;
+    }
+  } else if (!(dumpFile = fopen(testFile.c_str(), "wb"))) {
     LOG_ERROR << "[ENC] Failed to open test.mp4";
     closeService(pipe);
     return false;
   }
 
+  AVPipeline pipeline(pipe);
+  if (window && !pipeline.start(window)) {
+    LOG_ERROR << "[ENC] Failed to enable pipelined requests";
+    closeService(pipe);
+    return false;
+  }
+
   for (int i = 0; i < 120; i++) {
+    // halve the bitrate, then request an IDR, without reopening the session
+    if (reconfigure && (i == 40 || i == 60)) {
+      AVCmd ctrl;
+      memset(&ctrl, 0, sizeof(ctrl));
+      ctrl.type = (i == 40) ? AVCmdType::SetBitrate : AVCmdType::ForceKeyframe;
+      ctrl.rate.bps = bps / 2;
+      if (window) pipeline.submit(ctrl);
+      else if (sendAVCmd(pipe, ctrl) != AVCmdResult::Ack) LOG_ERROR << "[ENC] Reconfigure command got NACK response";
+    }
 
     auto startTs = std::chrono::system_clock::now();
     int stride = width;
@@ -64,15 +158,26 @@ bool runEncodeTest(bool &isHEVC, int testWidth, int testHeight, const std::strin
       }
     }
 
+    convert(rawFramePlanes(AVRawFormat::I420, frameData.data(), width, height),
+            rawFramePlanes(format, inputData.data(), width, height), width, height);
+
     auto startTs1 = std::chrono::system_clock::now();
 
     // Send data for encoding
     cmd.type = AVCmdType::Encode;
-    cmd.size = frameData.size();
+    cmd.payload.size = inputData.size();
+    cmd.payload.pts = i;
+    if (window) {
+      if (!pipeline.submit(cmd, inputData.data(), inputData.size())) {
+        LOG_ERROR << "[ENC] Encode request " << i << " failed";
+      }
+      drainPipeline(pipeline, dumpFile, packetInfo, 0);
+      continue;
+    }
     if (sendAVCmd(pipe, cmd) != AVCmdResult::Ack) {
       LOG_ERROR << "[ENC] Encode command got NACK response";
     }
-    if (pipe->write(frameData.data(), frameData.size()) != frameData.size()) {
+    if (pipe->writePayload(inputData.data(), inputData.size()) != inputData.size()) {
       LOG_ERROR << "[ENC] Encode command failed to send frame data";
     }
     if (readAVCmdResult(pipe) != AVCmdResult::Ack) {
@@ -86,11 +191,19 @@ bool runEncodeTest(bool &isHEVC, int testWidth, int testHeight, const std::strin
                   ", Time for encode: " << std::chrono::duration<float>(endTs - startTs1).count() << 
                   ", Packet size = " << packetData.size();
 
-      fwrite(packetData.data(), 1, packetData.size(), dumpFile);
+      if (params.container != AVContainer::None) writeSegments(dumpFile, packetData);
+      else writePackets(dumpFile, packetData, packetInfo);
     }
   }
 
-  {
+  if (window) {
+    cmd.type = AVCmdType::Flush;
+    auto flushId = pipeline.submit(cmd);
+    if (!flushId || !drainPipeline(pipeline, dumpFile, packetInfo, flushId)) {
+      LOG_ERROR << "[ENC] Encode flush request failed";
+    }
+    pipeline.stop();
+  } else {
     if (sendAVCmd(pipe, AVCmdType::Flush) != AVCmdResult::Ack) {
       LOG_ERROR << "[ENC] Encode flush command got NACK response";
     }
@@ -99,20 +212,49 @@ bool runEncodeTest(bool &isHEVC, int testWidth, int testHeight, const std::strin
       // Get encoded data
       if (getPacket(pipe, packetData) == AVCmdResult::Ack) {
         LOG_INFO << "Writing flush packet";
-        fwrite(packetData.data(), 1, packetData.size(), dumpFile);
+        if (params.container != AVContainer::None) writeSegments(dumpFile, packetData);
+        else writePackets(dumpFile, packetData, packetInfo);
       } else {
         break;
       }
     }
   }
 
-  fclose(dumpFile);
+  if (dumpFile) {
+    fclose(dumpFile);
+  }
+  AVSinkStatus status;
+  if (sink.type != AVSinkType::None && getSinkStatus(pipe, status) == AVCmdResult::Ack) {
+    LOG_INFO << "[ENC] Sink wrote " << status.written << " of " << status.bytes << " bytes, error " << status.error;
+  }
+  AVServiceStats stats;
+  if (getStats(pipe, stats) == AVCmdResult::Ack) {
+    static const char *stages[] = { "socket read", "codec send", "codec receive", "convert", "socket write" };
+    for (int i = 0; i < (int)AVStatLatency::Count; i++) {
+      auto &l = stats.latency[i];
+      LOG_INFO << "[ENC] " << stages[i] << ": count=" << l.count << " p50=" << l.p50Ns / 1000 << "us p99=" <<
+                  l.p99Ns / 1000 << "us max=" << l.maxNs / 1000 << "us";
+    }
+  }
 
   return closeService(pipe);
 }
 
 
-bool runDecodeTest(bool isHEVC, int testWidth, int testHeight, const std::string &testFile) {
+// Writes the visible part of each plane, dropping the decoder's line padding.
+static void dumpFramePlanes(FILE *fp, const AVFramePlanes &desc, const uint8_t *payload) {
+  for (int i = 0; i < desc.planes; i++) {
+    int width  = (i == 1 || i == 2) ? (desc.width + 1) / 2 : desc.width;
+    int height = desc.size[i] / desc.linesize[i];
+    auto plane = payload + desc.offset[i];
+    for (int y = 0; y < height; y++) {
+      fwrite(plane + (size_t)y * desc.linesize[i], 1, width, fp);
+    }
+  }
+}
+
+bool runDecodeTest(bool isHEVC, int testWidth, int testHeight, bool frameRefs, bool demux, AVRawFormat format,
+                   const AVEncodeParams &params, const std::string &testFile) {
   FILE *dumpFile = fopen(testFile.c_str(), "rb");
   if (!dumpFile) {
     LOG_ERROR << "[DEC] Failed to open test.mp4";
@@ -131,19 +273,60 @@ bool runDecodeTest(bool isHEVC, int testWidth, int testHeight, const std::string
   SingleArray frameData;
 
   AVCmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
   cmd.type = AVCmdType::OpenDecoder;
   cmd.init.width    = width;
   cmd.init.height   = height;
-
-  if (isHEVC) strcpy(cmd.init.codecName, "hevc");
+  if (frameRefs) cmd.init.flags = AVInitFlagFrameRefs;
+  cmd.init.format = format;
+
+  // the service reads the file itself, picking the decoder from its stream
+  AVEncodeParams decodeParams = params;
+  if (demux) {
+    cmd.init.flags |= AVInitFlagFileInput;
+    decodeParams.sourcePath = testFile;
+  } else if (isHEVC) strcpy(cmd.init.codecName, "hevc");
   else strcpy(cmd.init.codecName, "h264");
-  if (sendAVCmd(pipe, cmd) != AVCmdResult::Ack) {
+  if (sendOpenCmd(pipe, cmd, decodeParams, nullptr) != AVCmdResult::Ack) {
     LOG_ERROR << "[DEC] Service init failed";
     return false;
   }
 
   int frameId = 0;
-  while (!feof(dumpFile)) {
+  auto saveFrame = [&]() {
+    AVFramePlanes desc;
+    const uint8_t *payload = nullptr;
+    if (frameRefs) {
+      if (getFrameRef(pipe, desc, &payload) != AVCmdResult::Ack) {
+        return false;
+      }
+    } else if (getFrame(pipe, frameData) != AVCmdResult::Ack) {
+      return false;
+    }
+    LOG_INFO << "Decoded frame " << frameId;
+
+    std::string name = std::string("frame") + std::to_string(frameId++) + ".raw";
+    FILE *fp = fopen(name.c_str(), "wb");
+    if (frameRefs) {
+      dumpFramePlanes(fp, desc, payload);
+      releaseFrame(pipe, desc.frameId);
+    } else {
+      fwrite(frameData.data(), 1, frameData.size(), fp);
+    }
+    fclose(fp);
+    return true;
+  };
+
+  while (demux) {
+    cmd.type = AVCmdType::Decode;
+    cmd.size = 0;
+    if (sendAVCmd(pipe, cmd) != AVCmdResult::Ack || readAVCmdResult(pipe) != AVCmdResult::Ack) {
+      break;
+    }
+    while (saveFrame());
+  }
+
+  while (!demux && !feof(dumpFile)) {
     cmd.size = fread(packetData.data(), 1, packetData.size(), dumpFile);
     if (cmd.size) {
       // Send data for decoding
@@ -151,7 +334,7 @@ bool runDecodeTest(bool isHEVC, int testWidth, int testHeight, const std::string
       if (sendAVCmd(pipe, cmd) != AVCmdResult::Ack) {
         LOG_ERROR << "[DEC] Decode command got NACK response";
       }
-      if (pipe->write(packetData.data(), cmd.size) != cmd.size) {
+      if (pipe->writePayload(packetData.data(), cmd.size) != cmd.size) {
         LOG_ERROR << "[DEC] Decode command failed to send packet data";
       }
       if (readAVCmdResult(pipe) != AVCmdResult::Ack) {
@@ -160,33 +343,90 @@ bool runDecodeTest(bool isHEVC, int testWidth, int testHeight, const std::string
     }
 
     // Get decoded data
-    while (1) {
-      if (getFrame(pipe, frameData) != AVCmdResult::Ack) {
-        break;
-      }
-      LOG_INFO << "Decoded frame " << frameId;
-
-      std::string name = std::string("frame") + std::to_string(frameId++) + ".raw";
-      FILE *fp = fopen(name.c_str(), "wb");
-      fwrite(frameData.data(), 1, frameData.size(), fp);
-      fclose(fp);
-    }
+    while (saveFrame());
   }
   fclose(dumpFile);
 
   while (1) {
     sendAVCmd(pipe, AVCmdType::Flush);
-    if (getFrame(pipe, frameData) != AVCmdResult::Ack) {
+    if (!saveFrame()) {
       break;
     }
-    LOG_INFO << "Decoded frame " << frameId;
+  }
 
-    std::string name = std::string("frame") + std::to_string(frameId++) + ".raw";
-    FILE *fp = fopen(name.c_str(), "wb");
-    fwrite(frameData.data(), 1, frameData.size(), fp);
-    fclose(fp);
+  return closeService(pipe);
+}
+
+// Re-encodes the elementary stream in 'testFile' to H.264 at outWidth x
+// outHeight inside the service, writing testFile + ".transcoded".
+bool runTranscodeTest(bool isHEVC, int testWidth, int testHeight, int outWidth, int outHeight,
+                      const AVEncodeParams &params, const std::string &testFile) {
+  FILE *inputFile = fopen(testFile.c_str(), "rb");
+  if (!inputFile) {
+    LOG_ERROR << "[TRC] Failed to open " << testFile;
+    return false;
+  }
+  FILE *dumpFile = fopen((testFile + ".transcoded").c_str(), "wb");
+  if (!dumpFile) {
+    LOG_ERROR << "[TRC] Failed to open " << testFile << ".transcoded";
+    fclose(inputFile);
+    return false;
+  }
+  auto pipe = openService("test");
+  if (!pipe) {
+    fclose(inputFile);
+    fclose(dumpFile);
+    return false;
   }
 
+  AVEncodeParams trcParams = params;
+  trcParams.sourceCodec  = isHEVC ? "hevc" : "h264";
+  trcParams.sourceWidth  = testWidth;
+  trcParams.sourceHeight = testHeight;
+
+  AVCmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.type = AVCmdType::OpenTranscoder;
+  cmd.init.width  = outWidth;
+  cmd.init.height = outHeight;
+  cmd.init.fps    = 30;
+  cmd.init.bps    = 2000000;
+  strcpy(cmd.init.codecName, "h264");
+  if (sendOpenCmd(pipe, cmd, trcParams) != AVCmdResult::Ack) {
+    LOG_ERROR << "[TRC] Service init failed";
+    fclose(inputFile);
+    fclose(dumpFile);
+    closeService(pipe);
+    return false;
+  }
+
+  SingleArray packetData(16 * 1024);
+  SingleArray outputData;
+  auto savePackets = [&]() {
+    while (getPacket(pipe, outputData) == AVCmdResult::Ack) {
+      fwrite(outputData.data(), 1, outputData.size(), dumpFile);
+    }
+  };
+
+  while (!feof(inputFile)) {
+    cmd.type = AVCmdType::Decode;
+    cmd.payload.size = fread(packetData.data(), 1, packetData.size(), inputFile);
+    cmd.payload.pts = 0;
+    if (!cmd.payload.size) {
+      continue;
+    }
+    if (sendAVCmd(pipe, cmd) != AVCmdResult::Ack ||
+        pipe->writePayload(packetData.data(), cmd.payload.size) != cmd.payload.size ||
+        readAVCmdResult(pipe) != AVCmdResult::Ack) {
+      LOG_ERROR << "[TRC] Transcode command failed";
+    }
+    savePackets();
+  }
+
+  sendAVCmd(pipe, AVCmdType::Flush);
+  savePackets();
+  fclose(inputFile);
+  fclose(dumpFile);
   return closeService(pipe);
 }
 
@@ -196,15 +436,57 @@ int main(int argc, char **argv) {
   dumpLog = true;
 
   bool isHEVC = false;
-  bool testDec = false, testEnc = false;
+  bool frameRefs = false;
+  bool demux = false;
+  bool testDec = false, testEnc = false, testTrc = false;
   int testWidth = 1920, testHeight = 1080;
+  int outWidth = 0, outHeight = 0;
+  int window = 0;
   std::string testFile;
+  std::string formatName = "i420";
+  AVEncodeParams params;
+  std::vector<std::string> options;
+  bool reconfigure = false;
+  bool packetInfo = false;
+  std::string profileName;
+  bool keyframesOnly = false;
+  int ladder = 0;
+  bool sinkFile = false, sinkDirect = false;
+  std::string containerName;
+  AVSinkInfo sink = {};
   app.add_flag  ("-d", testDec, "Run a decoder test");
   app.add_option("-f", testFile, "Test file if decoder test is ran");
   app.add_flag  ("-e", testEnc, "Run an encoder test");
+  app.add_flag  ("-t", testTrc, "Run a transcode test, re-encoding the -f stream to H.264");
+  app.add_option("--out-width", outWidth, "Transcode test output width. Default half the width");
+  app.add_option("--out-height", outHeight, "Transcode test output height. Default half the height");
   app.add_option("--width", testWidth, "Test width for encoder test. Default 1920")->check(CLI::PositiveNumber);
   app.add_option("--height", testHeight, "Test height for encoder test. Default 1080")->check(CLI::PositiveNumber);
   app.add_flag("--hevc", isHEVC, "Use HEVC");
+  app.add_option("--window", window, "Encode requests kept in flight. Default 0 (lock-step)");
+  app.add_option("--format", formatName, "Raw picture format: i420, nv12, bgra or rgba. Default i420");
+  app.add_option("--preset", params.preset, "Encoder preset");
+  app.add_option("--tune", params.tune, "Encoder tune, e.g. zerolatency");
+  app.add_option("--threads", params.threadCount, "Encoder/decoder threads. Default 0 (auto)");
+  app.add_option("--gop", params.gop, "Keyframe interval");
+  app.add_option("--crf", params.crf, "Constant quality instead of the target bitrate");
+  app.add_option("--opt", options, "Encoder option as key=value, may be repeated");
+  app.add_flag("--reconfigure", reconfigure, "Change bitrate and force a keyframe during the encoder test");
+  app.add_option("--ladder", ladder, "Encoder test encodes N renditions, halving the size for each")->check(CLI::Range(0, AV_MAX_RENDITIONS));
+  app.add_option("--chunk-frames", params.chunkFrames, "Encoder test encodes closed-GOP chunks of N frames in parallel");
+  app.add_option("--chunk-encoders", params.chunkEncoders, "Parallel encoders of --chunk-frames. Default 0 (by core count)");
+  app.add_flag("--sink", sinkFile, "Encoder test has the service write -f itself");
+  app.add_flag("--sink-direct", sinkDirect, "Sink writes bypass the page cache");
+  app.add_option("--sink-batch", sink.batchSize, "Sink bytes gathered per write. Default 0 (every packet)");
+  app.add_option("--container", containerName, "Encoder test muxes into fmp4 or ts segments");
+  app.add_option("--segment-ms", params.segmentMs, "Muxed segment length in ms, cut at the next keyframe");
+  app.add_flag("--packet-info", packetInfo, "Encoder test reads packets with pts/dts/keyframe records");
+  app.add_option("--decode-profile", profileName, "Decoder profile: throughput, low-latency or fast");
+  app.add_flag("--keyframes-only", keyframesOnly, "Decoder test outputs keyframes only");
+  app.add_option("--downscale", params.downscale, "Decoder test output divided by 2^N, 0-3");
+  app.add_flag("--demux", demux, "Decoder test has the service map and demux -f, e.g. an MP4 file");
+  app.add_flag("--frame-refs", frameRefs, "Decoder test reads frames as plane descriptors");
+  app.add_flag("--shm", useSharedMemory, "Transfer frames and packets through shared memory");
 
   static plog::ColorConsoleAppender<plog::TxtFormatter> consoleAppender;
   plog::init(plog::debug, &consoleAppender);
@@ -216,12 +498,57 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if (!testDec && !testEnc) {
+  if (!testDec && !testEnc && !testTrc) {
     LOG_ERROR << app.help().c_str();
     return 1;
   }
 
-  if ((testDec || testEnc) && testFile.empty()) {
+  AVRawFormat format = AVRawFormat::I420;
+  for (auto f : { AVRawFormat::I420, AVRawFormat::NV12, AVRawFormat::BGRA, AVRawFormat::RGBA }) {
+    if (formatName == rawFormatName(f)) format = f;
+  }
+  if (formatName != rawFormatName(format)) {
+    LOG_ERROR << "Unknown format " << formatName << ". See --help.";
+    return 1;
+  }
+
+  if (profileName == "throughput") params.decodeProfile = AVDecodeProfile::Throughput;
+  else if (profileName == "low-latency") params.decodeProfile = AVDecodeProfile::LowLatency;
+  else if (profileName == "fast") params.decodeProfile = AVDecodeProfile::Fast;
+  else if (!profileName.empty()) {
+    LOG_ERROR << "Unknown decoder profile " << profileName << ". See --help.";
+    return 1;
+  }
+
+  for (int i = 0; i < ladder; i++) {
+    AVRendition rung;
+    rung.width  = (testWidth >> i) & ~1;
+    rung.height = (testHeight >> i) & ~1;
+    rung.bps    = std::max(1000000, 5000000 >> i);
+    params.renditions.push_back(rung);
+  }
+  if (containerName == "fmp4") params.container = AVContainer::FMP4;
+  else if (containerName == "ts") params.container = AVContainer::MPEGTS;
+  else if (!containerName.empty()) {
+    LOG_ERROR << "Unknown container " << containerName << ". See --help.";
+    return 1;
+  }
+
+  if (ladder) packetInfo = true;
+  if (sinkFile || sinkDirect) sink.type = AVSinkType::File;
+  if (sinkDirect) sink.flags |= AVSinkFlagDirect;
+  if (keyframesOnly) params.skipFrames = AVSkipFrames::NonKey;
+  if (params.crf) params.rateControl = AVRateControl::CRF;
+  for (auto &opt : options) {
+    auto pos = opt.find('=');
+    if (pos == std::string::npos) {
+      LOG_ERROR << "Invalid option " << opt << ". See --help.";
+      return 1;
+    }
+    params.options.emplace_back(opt.substr(0, pos), opt.substr(pos + 1));
+  }
+
+  if ((testDec || testEnc || testTrc) && testFile.empty()) {
     LOG_ERROR << "When running test, specify test file name. See --help.";
     return 1;
   }
@@ -229,7 +556,7 @@ int main(int argc, char **argv) {
 
   if (testEnc) {
     LOG_INFO << "[AVTest] Starting encode test";
-    if (!runEncodeTest(isHEVC, testWidth, testHeight, testFile)) {
+    if (!runEncodeTest(isHEVC, testWidth, testHeight, window, format, params, reconfigure, packetInfo, sink, testFile)) {
       LOG_ERROR << "Encode test failed";
       return 2;
     }
@@ -241,11 +568,21 @@ int main(int argc, char **argv) {
 
   if (testDec) {
     LOG_INFO << "[AVTest] Starting decode test";
-    if (!runDecodeTest(isHEVC, testWidth, testHeight, testFile)) {
+    if (!runDecodeTest(isHEVC, testWidth, testHeight, frameRefs, demux, format, params, testFile)) {
       LOG_ERROR << "Decode test failed";
       return 2;
     }
   }
 
+  if (testTrc) {
+    LOG_INFO << "[AVTest] Starting transcode test";
+    if (!outWidth) outWidth = (testWidth / 2) & ~1;
+    if (!outHeight) outHeight = (testHeight / 2) & ~1;
+    if (!runTranscodeTest(isHEVC, testWidth, testHeight, outWidth, outHeight, params, testFile)) {
+      LOG_ERROR << "Transcode test failed";
+      return 2;
+    }
+  }
+
   return 0;
 }
\ No newline at end of file